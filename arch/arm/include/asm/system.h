@@ -509,6 +509,37 @@ static inline unsigned long long __cmpxchg64_mb(volatile void *ptr,
 					 (unsigned long long)(o),	\
 					 (unsigned long long)(n)))
 
+/*
+ * Compare and exchange two adjacent words with a single ldrexd/strexd
+ * pair. p1 must be 8 byte aligned and p2 must be p1 + 1. The union
+ * keeps the first word at the lower address whatever the endianness.
+ * No barriers: only atomic against interrupts and this cpu's accesses.
+ */
+union __cmpxchg_double {
+	unsigned long w[2];
+	unsigned long long v;
+};
+
+static inline int __cmpxchg_double_local(volatile void *ptr,
+					 unsigned long o1, unsigned long o2,
+					 unsigned long n1, unsigned long n2)
+{
+	union __cmpxchg_double old = { .w = { o1, o2 } };
+	union __cmpxchg_double new = { .w = { n1, n2 } };
+
+	return __cmpxchg64(ptr, old.v, new.v) == old.v;
+}
+
+#define cmpxchg_double_local(p1, p2, o1, o2, n1, n2)			\
+({									\
+	BUILD_BUG_ON(sizeof(*(p1)) != sizeof(long));			\
+	BUILD_BUG_ON(sizeof(*(p2)) != sizeof(long));			\
+	__cmpxchg_double_local((p1), (unsigned long)(o1),		\
+			       (unsigned long)(o2),			\
+			       (unsigned long)(n1),			\
+			       (unsigned long)(n2));			\
+})
+
 #else	/* !CONFIG_CPU_32v6K */
 
 #define cmpxchg64_local(ptr, o, n) __cmpxchg64_local_generic((ptr), (o), (n))
@@ -0,0 +1,640 @@
+/*
+ *  Flash i/o scheduler.
+ *
+ *  Based on the deadline i/o scheduler, Copyright (C) 2002 Jens Axboe.
+ *
+ *  Tuned for eMMC/SD, where seeks are free but writes are slow and may
+ *  stall the card: reads are served first and in arrival order, writes
+ *  go out in sector-sorted batches that start at an erase block
+ *  boundary and are bounded in time rather than in count, and the
+ *  ioprio class of the submitting task picks which queue is served.
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/rbtree.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
+
+/*
+ * See Documentation/block/flash-iosched.txt
+ */
+static const int read_expire = HZ / 8;	/* reads are served in fifo order */
+static const int write_expire = HZ;	/* oldest write before it preempts reads */
+static const int write_budget = HZ / 50; /* time for a write batch while reads wait */
+static const int writes_starved = 4;	/* max reads dispatched ahead of writes */
+static const int erase_block = 1024;	/* write batch alignment, in sectors */
+
+/* ioprio classes, in the order they are served */
+enum {
+	FLASH_RT = 0,
+	FLASH_BE,
+	FLASH_IDLE,
+	FLASH_CLASSES,
+};
+
+/* fifo lists within a class */
+enum {
+	FLASH_READ = 0,
+	FLASH_SYNC_WRITE,
+	FLASH_ASYNC_WRITE,
+	FLASH_KINDS,
+};
+
+struct flash_data {
+	/*
+	 * run time data
+	 */
+
+	/*
+	 * requests are present on both sort_list and fifo_list of their
+	 * class
+	 */
+	struct rb_root sort_list[FLASH_CLASSES][2];
+	struct list_head fifo_list[FLASH_CLASSES][FLASH_KINDS];
+	unsigned int queued[FLASH_CLASSES];
+
+	/*
+	 * write batch in progress: next write in sort order, when it
+	 * started and the erase block of the last write dispatched
+	 */
+	struct request *next_write;
+	unsigned long batch_start;
+	sector_t last_block;
+	unsigned int starved;		/* reads dispatched while writes wait */
+
+	/*
+	 * settings that change how the i/o scheduler behaves
+	 */
+	int fifo_expire[2];
+	int write_budget;
+	int writes_starved;
+	int erase_block;
+	int front_merges;
+};
+
+static inline int flash_rq_class(struct request *rq)
+{
+	return (unsigned long)rq->elevator_private2;
+}
+
+static inline int flash_rq_kind(struct request *rq)
+{
+	if (rq_data_dir(rq) == READ)
+		return FLASH_READ;
+	return rq_is_sync(rq) ? FLASH_SYNC_WRITE : FLASH_ASYNC_WRITE;
+}
+
+static inline struct rb_root *
+flash_rb_root(struct flash_data *fd, struct request *rq)
+{
+	return &fd->sort_list[flash_rq_class(rq)][rq_data_dir(rq)];
+}
+
+/*
+ * get the request after `rq' in sector-sorted order
+ */
+static inline struct request *
+flash_latter_request(struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+static inline struct request *
+flash_former_request(struct request *rq)
+{
+	struct rb_node *node = rb_prev(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+/*
+ * first sector of the erase block holding `sector'
+ */
+static inline sector_t flash_block(struct flash_data *fd, sector_t sector)
+{
+	sector_t block = sector;
+
+	if (!fd->erase_block)
+		return sector;
+
+	return sector - sector_div(block, fd->erase_block);
+}
+
+/*
+ * Note the ioprio class of the submitting task. Requests that carry
+ * their own ioprio (from the bio) override it in flash_add_request.
+ */
+static int
+flash_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
+{
+	struct io_context *ioc = current->io_context;
+	int class;
+
+	if (ioc && ioprio_valid(ioc->ioprio))
+		class = IOPRIO_PRIO_CLASS(ioc->ioprio);
+	else
+		class = task_nice_ioclass(current);
+
+	rq->elevator_private = (void *)(unsigned long)class;
+	return 0;
+}
+
+static int flash_ioprio_to_class(int ioprio_class)
+{
+	switch (ioprio_class) {
+	case IOPRIO_CLASS_RT:
+		return FLASH_RT;
+	case IOPRIO_CLASS_IDLE:
+		return FLASH_IDLE;
+	default:
+		return FLASH_BE;
+	}
+}
+
+static void flash_move_request(struct flash_data *, struct request *);
+
+static void
+flash_add_rq_rb(struct flash_data *fd, struct request *rq)
+{
+	struct rb_root *root = flash_rb_root(fd, rq);
+	struct request *__alias;
+
+	while (unlikely(__alias = elv_rb_add(root, rq)))
+		flash_move_request(fd, __alias);
+}
+
+static inline void
+flash_del_rq_rb(struct flash_data *fd, struct request *rq)
+{
+	if (fd->next_write == rq)
+		fd->next_write = flash_latter_request(rq);
+
+	elv_rb_del(flash_rb_root(fd, rq), rq);
+}
+
+/*
+ * add rq to rbtree and fifo of its class
+ */
+static void
+flash_add_request(struct request_queue *q, struct request *rq)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+	const int data_dir = rq_data_dir(rq);
+	int class;
+
+	if (ioprio_valid(rq->ioprio))
+		class = IOPRIO_PRIO_CLASS(rq->ioprio);
+	else
+		class = (unsigned long)rq->elevator_private;
+	class = flash_ioprio_to_class(class);
+	rq->elevator_private2 = (void *)(unsigned long)class;
+
+	flash_add_rq_rb(fd, rq);
+	fd->queued[class]++;
+
+	/*
+	 * set expire time and add to fifo list
+	 */
+	rq_set_fifo_time(rq, jiffies + fd->fifo_expire[data_dir]);
+	list_add_tail(&rq->queuelist,
+		      &fd->fifo_list[class][flash_rq_kind(rq)]);
+}
+
+/*
+ * remove rq from rbtree and fifo.
+ */
+static void flash_remove_request(struct request_queue *q, struct request *rq)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+
+	rq_fifo_clear(rq);
+	flash_del_rq_rb(fd, rq);
+	fd->queued[flash_rq_class(rq)]--;
+}
+
+static int
+flash_merge(struct request_queue *q, struct request **req, struct bio *bio)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+	struct request *__rq;
+	int class;
+
+	/*
+	 * check for front merge, in any class
+	 */
+	if (fd->front_merges) {
+		sector_t sector = bio->bi_sector + bio_sectors(bio);
+
+		for (class = 0; class < FLASH_CLASSES; class++) {
+			__rq = elv_rb_find(
+				&fd->sort_list[class][bio_data_dir(bio)],
+				sector);
+			if (!__rq)
+				continue;
+
+			BUG_ON(sector != blk_rq_pos(__rq));
+
+			if (elv_rq_merge_ok(__rq, bio)) {
+				*req = __rq;
+				return ELEVATOR_FRONT_MERGE;
+			}
+		}
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+
+static void flash_merged_request(struct request_queue *q,
+				 struct request *req, int type)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+
+	/*
+	 * if the merge was a front merge, we need to reposition request
+	 */
+	if (type == ELEVATOR_FRONT_MERGE) {
+		elv_rb_del(flash_rb_root(fd, req), req);
+		flash_add_rq_rb(fd, req);
+	}
+}
+
+static void
+flash_merged_requests(struct request_queue *q, struct request *req,
+		      struct request *next)
+{
+	/*
+	 * if next expires before rq and sits on the same fifo, assign
+	 * its expire time to rq and move into next position (next will
+	 * be deleted) in fifo
+	 */
+	if (!list_empty(&req->queuelist) && !list_empty(&next->queuelist) &&
+	    flash_rq_class(req) == flash_rq_class(next) &&
+	    flash_rq_kind(req) == flash_rq_kind(next)) {
+		if (time_before(rq_fifo_time(next), rq_fifo_time(req))) {
+			list_move(&req->queuelist, &next->queuelist);
+			rq_set_fifo_time(req, rq_fifo_time(next));
+		}
+	}
+
+	/*
+	 * kill knowledge of next, this one is a goner
+	 */
+	flash_remove_request(q, next);
+}
+
+/*
+ * move an entry to dispatch queue
+ */
+static void
+flash_move_request(struct flash_data *fd, struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	if (rq_data_dir(rq) == WRITE) {
+		fd->next_write = flash_latter_request(rq);
+		fd->last_block = flash_block(fd, blk_rq_pos(rq));
+	} else
+		fd->next_write = NULL;
+
+	/*
+	 * take it off the sort and fifo list, move
+	 * to dispatch queue
+	 */
+	flash_remove_request(q, rq);
+	elv_dispatch_add_tail(q, rq);
+}
+
+/*
+ * returns 1 if the oldest request on the fifo has expired
+ */
+static inline int flash_fifo_expired(struct flash_data *fd, int class,
+				     int kind)
+{
+	struct list_head *fifo = &fd->fifo_list[class][kind];
+
+	if (list_empty(fifo))
+		return 0;
+
+	return time_after(jiffies, rq_fifo_time(rq_entry_fifo(fifo->next)));
+}
+
+static inline int flash_reads_waiting(struct flash_data *fd, int class)
+{
+	int i;
+
+	for (i = 0; i <= class; i++)
+		if (!list_empty(&fd->fifo_list[i][FLASH_READ]))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Decide whether the write batch may go on with `rq'. It ends as soon
+ * as any request of a higher class is queued, and once its time budget
+ * is used up while reads of its own class wait, but not in the middle
+ * of an erase block unless it has run for twice its budget.
+ */
+static int flash_batch_continue(struct flash_data *fd, struct request *rq,
+				int force)
+{
+	int class = flash_rq_class(rq);
+	unsigned long end = fd->batch_start + fd->write_budget;
+	int i;
+
+	if (force)
+		return 1;
+
+	for (i = 0; i < class; i++)
+		if (fd->queued[i])
+			return 0;
+
+	if (!flash_reads_waiting(fd, class) || !time_after(jiffies, end))
+		return 1;
+
+	if (flash_block(fd, blk_rq_pos(rq)) == fd->last_block &&
+	    !time_after(jiffies, end + fd->write_budget))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Start a write batch in `class': from the oldest sync write, or an
+ * older expired async one, back to the first write queued in the same
+ * erase block, so the batch runs through the block in sector order.
+ */
+static struct request *flash_start_writes(struct flash_data *fd, int class)
+{
+	struct list_head *sync = &fd->fifo_list[class][FLASH_SYNC_WRITE];
+	struct list_head *async = &fd->fifo_list[class][FLASH_ASYNC_WRITE];
+	struct request *rq, *prev;
+	sector_t block;
+
+	if (list_empty(sync) ||
+	    (flash_fifo_expired(fd, class, FLASH_ASYNC_WRITE) &&
+	     time_before(rq_fifo_time(rq_entry_fifo(async->next)),
+			 rq_fifo_time(rq_entry_fifo(sync->next)))))
+		rq = rq_entry_fifo(async->next);
+	else
+		rq = rq_entry_fifo(sync->next);
+
+	block = flash_block(fd, blk_rq_pos(rq));
+	while ((prev = flash_former_request(rq)) &&
+	       blk_rq_pos(prev) >= block)
+		rq = prev;
+
+	fd->batch_start = jiffies;
+	fd->starved = 0;
+
+	return rq;
+}
+
+/*
+ * pick the next request of `class': reads first, in fifo order, unless
+ * writes have waited too long
+ */
+static struct request *flash_choose_request(struct flash_data *fd, int class)
+{
+	const int reads = !list_empty(&fd->fifo_list[class][FLASH_READ]);
+	const int writes = !list_empty(&fd->fifo_list[class][FLASH_SYNC_WRITE])
+		|| !list_empty(&fd->fifo_list[class][FLASH_ASYNC_WRITE]);
+
+	if (reads) {
+		if (writes &&
+		    (fd->starved >= fd->writes_starved ||
+		     flash_fifo_expired(fd, class, FLASH_SYNC_WRITE) ||
+		     flash_fifo_expired(fd, class, FLASH_ASYNC_WRITE)))
+			return flash_start_writes(fd, class);
+
+		if (writes)
+			fd->starved++;
+
+		return rq_entry_fifo(fd->fifo_list[class][FLASH_READ].next);
+	}
+
+	if (writes)
+		return flash_start_writes(fd, class);
+
+	return NULL;
+}
+
+static int flash_dispatch_requests(struct request_queue *q, int force)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+	struct request *rq = fd->next_write;
+	int class;
+
+	if (rq && flash_batch_continue(fd, rq, force))
+		goto dispatch_request;
+
+	fd->next_write = NULL;
+
+	for (class = 0; class < FLASH_CLASSES; class++) {
+		if (!fd->queued[class])
+			continue;
+
+		rq = flash_choose_request(fd, class);
+		if (rq)
+			goto dispatch_request;
+	}
+
+	return 0;
+
+dispatch_request:
+	flash_move_request(fd, rq);
+
+	return 1;
+}
+
+static int flash_queue_empty(struct request_queue *q)
+{
+	struct flash_data *fd = q->elevator->elevator_data;
+	int class;
+
+	for (class = 0; class < FLASH_CLASSES; class++)
+		if (fd->queued[class])
+			return 0;
+
+	return 1;
+}
+
+static void flash_exit_queue(struct elevator_queue *e)
+{
+	struct flash_data *fd = e->elevator_data;
+	int class;
+
+	for (class = 0; class < FLASH_CLASSES; class++)
+		BUG_ON(fd->queued[class]);
+
+	kfree(fd);
+}
+
+/*
+ * initialize elevator private data (flash_data).
+ */
+static void *flash_init_queue(struct request_queue *q)
+{
+	struct flash_data *fd;
+	int class, kind;
+
+	fd = kmalloc_node(sizeof(*fd), GFP_KERNEL | __GFP_ZERO, q->node);
+	if (!fd)
+		return NULL;
+
+	for (class = 0; class < FLASH_CLASSES; class++) {
+		for (kind = 0; kind < FLASH_KINDS; kind++)
+			INIT_LIST_HEAD(&fd->fifo_list[class][kind]);
+		fd->sort_list[class][READ] = RB_ROOT;
+		fd->sort_list[class][WRITE] = RB_ROOT;
+	}
+	fd->fifo_expire[READ] = read_expire;
+	fd->fifo_expire[WRITE] = write_expire;
+	fd->write_budget = write_budget;
+	fd->writes_starved = writes_starved;
+	fd->erase_block = erase_block;
+	fd->front_merges = 1;
+	return fd;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+flash_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+flash_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct flash_data *fd = e->elevator_data;			\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return flash_var_show(__data, (page));				\
+}
+SHOW_FUNCTION(flash_read_expire_show, fd->fifo_expire[READ], 1);
+SHOW_FUNCTION(flash_write_expire_show, fd->fifo_expire[WRITE], 1);
+SHOW_FUNCTION(flash_write_budget_show, fd->write_budget, 1);
+SHOW_FUNCTION(flash_writes_starved_show, fd->writes_starved, 0);
+SHOW_FUNCTION(flash_erase_block_kb_show, fd->erase_block / 2, 0);
+SHOW_FUNCTION(flash_front_merges_show, fd->front_merges, 0);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct flash_data *fd = e->elevator_data;			\
+	int __data;							\
+	int ret = flash_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(flash_read_expire_store, &fd->fifo_expire[READ], 0, INT_MAX, 1);
+STORE_FUNCTION(flash_write_expire_store, &fd->fifo_expire[WRITE], 0, INT_MAX, 1);
+STORE_FUNCTION(flash_write_budget_store, &fd->write_budget, 0, INT_MAX, 1);
+STORE_FUNCTION(flash_writes_starved_store, &fd->writes_starved, 0, INT_MAX, 0);
+STORE_FUNCTION(flash_front_merges_store, &fd->front_merges, 0, 1, 0);
+#undef STORE_FUNCTION
+
+static ssize_t
+flash_erase_block_kb_store(struct elevator_queue *e, const char *page,
+			   size_t count)
+{
+	struct flash_data *fd = e->elevator_data;
+	int __data;
+	int ret = flash_var_store(&__data, (page), count);
+
+	if (__data < 0)
+		__data = 0;
+	else if (__data > INT_MAX / 2)
+		__data = INT_MAX / 2;
+	fd->erase_block = __data * 2;
+	return ret;
+}
+
+#define FD_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, flash_##name##_show, \
+				      flash_##name##_store)
+
+static struct elv_fs_entry flash_attrs[] = {
+	FD_ATTR(read_expire),
+	FD_ATTR(write_expire),
+	FD_ATTR(write_budget),
+	FD_ATTR(writes_starved),
+	FD_ATTR(erase_block_kb),
+	FD_ATTR(front_merges),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_flash = {
+	.ops = {
+		.elevator_merge_fn = 		flash_merge,
+		.elevator_merged_fn =		flash_merged_request,
+		.elevator_merge_req_fn =	flash_merged_requests,
+		.elevator_dispatch_fn =		flash_dispatch_requests,
+		.elevator_add_req_fn =		flash_add_request,
+		.elevator_queue_empty_fn =	flash_queue_empty,
+		.elevator_former_req_fn =	elv_rb_former_request,
+		.elevator_latter_req_fn =	elv_rb_latter_request,
+		.elevator_set_req_fn =		flash_set_request,
+		.elevator_init_fn =		flash_init_queue,
+		.elevator_exit_fn =		flash_exit_queue,
+	},
+
+	.elevator_attrs = flash_attrs,
+	.elevator_name = "flash",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init flash_init(void)
+{
+	elv_register(&iosched_flash);
+
+	return 0;
+}
+
+static void __exit flash_exit(void)
+{
+	elv_unregister(&iosched_flash);
+}
+
+module_init(flash_init);
+module_exit(flash_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("flash IO scheduler");
@@ -141,11 +141,13 @@ static const struct block_device_operations mmc_bdops = {
 	.owner			= THIS_MODULE,
 };
 
-struct mmc_blk_request {
-	struct mmc_request	mrq;
-	struct mmc_command	cmd;
-	struct mmc_command	stop;
-	struct mmc_data		data;
+enum mmc_blk_status {
+	MMC_BLK_SUCCESS = 0,
+	MMC_BLK_PARTIAL,
+	MMC_BLK_RETRY_SINGLE,
+	MMC_BLK_DATA_ERR,
+	MMC_BLK_CMD_ERR,
+	MMC_BLK_PACKED_ERR,
 };
 
 static u32 mmc_sd_num_wr_blocks(struct mmc_card *card)
@@ -265,210 +267,500 @@ mmc_blk_set_blksize(struct mmc_blk_data *md, struct mmc_card *card)
 }
 
 
-static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+/*
+ * Called by mmc_start_req() once the request has completed, before the
+ * next request is started.
+ */
+static int mmc_blk_err_check(struct mmc_card *card,
+			     struct mmc_async_req *areq)
 {
-	struct mmc_blk_data *md = mq->data;
-	struct mmc_card *card = md->queue.card;
-	struct mmc_blk_request brq;
-	int ret = 1, disable_multi = 0;
+	struct mmc_queue_req *mq_mrq = container_of(areq, struct mmc_queue_req,
+						    mmc_active);
+	struct mmc_blk_request *brq = &mq_mrq->brq;
+	struct request *req = mq_mrq->req;
+	struct mmc_command cmd;
+	u32 status = 0;
 
-#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
-	if (mmc_bus_needs_resume(card->host)) {
-		mmc_resume_bus(card->host);
-		mmc_blk_set_blksize(md, card);
+	/*
+	 * Check for errors here, but don't jump to cmd_err
+	 * until later as we need to wait for the card to leave
+	 * programming mode even when things go wrong.
+	 */
+	if (brq->cmd.error || brq->data.error || brq->stop.error) {
+		if (brq->data.blocks > 1 && rq_data_dir(req) == READ) {
+			/* Redo read one sector at a time */
+			printk(KERN_WARNING "%s: retrying using single "
+			       "block read\n", req->rq_disk->disk_name);
+			return MMC_BLK_RETRY_SINGLE;
+		}
+		status = get_card_status(card, req);
 	}
-#endif
 
-	mmc_claim_host(card->host);
+	if (brq->cmd.error) {
+		printk(KERN_ERR "%s: error %d sending read/write "
+		       "command, response %#x, card status %#x\n",
+		       req->rq_disk->disk_name, brq->cmd.error,
+		       brq->cmd.resp[0], status);
+	}
 
-	do {
-		struct mmc_command cmd;
-		u32 readcmd, writecmd, status = 0;
-
-		memset(&brq, 0, sizeof(struct mmc_blk_request));
-		brq.mrq.cmd = &brq.cmd;
-		brq.mrq.data = &brq.data;
-
-		brq.cmd.arg = blk_rq_pos(req);
-		if (!mmc_card_blockaddr(card))
-			brq.cmd.arg <<= 9;
-		brq.cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-		brq.data.blksz = 512;
-		brq.stop.opcode = MMC_STOP_TRANSMISSION;
-		brq.stop.arg = 0;
-		brq.stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-		brq.data.blocks = blk_rq_sectors(req);
+	if (brq->data.error) {
+		if (brq->data.error == -ETIMEDOUT && brq->mrq.stop)
+			/* 'Stop' response contains card status */
+			status = brq->mrq.stop->resp[0];
+		printk(KERN_ERR "%s: error %d transferring data,"
+		       " sector %u, nr %u, card status %#x\n",
+		       req->rq_disk->disk_name, brq->data.error,
+		       (unsigned)blk_rq_pos(req),
+		       (unsigned)blk_rq_sectors(req), status);
+	}
 
-		/*
-		 * The block layer doesn't support all sector count
-		 * restrictions, so we need to be prepared for too big
-		 * requests.
-		 */
-		if (brq.data.blocks > card->host->max_blk_count)
-			brq.data.blocks = card->host->max_blk_count;
+	if (brq->stop.error) {
+		printk(KERN_ERR "%s: error %d sending stop command, "
+		       "response %#x, card status %#x\n",
+		       req->rq_disk->disk_name, brq->stop.error,
+		       brq->stop.resp[0], status);
+	}
+
+	if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
+		do {
+			int err;
+
+			cmd.opcode = MMC_SEND_STATUS;
+			cmd.arg = card->rca << 16;
+			cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+			err = mmc_wait_for_cmd(card->host, &cmd, 5);
+			if (err) {
+				printk(KERN_ERR "%s: error %d requesting status\n",
+				       req->rq_disk->disk_name, err);
+				return MMC_BLK_CMD_ERR;
+			}
+			/*
+			 * Some cards mishandle the status bits,
+			 * so make sure to check both the busy
+			 * indication and the card state.
+			 */
+		} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
+			(R1_CURRENT_STATE(cmd.resp[0]) == 7));
+	}
 
+	/*
+	 * The card does not tell which part of a packed write failed
+	 * without reading back EXT_CSD; redo the requests one by one.
+	 */
+	if (mq_mrq->packed_num) {
+		if (brq->cmd.error || brq->data.error ||
+		    brq->data.bytes_xfered !=
+		    brq->data.blocks * brq->data.blksz)
+			return MMC_BLK_PACKED_ERR;
+		return MMC_BLK_SUCCESS;
+	}
+
+	if (brq->cmd.error || brq->stop.error || brq->data.error) {
 		/*
-		 * After a read error, we redo the request one sector at a time
-		 * in order to accurately determine which sectors can be read
-		 * successfully.
+		 * After an error, we redo I/O one sector at a
+		 * time, so we only reach here after trying to
+		 * read a single sector.
 		 */
-		if (disable_multi && brq.data.blocks > 1)
-			brq.data.blocks = 1;
+		if (rq_data_dir(req) == READ)
+			return MMC_BLK_DATA_ERR;
+		return MMC_BLK_CMD_ERR;
+	}
 
-		if (brq.data.blocks > 1) {
-			/* SPI multiblock writes terminate using a special
-			 * token, not a STOP_TRANSMISSION request.
-			 */
-			if (!mmc_host_is_spi(card->host)
-					|| rq_data_dir(req) == READ)
-				brq.mrq.stop = &brq.stop;
-			readcmd = MMC_READ_MULTIPLE_BLOCK;
-			writecmd = MMC_WRITE_MULTIPLE_BLOCK;
-		} else {
-			brq.mrq.stop = NULL;
-			readcmd = MMC_READ_SINGLE_BLOCK;
-			writecmd = MMC_WRITE_BLOCK;
-		}
+	if (blk_rq_bytes(req) != brq->data.bytes_xfered)
+		return MMC_BLK_PARTIAL;
 
-		if (rq_data_dir(req) == READ) {
-			brq.cmd.opcode = readcmd;
-			brq.data.flags |= MMC_DATA_READ;
-		} else {
-			brq.cmd.opcode = writecmd;
-			brq.data.flags |= MMC_DATA_WRITE;
-		}
+	return MMC_BLK_SUCCESS;
+}
+
+static void mmc_blk_rw_rq_prep(struct mmc_queue_req *mqrq,
+			       struct mmc_card *card,
+			       int disable_multi,
+			       struct mmc_queue *mq)
+{
+	u32 readcmd, writecmd;
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+	mqrq->packed_num = 0;
+
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	brq->data.blksz = 512;
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	brq->data.blocks = blk_rq_sectors(req);
 
-		mmc_set_data_timeout(&brq.data, card);
+	/*
+	 * The block layer doesn't support all sector count
+	 * restrictions, so we need to be prepared for too big
+	 * requests.
+	 */
+	if (brq->data.blocks > card->host->max_blk_count)
+		brq->data.blocks = card->host->max_blk_count;
 
-		brq.data.sg = mq->sg;
-		brq.data.sg_len = mmc_queue_map_sg(mq);
+	/*
+	 * After a read error, we redo the request one sector at a time
+	 * in order to accurately determine which sectors can be read
+	 * successfully.
+	 */
+	if (disable_multi && brq->data.blocks > 1)
+		brq->data.blocks = 1;
 
-		/*
-		 * Adjust the sg list so it is the same size as the
-		 * request.
+	if (brq->data.blocks > 1) {
+		/* SPI multiblock writes terminate using a special
+		 * token, not a STOP_TRANSMISSION request.
 		 */
-		if (brq.data.blocks != blk_rq_sectors(req)) {
-			int i, data_size = brq.data.blocks << 9;
-			struct scatterlist *sg;
-
-			for_each_sg(brq.data.sg, sg, brq.data.sg_len, i) {
-				data_size -= sg->length;
-				if (data_size <= 0) {
-					sg->length += data_size;
-					i++;
-					break;
-				}
-			}
-			brq.data.sg_len = i;
-		}
+		if (!mmc_host_is_spi(card->host)
+				|| rq_data_dir(req) == READ)
+			brq->mrq.stop = &brq->stop;
+		readcmd = MMC_READ_MULTIPLE_BLOCK;
+		writecmd = MMC_WRITE_MULTIPLE_BLOCK;
+	} else {
+		brq->mrq.stop = NULL;
+		readcmd = MMC_READ_SINGLE_BLOCK;
+		writecmd = MMC_WRITE_BLOCK;
+	}
 
-		mmc_queue_bounce_pre(mq);
+	if (rq_data_dir(req) == READ) {
+		brq->cmd.opcode = readcmd;
+		brq->data.flags |= MMC_DATA_READ;
+	} else {
+		brq->cmd.opcode = writecmd;
+		brq->data.flags |= MMC_DATA_WRITE;
+	}
 
-		mmc_wait_for_req(card->host, &brq.mrq);
+	mmc_set_data_timeout(&brq->data, card);
 
-		mmc_queue_bounce_post(mq);
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
 
-		/*
-		 * Check for errors here, but don't jump to cmd_err
-		 * until later as we need to wait for the card to leave
-		 * programming mode even when things go wrong.
-		 */
-		if (brq.cmd.error || brq.data.error || brq.stop.error) {
-			if (brq.data.blocks > 1 && rq_data_dir(req) == READ) {
-				/* Redo read one sector at a time */
-				printk(KERN_WARNING "%s: retrying using single "
-				       "block read\n", req->rq_disk->disk_name);
-				disable_multi = 1;
-				continue;
+	/*
+	 * Adjust the sg list so it is the same size as the
+	 * request.
+	 */
+	if (brq->data.blocks != blk_rq_sectors(req)) {
+		int i, data_size = brq->data.blocks << 9;
+		struct scatterlist *sg;
+
+		for_each_sg(brq->data.sg, sg, brq->data.sg_len, i) {
+			data_size -= sg->length;
+			if (data_size <= 0) {
+				sg->length += data_size;
+				i++;
+				break;
 			}
-			status = get_card_status(card, req);
-		} else if (disable_multi == 1) {
-			disable_multi = 0;
 		}
+		brq->data.sg_len = i;
+	}
 
-		if (brq.cmd.error) {
-			printk(KERN_ERR "%s: error %d sending read/write "
-			       "command, response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.cmd.error,
-			       brq.cmd.resp[0], status);
-		}
+	mqrq->mmc_active.mrq = &brq->mrq;
+	mqrq->mmc_active.err_check = mmc_blk_err_check;
 
-		if (brq.data.error) {
-			if (brq.data.error == -ETIMEDOUT && brq.mrq.stop)
-				/* 'Stop' response contains card status */
-				status = brq.mrq.stop->resp[0];
-			printk(KERN_ERR "%s: error %d transferring data,"
-			       " sector %u, nr %u, card status %#x\n",
-			       req->rq_disk->disk_name, brq.data.error,
-			       (unsigned)blk_rq_pos(req),
-			       (unsigned)blk_rq_sectors(req), status);
-		}
+	mmc_queue_bounce_pre(mqrq);
+}
+
+/*
+ * Pull further writes off the queue to send along with req in one
+ * packed command. Returns the number of requests packed, or 0 if req
+ * goes out on its own.
+ */
+static unsigned int mmc_blk_prep_packed_list(struct mmc_queue *mq,
+					     struct request *req)
+{
+	struct mmc_queue_req *mqrq = mq->mqrq_cur;
+	struct request_queue *q = mq->queue;
+	struct mmc_host *host = mq->card->host;
+	unsigned int max_blocks, max_segs, blocks, segs, num;
+	struct request *next;
+
+	if (!mq->max_packed || mq->no_pack || rq_data_dir(req) != WRITE ||
+	    blk_barrier_rq(req) || blk_discard_rq(req))
+		return 0;
+
+	max_blocks = min(host->max_blk_count, host->max_req_size >> 9);
+	max_segs = min(host->max_hw_segs, host->max_phys_segs);
+
+	/* The header takes a block and a segment of its own */
+	blocks = 1 + blk_rq_sectors(req);
+	segs = 1 + req->nr_phys_segments;
+	if (blocks >= max_blocks || segs >= max_segs)
+		return 0;
+
+	INIT_LIST_HEAD(&mqrq->packed_list);
+	list_add_tail(&req->queuelist, &mqrq->packed_list);
+	num = 1;
+
+	spin_lock_irq(q->queue_lock);
+	while (num < mq->max_packed) {
+		next = blk_peek_request(q);
+		if (!next || !blk_fs_request(next) ||
+		    rq_data_dir(next) != WRITE ||
+		    blk_barrier_rq(next) || blk_discard_rq(next))
+			break;
+		if (blocks + blk_rq_sectors(next) > max_blocks ||
+		    segs + next->nr_phys_segments > max_segs)
+			break;
+
+		blk_start_request(next);
+		list_add_tail(&next->queuelist, &mqrq->packed_list);
+		blocks += blk_rq_sectors(next);
+		segs += next->nr_phys_segments;
+		num++;
+	}
+	spin_unlock_irq(q->queue_lock);
+
+	if (num == 1) {
+		list_del_init(&req->queuelist);
+		return 0;
+	}
+
+	return num;
+}
+
+static void mmc_blk_packed_hdr_wrq_prep(struct mmc_queue_req *mqrq,
+					struct mmc_card *card,
+					struct mmc_queue *mq,
+					unsigned int num)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	__le32 *hdr = mqrq->packed_hdr;
+	struct request *prq;
+	unsigned int i = 0, blocks = 0;
+
+	/* mq->max_packed keeps the list within one header block */
+	BUG_ON(num > MMC_PACKED_MAX_ENTRIES);
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	mqrq->packed_num = num;
+
+	mmc_packed_hdr_init(hdr, num);
+	list_for_each_entry(prq, &mqrq->packed_list, queuelist) {
+		mmc_packed_hdr_set(card, hdr, i++, blk_rq_sectors(prq),
+				   blk_rq_pos(prq));
+		blocks += blk_rq_sectors(prq);
+	}
+	blocks++;			/* the header block */
+
+	brq->mrq.sbc = &brq->sbc;
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+	/* The block count is set up front, so there is no stop command */
+	brq->mrq.stop = NULL;
+
+	brq->sbc.opcode = MMC_SET_BLOCK_COUNT;
+	brq->sbc.arg = MMC_CMD23_ARG_PACKED | blocks;
+	brq->sbc.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+	brq->cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+
+	brq->data.blksz = 512;
+	brq->data.blocks = blocks;
+	brq->data.flags |= MMC_DATA_WRITE;
+	mmc_set_data_timeout(&brq->data, card);
+
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_packed_map_sg(mq, mqrq);
+
+	mqrq->mmc_active.mrq = &brq->mrq;
+	mqrq->mmc_active.err_check = mmc_blk_err_check;
+}
+
+/*
+ * Put the requests packed behind mqrq->req back on the queue, so
+ * that mqrq->req can be redone on its own.
+ */
+static void mmc_blk_revert_packed(struct mmc_queue *mq,
+				  struct mmc_queue_req *mqrq)
+{
+	struct request_queue *q = mq->queue;
+	struct request *prq, *tmp;
+
+	spin_lock_irq(q->queue_lock);
+	list_for_each_entry_safe_reverse(prq, tmp, &mqrq->packed_list,
+					 queuelist) {
+		list_del_init(&prq->queuelist);
+		if (prq != mqrq->req)
+			blk_requeue_request(q, prq);
+	}
+	spin_unlock_irq(q->queue_lock);
+
+	mqrq->packed_num = 0;
+	mqrq->brq.data.bytes_xfered = 0;
+}
 
-		if (brq.stop.error) {
-			printk(KERN_ERR "%s: error %d sending stop command, "
-			       "response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.stop.error,
-			       brq.stop.resp[0], status);
+static void mmc_blk_end_packed_req(struct mmc_blk_data *md,
+				   struct mmc_queue_req *mqrq)
+{
+	struct request *prq, *tmp;
+
+	spin_lock_irq(&md->lock);
+	list_for_each_entry_safe(prq, tmp, &mqrq->packed_list, queuelist) {
+		list_del_init(&prq->queuelist);
+		__blk_end_request(prq, 0, blk_rq_bytes(prq));
+	}
+	spin_unlock_irq(&md->lock);
+
+	mqrq->packed_num = 0;
+}
+
+static void mmc_blk_prep(struct mmc_queue *mq, struct request *rqc)
+{
+	struct mmc_packed_stats *stats = &mq->packed_stats;
+	struct mmc_card *card = mq->card;
+	unsigned int num;
+
+	num = mmc_blk_prep_packed_list(mq, rqc);
+	if (num) {
+		mmc_blk_packed_hdr_wrq_prep(mq->mqrq_cur, card, mq, num);
+		stats->packed++;
+		stats->packed_reqs += num;
+		if (num > stats->max_packed)
+			stats->max_packed = num;
+	} else
+		mmc_blk_rw_rq_prep(mq->mqrq_cur, card, 0, mq);
+
+	if (rq_data_dir(rqc) == WRITE)
+		stats->writes++;
+}
+
+/*
+ * Start rqc (if any) and complete the request that was on the bus
+ * before it. The new request is prepared and, through the host's
+ * pre_req hook, mapped while the previous one is still transferring.
+ * If the previous request failed or was only partly done, rqc is not
+ * started until the previous one has been retried or ended.
+ */
+static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_request *brq;
+	int ret = 1, disable_multi = 0;
+	int status;
+	struct mmc_queue_req *mq_rq;
+	struct request *req;
+	struct mmc_async_req *areq, *resend = NULL;
+
+	if (!rqc && !mq->mqrq_prev->req)
+		return 0;
+
+	/*
+	 * Prepare rqc only once. If the previous request has to be sent
+	 * again first, rqc is issued as it is on the next pass: a packed
+	 * rqc holds requests already taken off the queue.
+	 */
+	if (rqc)
+		mmc_blk_prep(mq, rqc);
+
+	do {
+		if (resend) {
+			/*
+			 * The error that brought the request back left
+			 * nothing in flight, so this normally just starts
+			 * it and rqc follows on the next pass. Anything
+			 * that does complete here is handled as usual.
+			 */
+			areq = mmc_start_req(card->host, resend, &status);
+			resend = NULL;
+			if (!areq)
+				continue;
+		} else {
+			areq = rqc ? &mq->mqrq_cur->mmc_active : NULL;
+			areq = mmc_start_req(card->host, areq, &status);
+			if (!areq)
+				return 0;
 		}
 
-		if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
-			do {
-				int err;
-
-				cmd.opcode = MMC_SEND_STATUS;
-				cmd.arg = card->rca << 16;
-				cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
-				err = mmc_wait_for_cmd(card->host, &cmd, 5);
-				if (err) {
-					printk(KERN_ERR "%s: error %d requesting status\n",
-					       req->rq_disk->disk_name, err);
-					goto cmd_err;
-				}
-				/*
-				 * Some cards mishandle the status bits,
-				 * so make sure to check both the busy
-				 * indication and the card state.
-				 */
-			} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
-				(R1_CURRENT_STATE(cmd.resp[0]) == 7));
-
-#if 0
-			if (cmd.resp[0] & ~0x00000900)
-				printk(KERN_ERR "%s: status = %08x\n",
-				       req->rq_disk->disk_name, cmd.resp[0]);
-			if (mmc_decode_status(cmd.resp))
-				goto cmd_err;
-#endif
+		mq_rq = container_of(areq, struct mmc_queue_req, mmc_active);
+		brq = &mq_rq->brq;
+		req = mq_rq->req;
+		mmc_queue_bounce_post(mq_rq);
+
+		if (mq_rq->packed_num && status == MMC_BLK_SUCCESS) {
+			mmc_blk_end_packed_req(md, mq_rq);
+			ret = 0;
+			continue;
 		}
 
-		if (brq.cmd.error || brq.stop.error || brq.data.error) {
-			if (rq_data_dir(req) == READ) {
+		switch (status) {
+		case MMC_BLK_SUCCESS:
+		case MMC_BLK_PARTIAL:
+			/*
+			 * A block was successfully transferred.
+			 */
+			disable_multi = 0;
+			if (rq_data_dir(req) == WRITE)
+				mq->no_pack = 0;
+			spin_lock_irq(&md->lock);
+			ret = __blk_end_request(req, 0,
+						brq->data.bytes_xfered);
+			spin_unlock_irq(&md->lock);
+			if (status == MMC_BLK_SUCCESS && ret) {
 				/*
-				 * After an error, we redo I/O one sector at a
-				 * time, so we only reach here after trying to
-				 * read a single sector.
+				 * All data was transferred without errors,
+				 * yet the block layer still has bytes left.
+				 * rqc has been started already, so end this
+				 * one rather than issue it again.
 				 */
-				spin_lock_irq(&md->lock);
-				ret = __blk_end_request(req, -EIO, brq.data.blksz);
-				spin_unlock_irq(&md->lock);
-				continue;
+				printk(KERN_ERR "%s: BUG rq_tot %d d_xfer %d\n",
+				       req->rq_disk->disk_name,
+				       blk_rq_bytes(req),
+				       brq->data.bytes_xfered);
+				rqc = NULL;
+				goto cmd_abort;
 			}
+			break;
+		case MMC_BLK_RETRY_SINGLE:
+			disable_multi = 1;
+			break;
+		case MMC_BLK_DATA_ERR:
+			spin_lock_irq(&md->lock);
+			ret = __blk_end_request(req, -EIO, brq->data.blksz);
+			spin_unlock_irq(&md->lock);
+			if (!ret)
+				goto start_new_req;
+			break;
+		case MMC_BLK_PACKED_ERR:
+			/* Redo the first request alone, requeue the rest */
+			printk(KERN_WARNING "%s: packed write of %u requests "
+			       "failed, retrying unpacked\n",
+			       req->rq_disk->disk_name, mq_rq->packed_num);
+			mmc_blk_revert_packed(mq, mq_rq);
+			mq->packed_stats.packed_fail++;
+			mq->no_pack = 1;
+			ret = 1;
+			break;
+		case MMC_BLK_CMD_ERR:
+		default:
 			goto cmd_err;
 		}
 
-		/*
-		 * A block was successfully transferred.
-		 */
-		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
-		spin_unlock_irq(&md->lock);
+		if (ret) {
+			/*
+			 * In case of a none complete request
+			 * prepare it again and resend.
+			 */
+			mmc_blk_rw_rq_prep(mq_rq, card, disable_multi, mq);
+			resend = &mq_rq->mmc_active;
+		}
 	} while (ret);
 
-	mmc_release_host(card->host);
-
 	return 1;
 
  cmd_err:
+	if (mq_rq->packed_num)
+		mmc_blk_revert_packed(mq, mq_rq);
  	/*
  	 * If this is an SD card and we're writing, we can first
  	 * mark the known good sectors as ok.
@@ -488,20 +780,67 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		}
 	} else {
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	}
 
-	mmc_release_host(card->host);
-
+ cmd_abort:
 	spin_lock_irq(&md->lock);
 	while (ret)
 		ret = __blk_end_request(req, -EIO, blk_rq_cur_bytes(req));
 	spin_unlock_irq(&md->lock);
 
+ start_new_req:
+	if (rqc) {
+		/* A packed rqc still holds its requests; send as is */
+		if (!mq->mqrq_cur->packed_num)
+			mmc_blk_rw_rq_prep(mq->mqrq_cur, card, 0, mq);
+		mmc_start_req(card->host, &mq->mqrq_cur->mmc_active, NULL);
+	}
+
 	return 0;
 }
 
+static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	int ret;
+
+	if (req && !mq->mqrq_prev->req) {
+#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
+		if (mmc_bus_needs_resume(card->host)) {
+			mmc_resume_bus(card->host);
+			mmc_blk_set_blksize(md, card);
+		}
+#endif
+		/* claim host only for the first request */
+		mmc_claim_host(card->host);
+	}
+
+	if (req && mmc_req_is_flush(req)) {
+		/* Complete what is on the bus, then write the cache back */
+		mmc_blk_issue_rw_rq(mq, NULL);
+		ret = mmc_flush_cache(card);
+
+		spin_lock_irq(&md->lock);
+		__blk_end_request_all(req, ret ? -EIO : 0);
+		spin_unlock_irq(&md->lock);
+
+		/* Nothing is left in flight for the thread to complete */
+		mq->mqrq_cur->req = NULL;
+		mmc_release_host(card->host);
+		return !ret;
+	}
+
+	ret = mmc_blk_issue_rw_rq(mq, req);
+
+	/* release host only when there are no more requests */
+	if (!req)
+		mmc_release_host(card->host);
+
+	return ret;
+}
 
 static inline int mmc_blk_readonly(struct mmc_card *card)
 {
@@ -596,6 +935,50 @@ static struct mmc_blk_data *mmc_blk_alloc(struct mmc_card *card)
 	return ERR_PTR(ret);
 }
 
+static ssize_t mmc_blk_packed_stats_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct mmc_blk_data *md = dev_to_disk(dev)->private_data;
+	struct mmc_packed_stats *stats = &md->queue.packed_stats;
+	unsigned long reqs, ratio = 0;
+
+	/* Write requests per write command, in hundredths */
+	reqs = stats->writes - stats->packed + stats->packed_reqs;
+	if (stats->writes)
+		ratio = reqs * 100 / stats->writes;
+
+	return snprintf(buf, PAGE_SIZE,
+			"max_packed_writes %u\n"
+			"write_cmds %lu\n"
+			"packed_cmds %lu\n"
+			"packed_reqs %lu\n"
+			"packed_fail %lu\n"
+			"max_packed %u\n"
+			"reqs_per_write %lu.%02lu\n",
+			md->queue.max_packed, stats->writes, stats->packed,
+			stats->packed_reqs, stats->packed_fail,
+			stats->max_packed, ratio / 100, ratio % 100);
+}
+
+static ssize_t mmc_blk_packed_stats_store(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct mmc_blk_data *md = dev_to_disk(dev)->private_data;
+	unsigned long value;
+
+	if (strict_strtoul(buf, 0, &value) || value)
+		return -EINVAL;
+
+	memset(&md->queue.packed_stats, 0, sizeof(md->queue.packed_stats));
+
+	return count;
+}
+
+static DEVICE_ATTR(packed_stats, S_IRUGO | S_IWUSR,
+		   mmc_blk_packed_stats_show, mmc_blk_packed_stats_store);
+
 static int mmc_blk_probe(struct mmc_card *card)
 {
 	struct mmc_blk_data *md;
@@ -628,6 +1011,11 @@ static int mmc_blk_probe(struct mmc_card *card)
 	mmc_set_bus_resume_policy(card->host, 1);
 #endif
 	add_disk(md->disk);
+
+	err = device_create_file(disk_to_dev(md->disk), &dev_attr_packed_stats);
+	if (err)
+		printk(KERN_WARNING "%s: failed to create packed_stats: %d\n",
+		       md->disk->disk_name, err);
 	return 0;
 
  out:
@@ -642,6 +1030,9 @@ static void mmc_blk_remove(struct mmc_card *card)
 	struct mmc_blk_data *md = mmc_get_drvdata(card);
 
 	if (md) {
+		device_remove_file(disk_to_dev(md->disk),
+				   &dev_attr_packed_stats);
+
 		/* Stop new requests from getting into the queue */
 		del_gendisk(md->disk);
 
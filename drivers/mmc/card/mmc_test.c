@@ -16,6 +16,8 @@
 #include <linux/slab.h>
 
 #include <linux/scatterlist.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #define RESULT_OK		0
 #define RESULT_FAIL		1
@@ -895,6 +897,507 @@ static int mmc_test_multi_read_high(struct mmc_test_card *test)
 
 #endif /* CONFIG_HIGHMEM */
 
+/*******************************************************************/
+/*  Packed command tests                                           */
+/*******************************************************************/
+
+#define MMC_TEST_PACKED_MAX	MMC_PACKED_MAX_ENTRIES
+
+struct mmc_test_packed_entry {
+	unsigned	dev_addr;	/* in 512 byte sectors */
+	unsigned	blocks;
+};
+
+/* Build a packed write header with the helpers the block driver uses */
+static int mmc_test_packed_build(struct mmc_test_card *test, __le32 *hdr,
+	const struct mmc_test_packed_entry *ent, unsigned num)
+{
+	unsigned i;
+	int ret;
+
+	mmc_packed_hdr_init(hdr, num);
+	for (i = 0; i < num; i++) {
+		ret = mmc_packed_hdr_set(test->card, hdr, i, ent[i].blocks,
+					 ent[i].dev_addr);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Software model of the card side: decode a packed write header and
+ * check it against the CMD23 block count, as an eMMC 4.5 device would
+ * before accepting the data.
+ */
+static int mmc_test_packed_model(struct mmc_test_card *test,
+	const __le32 *hdr, unsigned sbc_blocks,
+	struct mmc_test_packed_entry *ent, unsigned max)
+{
+	u32 word = le32_to_cpu(hdr[0]);
+	unsigned i, num, blocks = 1;
+
+	if ((word & 0xff) != MMC_PACKED_CMD_VER)
+		return RESULT_FAIL;
+	if (((word >> 8) & 0xff) != MMC_PACKED_CMD_WR)
+		return RESULT_FAIL;
+
+	num = (word >> 16) & 0xff;
+	if (!num || num > max || (num + 1) * 8 > MMC_PACKED_HDR_SIZE)
+		return RESULT_FAIL;
+
+	for (i = 0; i < num; i++) {
+		ent[i].blocks = le32_to_cpu(hdr[(i + 1) * 2]);
+		ent[i].dev_addr = le32_to_cpu(hdr[(i + 1) * 2 + 1]);
+		if (!mmc_card_blockaddr(test->card)) {
+			if (ent[i].dev_addr & 511)
+				return RESULT_FAIL;
+			ent[i].dev_addr >>= 9;
+		}
+		if (!ent[i].blocks)
+			return RESULT_FAIL;
+		blocks += ent[i].blocks;
+	}
+
+	/* The header block plus the data of every entry */
+	if (blocks != sbc_blocks)
+		return RESULT_FAIL;
+
+	return 0;
+}
+
+/*
+ * Round trip headers of every size the block driver can build through
+ * the model, and check that no entry lands past the header block. Needs
+ * no card support, so it also runs on cards without packed commands.
+ */
+static int mmc_test_packed_hdr(struct mmc_test_card *test)
+{
+	struct mmc_test_packed_entry ent[MMC_TEST_PACKED_MAX + 1];
+	struct mmc_test_packed_entry out[MMC_TEST_PACKED_MAX];
+	__le32 *hdr = (__le32 *)test->scratch;
+	unsigned num, i, blocks, rnd = 0x5eed;
+	int ret;
+
+	for (num = 1; num <= MMC_TEST_PACKED_MAX + 1; num++) {
+		blocks = 1;
+		for (i = 0; i < num; i++) {
+			rnd = rnd * 1103515245 + 12345;
+			ent[i].blocks = 1 + ((rnd >> 16) & 63);
+			ent[i].dev_addr = ((rnd >> 8) & 0xffff) * 8;
+			blocks += ent[i].blocks;
+		}
+
+		/* The block after the header must never be written */
+		memset(test->scratch + MMC_PACKED_HDR_SIZE, 0xa5, 512);
+
+		ret = mmc_test_packed_build(test, hdr, ent, num);
+		for (i = 0; i < 512; i++) {
+			if (test->scratch[MMC_PACKED_HDR_SIZE + i] != 0xa5)
+				return RESULT_FAIL;
+		}
+		if (num > MMC_TEST_PACKED_MAX) {
+			/* One entry too many must be refused */
+			if (!ret)
+				return RESULT_FAIL;
+			break;
+		}
+		if (ret)
+			return RESULT_FAIL;
+
+		ret = mmc_test_packed_model(test, hdr, blocks, out,
+					    MMC_TEST_PACKED_MAX);
+		if (ret)
+			return ret;
+		for (i = 0; i < num; i++) {
+			if (out[i].blocks != ent[i].blocks ||
+			    out[i].dev_addr != ent[i].dev_addr)
+				return RESULT_FAIL;
+		}
+
+		/* A count that doesn't match the header must be refused */
+		if (!mmc_test_packed_model(test, hdr, blocks + 1, out,
+					   MMC_TEST_PACKED_MAX))
+			return RESULT_FAIL;
+	}
+
+	return 0;
+}
+
+/*
+ * Write a few scattered areas with one packed command and read each
+ * back on its own.
+ */
+static int mmc_test_packed_write(struct mmc_test_card *test)
+{
+	struct mmc_test_packed_entry ent[4];
+	struct mmc_request mrq;
+	struct mmc_command sbc, cmd;
+	struct mmc_data data;
+	struct scatterlist sg;
+	unsigned num, i, j, blocks, off;
+	u8 *rbuf = test->buffer + BUFFER_SIZE - 4 * 512;
+	int ret;
+
+	if (!mmc_card_mmc(test->card) ||
+	    test->card->ext_csd.max_packed_writes < 2)
+		return RESULT_UNSUP_CARD;
+
+	ret = mmc_test_set_blksize(test, 512);
+	if (ret)
+		return ret;
+
+	num = min_t(unsigned, ARRAY_SIZE(ent),
+		    test->card->ext_csd.max_packed_writes);
+
+	blocks = 1;
+	for (i = 0; i < num; i++) {
+		ent[i].dev_addr = i * 16 + (i & 1) * 3;
+		ent[i].blocks = 4;
+		blocks += ent[i].blocks;
+	}
+	if (blocks * 512 > BUFFER_SIZE - 4 * 512)
+		return RESULT_FAIL;
+
+	ret = mmc_test_packed_build(test, (__le32 *)test->buffer, ent, num);
+	if (ret)
+		return RESULT_FAIL;
+	for (i = 512; i < blocks * 512; i++)
+		test->buffer[i] = (i * 37 + (i >> 9)) & 0xff;
+
+	/* Check our own header before the card sees it */
+	ret = mmc_test_packed_model(test, (__le32 *)test->buffer, blocks,
+				    ent, num);
+	if (ret)
+		return ret;
+
+	memset(&mrq, 0, sizeof(struct mmc_request));
+	memset(&sbc, 0, sizeof(struct mmc_command));
+	memset(&cmd, 0, sizeof(struct mmc_command));
+	memset(&data, 0, sizeof(struct mmc_data));
+
+	mrq.sbc = &sbc;
+	mrq.cmd = &cmd;
+	mrq.data = &data;
+
+	sbc.opcode = MMC_SET_BLOCK_COUNT;
+	sbc.arg = MMC_CMD23_ARG_PACKED | blocks;
+	sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+	cmd.arg = ent[0].dev_addr;
+	if (!mmc_card_blockaddr(test->card))
+		cmd.arg <<= 9;
+	cmd.flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+
+	sg_init_one(&sg, test->buffer, blocks * 512);
+	data.blksz = 512;
+	data.blocks = blocks;
+	data.flags = MMC_DATA_WRITE;
+	data.sg = &sg;
+	data.sg_len = 1;
+	mmc_set_data_timeout(&data, test->card);
+
+	mmc_wait_for_req(test->card->host, &mrq);
+
+	if (sbc.error)
+		return sbc.error;
+	ret = mmc_test_check_result(test, &mrq);
+	if (ret)
+		return ret;
+	ret = mmc_test_wait_busy(test);
+	if (ret)
+		return ret;
+
+	for (i = 0, off = 512; i < num; i++) {
+		memset(rbuf, 0, ent[i].blocks * 512);
+		sg_init_one(&sg, rbuf, ent[i].blocks * 512);
+		ret = mmc_test_simple_transfer(test, &sg, 1, ent[i].dev_addr,
+					       ent[i].blocks, 512, 0);
+		if (ret)
+			return ret;
+		for (j = 0; j < ent[i].blocks * 512; j++) {
+			if (rbuf[j] != test->buffer[off + j])
+				return RESULT_FAIL;
+		}
+		off += ent[i].blocks * 512;
+	}
+
+	return 0;
+}
+
+static int mmc_test_cache_flush(struct mmc_test_card *test)
+{
+	struct scatterlist sg;
+	int ret;
+
+	if (!mmc_card_mmc(test->card) || !test->card->ext_csd.cache_ctrl)
+		return RESULT_UNSUP_CARD;
+
+	ret = mmc_test_set_blksize(test, 512);
+	if (ret)
+		return ret;
+
+	sg_init_one(&sg, test->buffer, 512);
+	ret = mmc_test_simple_transfer(test, &sg, 1, 0, 1, 512, 1);
+	if (ret)
+		return ret;
+
+	return mmc_flush_cache(test->card);
+}
+
+/*******************************************************************/
+/*  Performance tests                                              */
+/*******************************************************************/
+
+/*
+ * Each performance test does MMC_TEST_PERF_XFERS transfers of up to
+ * 64 KiB within the first MMC_TEST_PERF_AREA bytes of the card, once
+ * waiting for each request (blocking) and once with mmc_start_req()
+ * keeping the next request prepared while the current one runs
+ * (non-blocking). Like the other tests it destroys data on the card.
+ */
+#define MMC_TEST_PERF_XFERS	64
+#define MMC_TEST_PERF_SIZE	(64 * 1024)
+#define MMC_TEST_PERF_AREA	(16 * 1024 * 1024)
+
+struct mmc_test_perf_req {
+	struct mmc_request	mrq;
+	struct mmc_command	cmd;
+	struct mmc_command	stop;
+	struct mmc_data		data;
+	struct scatterlist	*sg;
+	u8			*buf;
+	struct mmc_async_req	areq;
+	struct mmc_test_card	*test;
+};
+
+struct mmc_test_perf {
+	struct mmc_test_perf_req req[2];
+	unsigned int		size;		/* bytes per transfer */
+	unsigned int		sg_len;
+	unsigned int		slots;		/* transfers in the area */
+};
+
+static unsigned int mmc_test_capacity(struct mmc_card *card)
+{
+	if (!mmc_card_sd(card) && mmc_card_blockaddr(card))
+		return card->ext_csd.sectors;
+	else
+		return card->csd.capacity << (card->csd.read_blkbits - 9);
+}
+
+static void mmc_test_perf_free(struct mmc_test_perf *p)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(p->req); i++) {
+		kfree(p->req[i].sg);
+		kfree(p->req[i].buf);
+	}
+}
+
+static int mmc_test_perf_init(struct mmc_test_card *test,
+			      struct mmc_test_perf *p)
+{
+	struct mmc_host *host = test->card->host;
+	unsigned int seg, max_segs, area;
+	int i;
+
+	memset(p, 0, sizeof(*p));
+
+	p->size = MMC_TEST_PERF_SIZE;
+	p->size = min(p->size, host->max_req_size);
+	p->size = min(p->size, host->max_blk_count * 512);
+
+	seg = min(p->size, host->max_seg_size);
+	max_segs = min(host->max_hw_segs, host->max_phys_segs);
+	p->sg_len = DIV_ROUND_UP(p->size, seg);
+	if (p->sg_len > max_segs) {
+		p->sg_len = max_segs;
+		p->size = max_segs * seg;
+	}
+	p->size &= ~511;
+	if (p->size < 512)
+		return RESULT_UNSUP_HOST;
+	p->sg_len = DIV_ROUND_UP(p->size, seg);
+
+	area = min_t(unsigned int, MMC_TEST_PERF_AREA / 512,
+		     mmc_test_capacity(test->card) / 2);
+	p->slots = area / (p->size / 512);
+	if (!p->slots)
+		return RESULT_UNSUP_CARD;
+
+	for (i = 0; i < ARRAY_SIZE(p->req); i++) {
+		struct mmc_test_perf_req *r = &p->req[i];
+		unsigned int j, left = p->size;
+		u8 *b;
+
+		r->test = test;
+		r->buf = kzalloc(p->size, GFP_KERNEL);
+		r->sg = kmalloc(sizeof(struct scatterlist) * p->sg_len,
+				GFP_KERNEL);
+		if (!r->buf || !r->sg) {
+			mmc_test_perf_free(p);
+			return -ENOMEM;
+		}
+
+		sg_init_table(r->sg, p->sg_len);
+		for (j = 0, b = r->buf; j < p->sg_len; j++) {
+			unsigned int len = min(left, seg);
+
+			sg_set_buf(&r->sg[j], b, len);
+			b += len;
+			left -= len;
+		}
+	}
+
+	return 0;
+}
+
+static int mmc_test_perf_check(struct mmc_card *card,
+			       struct mmc_async_req *areq)
+{
+	struct mmc_test_perf_req *r =
+		container_of(areq, struct mmc_test_perf_req, areq);
+
+	if (r->cmd.error)
+		return r->cmd.error;
+	if (r->data.error)
+		return r->data.error;
+	if (r->mrq.stop && r->stop.error)
+		return r->stop.error;
+	if (r->data.bytes_xfered != r->data.blocks * r->data.blksz)
+		return RESULT_FAIL;
+
+	if (r->data.flags & MMC_DATA_WRITE)
+		return mmc_test_wait_busy(r->test);
+
+	return 0;
+}
+
+static void mmc_test_perf_prepare(struct mmc_test_perf *p,
+				  struct mmc_test_perf_req *r,
+				  unsigned dev_addr, int write)
+{
+	memset(&r->mrq, 0, sizeof(struct mmc_request));
+	memset(&r->cmd, 0, sizeof(struct mmc_command));
+	memset(&r->data, 0, sizeof(struct mmc_data));
+	memset(&r->stop, 0, sizeof(struct mmc_command));
+
+	r->mrq.cmd = &r->cmd;
+	r->mrq.data = &r->data;
+	r->mrq.stop = &r->stop;
+
+	mmc_test_prepare_mrq(r->test, &r->mrq, r->sg, p->sg_len, dev_addr,
+			     p->size / 512, 512, write);
+
+	r->areq.mrq = &r->mrq;
+	r->areq.err_check = mmc_test_perf_check;
+}
+
+static int mmc_test_perf_pass(struct mmc_test_card *test,
+			      struct mmc_test_perf *p, int write, int random,
+			      int nonblock)
+{
+	struct mmc_host *host = test->card->host;
+	unsigned int i, addr, rnd = 0x2545f491;
+	unsigned int bytes = MMC_TEST_PERF_XFERS * p->size;
+	struct timespec ts;
+	ktime_t start;
+	u64 ns;
+	int ret = 0;
+
+	start = ktime_get();
+
+	for (i = 0; i < MMC_TEST_PERF_XFERS; i++) {
+		struct mmc_test_perf_req *r = &p->req[i & 1];
+
+		if (random) {
+			rnd = rnd * 1103515245 + 12345;
+			addr = (rnd >> 8) % p->slots;
+		} else
+			addr = i % p->slots;
+
+		mmc_test_perf_prepare(p, r, addr * (p->size / 512), write);
+
+		if (nonblock) {
+			mmc_start_req(host, &r->areq, &ret);
+		} else {
+			mmc_wait_for_req(host, &r->mrq);
+			ret = mmc_test_perf_check(test->card, &r->areq);
+		}
+		if (ret)
+			break;
+	}
+	if (nonblock && !ret)
+		mmc_start_req(host, NULL, &ret);
+	if (ret)
+		return RESULT_FAIL;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	ts = ns_to_timespec(ns);
+
+	printk(KERN_INFO "%s: %s %s, %s: %u x %u bytes took "
+		"%lu.%09lu seconds (%u kB/s)\n",
+		mmc_hostname(host), random ? "Random" : "Sequential",
+		write ? "write" : "read",
+		nonblock ? "non-blocking" : "blocking",
+		MMC_TEST_PERF_XFERS, p->size,
+		(unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec,
+		ns ? (unsigned int)div64_u64((u64)bytes * 1000000, ns) : 0);
+
+	return 0;
+}
+
+static int mmc_test_perf(struct mmc_test_card *test, int write, int random)
+{
+	struct mmc_test_perf p;
+	int ret;
+
+	ret = mmc_test_set_blksize(test, 512);
+	if (ret)
+		return ret;
+
+	ret = mmc_test_perf_init(test, &p);
+	if (ret)
+		return ret;
+
+	if (!test->card->host->ops->pre_req)
+		printk(KERN_INFO "%s: Host does not prepare requests "
+			"ahead (no pre_req)\n",
+			mmc_hostname(test->card->host));
+
+	ret = mmc_test_perf_pass(test, &p, write, random, 0);
+	if (!ret)
+		ret = mmc_test_perf_pass(test, &p, write, random, 1);
+
+	mmc_test_perf_free(&p);
+
+	return ret;
+}
+
+static int mmc_test_seq_write_perf(struct mmc_test_card *test)
+{
+	return mmc_test_perf(test, 1, 0);
+}
+
+static int mmc_test_seq_read_perf(struct mmc_test_card *test)
+{
+	return mmc_test_perf(test, 0, 0);
+}
+
+static int mmc_test_random_write_perf(struct mmc_test_card *test)
+{
+	return mmc_test_perf(test, 1, 1);
+}
+
+static int mmc_test_random_read_perf(struct mmc_test_card *test)
+{
+	return mmc_test_perf(test, 0, 1);
+}
+
 static const struct mmc_test_case mmc_test_cases[] = {
 	{
 		.name = "Basic write (no data verification)",
@@ -1042,6 +1545,43 @@ static const struct mmc_test_case mmc_test_cases[] = {
 
 #endif /* CONFIG_HIGHMEM */
 
+	{
+		.name = "Packed write header model",
+		.run = mmc_test_packed_hdr,
+	},
+
+	{
+		.name = "Packed write",
+		.run = mmc_test_packed_write,
+		.cleanup = mmc_test_cleanup,
+	},
+
+	{
+		.name = "Cache flush",
+		.run = mmc_test_cache_flush,
+		.cleanup = mmc_test_cleanup,
+	},
+
+	{
+		.name = "Sequential write performance (blocking vs non-blocking)",
+		.run = mmc_test_seq_write_perf,
+	},
+
+	{
+		.name = "Sequential read performance (blocking vs non-blocking)",
+		.run = mmc_test_seq_read_perf,
+	},
+
+	{
+		.name = "Random write performance (blocking vs non-blocking)",
+		.run = mmc_test_random_write_perf,
+	},
+
+	{
+		.name = "Random read performance (blocking vs non-blocking)",
+		.run = mmc_test_random_read_perf,
+	},
+
 };
 
 static DEFINE_MUTEX(mmc_test_lock);
@@ -4,28 +4,74 @@
 struct request;
 struct task_struct;
 
+struct mmc_blk_request {
+	struct mmc_request	mrq;
+	struct mmc_command	sbc;
+	struct mmc_command	cmd;
+	struct mmc_command	stop;
+	struct mmc_data		data;
+};
+
+struct mmc_queue_req {
+	struct request		*req;
+	struct mmc_blk_request	brq;
+	struct scatterlist	*sg;
+	char			*bounce_buf;
+	struct scatterlist	*bounce_sg;
+	unsigned int		bounce_sg_len;
+	struct mmc_async_req	mmc_active;
+	/* Packed write: all requests (req first) and the header block */
+	struct list_head	packed_list;
+	unsigned int		packed_num;
+	__le32			*packed_hdr;
+};
+
+struct mmc_packed_stats {
+	unsigned long		writes;		/* write commands issued */
+	unsigned long		packed;		/* of which packed */
+	unsigned long		packed_reqs;	/* requests in packed commands */
+	unsigned long		packed_fail;	/* packed commands retried */
+	unsigned int		max_packed;	/* most requests in one */
+};
+
 struct mmc_queue {
 	struct mmc_card		*card;
 	struct task_struct	*thread;
 	struct semaphore	thread_sem;
 	unsigned int		flags;
-	struct request		*req;
 	int			(*issue_fn)(struct mmc_queue *, struct request *);
 	void			*data;
 	struct request_queue	*queue;
-	struct scatterlist	*sg;
-	char			*bounce_buf;
-	struct scatterlist	*bounce_sg;
-	unsigned int		bounce_sg_len;
+	unsigned long		dma_pfn;	/* highest page the host can DMA */
+	/*
+	 * Two requests are in use at a time: the one on the bus (prev)
+	 * and the one being prepared while it runs (cur).
+	 */
+	struct mmc_queue_req	mqrq[2];
+	struct mmc_queue_req	*mqrq_cur;
+	struct mmc_queue_req	*mqrq_prev;
+	unsigned int		max_packed;	/* 0: no packed writes */
+	unsigned int		no_pack;	/* skip packing until a write succeeds */
+	struct mmc_packed_stats	packed_stats;
 };
 
+/* Cache flush generated by the block layer for a barrier */
+static inline int mmc_req_is_flush(struct request *req)
+{
+	return req->cmd_type == REQ_TYPE_LINUX_BLOCK &&
+	       req->cmd[0] == REQ_LB_OP_FLUSH;
+}
+
 extern int mmc_init_queue(struct mmc_queue *, struct mmc_card *, spinlock_t *);
 extern void mmc_cleanup_queue(struct mmc_queue *);
 extern void mmc_queue_suspend(struct mmc_queue *);
 extern void mmc_queue_resume(struct mmc_queue *);
 
-extern unsigned int mmc_queue_map_sg(struct mmc_queue *);
-extern void mmc_queue_bounce_pre(struct mmc_queue *);
-extern void mmc_queue_bounce_post(struct mmc_queue *);
+extern unsigned int mmc_queue_map_sg(struct mmc_queue *,
+				     struct mmc_queue_req *);
+extern unsigned int mmc_queue_packed_map_sg(struct mmc_queue *,
+					    struct mmc_queue_req *);
+extern void mmc_queue_bounce_pre(struct mmc_queue_req *);
+extern void mmc_queue_bounce_post(struct mmc_queue_req *);
 
 #endif
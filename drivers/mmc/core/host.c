@@ -165,10 +165,48 @@ static DEVICE_ATTR(perf, S_IRUGO | S_IWUSR,
 		show_perf, set_perf);
 #endif
 
+static ssize_t
+show_bounce_stats(struct device *dev, struct device_attribute *attr,
+		  char *buf)
+{
+	struct mmc_host *host = dev_get_drvdata(dev);
+
+	return snprintf(buf, PAGE_SIZE,
+			"direct_reqs %lu\n"
+			"bounce_reqs %lu\n"
+			"bounce_bytes %llu\n"
+			"pio_reqs %lu\n"
+			"pio_bytes %llu\n",
+			host->bounce.direct_reqs,
+			host->bounce.bounce_reqs,
+			(unsigned long long)host->bounce.bounce_bytes,
+			host->bounce.pio_reqs,
+			(unsigned long long)host->bounce.pio_bytes);
+}
+
+static ssize_t
+set_bounce_stats(struct device *dev, struct device_attribute *attr,
+		 const char *buf, size_t count)
+{
+	struct mmc_host *host = dev_get_drvdata(dev);
+	unsigned long value;
+
+	if (strict_strtoul(buf, 0, &value) || value)
+		return -EINVAL;
+
+	memset(&host->bounce, 0, sizeof(host->bounce));
+
+	return count;
+}
+
+static DEVICE_ATTR(bounce_stats, S_IRUGO | S_IWUSR,
+		show_bounce_stats, set_bounce_stats);
+
 static struct attribute *dev_attrs[] = {
 #ifdef CONFIG_MMC_PERF_PROFILING
 	&dev_attr_perf.attr,
 #endif
+	&dev_attr_bounce_stats.attr,
 	NULL,
 };
 static struct attribute_group dev_attr_grp = {
@@ -288,8 +288,10 @@ msmsdcc_dma_complete_tlet(unsigned long data)
 		if (!mrq->data->error)
 			mrq->data->error = -EIO;
 	}
-	dma_unmap_sg(mmc_dev(host->mmc), host->dma.sg, host->dma.num_ents,
-		     host->dma.dir);
+	/* Buffers mapped in msmsdcc_pre_req() are unmapped in post_req */
+	if (!mrq->data->host_cookie)
+		dma_unmap_sg(mmc_dev(host->mmc), host->dma.sg,
+			     host->dma.num_ents, host->dma.dir);
 
 	if (host->curr.user_pages) {
 		struct scatterlist *sg = host->dma.sg;
@@ -372,6 +374,9 @@ msmsdcc_dma_complete_func(struct msm_dmov_cmd *cmd,
 
 static int validate_dma(struct msmsdcc_host *host, struct mmc_data *data)
 {
+	struct scatterlist *sg;
+	int i;
+
 	if ((host->dma.channel == -1) || (host->dma.crci == -1))
 		return -ENOENT;
 
@@ -379,6 +384,18 @@ static int validate_dma(struct msmsdcc_host *host, struct mmc_data *data)
 		return -EINVAL;
 	if ((data->blksz * data->blocks) % MCI_FIFOSIZE)
 		return -EINVAL;
+	if (data->sg_len > NR_SG)
+		return -EINVAL;
+
+	/*
+	 * Each segment is moved in whole FIFO-sized box rows, so a
+	 * segment that is not a multiple of the FIFO size would be
+	 * overrun. Such (rare) lists go through PIO instead.
+	 */
+	for_each_sg(data->sg, sg, data->sg_len, i)
+		if (sg->length % MCI_FIFOSIZE)
+			return -EINVAL;
+
 	return 0;
 }
 
@@ -459,6 +476,12 @@ static int msmsdcc_config_dma(struct msmsdcc_host *host, struct mmc_data *data)
 	host->dma.hdr.complete_func = msmsdcc_dma_complete_func;
 	host->dma.hdr.crci_mask = msm_dmov_build_crci_mask(1, host->dma.crci);
 
+	if (data->host_cookie) {
+		/* Already mapped by msmsdcc_pre_req(); write nc out */
+		dsb();
+		return 0;
+	}
+
 	n = dma_map_sg(mmc_dev(host->mmc), host->dma.sg,
 			host->dma.num_ents, host->dma.dir);
 	/* dsb inside dma_map_sg will write nc out to mem as well */
@@ -548,6 +571,9 @@ msmsdcc_start_data(struct msmsdcc_host *host, struct mmc_data *data,
 
 	/* Is data transfer in PIO mode required? */
 	if (!(datactrl & MCI_DPSM_DMAENABLE)) {
+		host->mmc->bounce.pio_reqs++;
+		host->mmc->bounce.pio_bytes += host->curr.xfer_size;
+
 		host->pio.sg = data->sg;
 		host->pio.sg_len = data->sg_len;
 		host->pio.sg_off = 0;
@@ -1081,6 +1107,48 @@ msmsdcc_request_start(struct msmsdcc_host *host, struct mmc_request *mrq)
 	}
 }
 
+/*
+ * Map the data buffers of the next request while the current one is
+ * still on the bus, so that the cache maintenance in dma_map_sg() does
+ * not add to the latency between two requests.
+ */
+static void
+msmsdcc_pre_req(struct mmc_host *mmc, struct mmc_request *mrq,
+		bool is_first_req)
+{
+	struct msmsdcc_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	enum dma_data_direction dir;
+
+	if (!data || data->host_cookie)
+		return;
+
+	/* Same test as msmsdcc_config_dma(); PIO requests stay unmapped */
+	if (validate_dma(host, data))
+		return;
+
+	dir = (data->flags & MMC_DATA_READ) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+	if (dma_map_sg(mmc_dev(mmc), data->sg, data->sg_len, dir) !=
+	    data->sg_len)
+		return;
+
+	data->host_cookie = 1;
+}
+
+static void
+msmsdcc_post_req(struct mmc_host *mmc, struct mmc_request *mrq, int err)
+{
+	struct mmc_data *data = mrq->data;
+	enum dma_data_direction dir;
+
+	if (!data || !data->host_cookie)
+		return;
+
+	dir = (data->flags & MMC_DATA_READ) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+	dma_unmap_sg(mmc_dev(mmc), data->sg, data->sg_len, dir);
+	data->host_cookie = 0;
+}
+
 static void
 msmsdcc_request(struct mmc_host *mmc, struct mmc_request *mrq)
 {
@@ -1424,6 +1492,8 @@ static int msmsdcc_disable(struct mmc_host *mmc, int lazy)
 static const struct mmc_host_ops msmsdcc_ops = {
 	.enable		= msmsdcc_enable,
 	.disable	= msmsdcc_disable,
+	.pre_req	= msmsdcc_pre_req,
+	.post_req	= msmsdcc_post_req,
 	.request	= msmsdcc_request,
 	.set_ios	= msmsdcc_set_ios,
 	.get_ro		= msmsdcc_get_ro,
@@ -1848,6 +1918,8 @@ msmsdcc_probe(struct platform_device *pdev)
 	mmc->caps |= plat->mmc_bus_width;
 
 	mmc->caps |= MMC_CAP_MMC_HIGHSPEED | MMC_CAP_SD_HIGHSPEED;
+	/* Only used with eMMC 4.5 parts that report them */
+	mmc->caps |= MMC_CAP_CACHE_CTRL | MMC_CAP_PACKED_WR;
 
 #if defined (CONFIG_WIFI_BCM4329_ZTE) || defined(CONFIG_WIFI_BCM4330_ZTE)
 	if(host->pdev_id == 4) {
@@ -1876,7 +1948,9 @@ msmsdcc_probe(struct platform_device *pdev)
 	mmc->max_blk_count = 65535;
 
 	mmc->max_req_size = 33554432;	/* MCI_DATA_LENGTH is 25 bits */
-	mmc->max_seg_size = mmc->max_req_size;
+	/* One box command per segment; num_rows is 16 bits of FIFO rows */
+	mmc->max_seg_size = min_t(unsigned int, mmc->max_req_size,
+				  MCI_FIFOSIZE * 0xffff);
 
 	writel_relaxed(0, host->base + MMCIMASK0);
 	writel_relaxed(MCI_CLEAR_STATIC_MASK, host->base + MMCICLEAR);
@@ -166,7 +166,11 @@
 
 #define MCI_FIFOHALFSIZE (MCI_FIFOSIZE / 2)
 
-#define NR_SG		32
+/*
+ * Box commands in the data mover list; bounds the number of segments a
+ * request may have before it is split by the block layer.
+ */
+#define NR_SG		128
 
 #define MSM_MMC_IDLE_TIMEOUT	10000 /* msecs */
 
@@ -32,11 +32,20 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
+/*
+ * The priority bits hold the node's minimum priority: a nice value for
+ * SCHED_NORMAL/SCHED_BATCH nodes (values above 19 mean no minimum), or an
+ * rt_priority for SCHED_FIFO/SCHED_RR nodes, as selected by the policy
+ * bits.  Threads handling calls to the node run at least at that priority.
+ */
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << 9,
 };
 
 /*
@@ -61,6 +70,30 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+/*
+ * A BINDER_TYPE_PTR object describes a buffer in the sender's memory that
+ * the driver copies into the target's transaction buffer, after the
+ * offsets array, rewriting 'buffer' to point at the copy.  This lets a
+ * parcel carry large or nested data without first flattening it into the
+ * data area.  If BINDER_BUFFER_FLAG_HAS_PARENT is set, 'parent' is the
+ * index in the offsets array of an earlier BINDER_TYPE_PTR object, and
+ * the pointer at 'parent_offset' inside that buffer's copy is rewritten
+ * as well.  The space for all copies is reserved with the buffers_size
+ * field of BC_TRANSACTION_SG and BC_REPLY_SG.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +180,11 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	size_t	buffers_size;	/* space for BINDER_TYPE_PTR copies */
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +362,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, for transactions
+	 * carrying BINDER_TYPE_PTR objects.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
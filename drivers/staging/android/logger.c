@@ -21,10 +21,16 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/device.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -34,31 +40,120 @@
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock', which is only ever held across memcpy()s of a single entry:
+ * all copying to and from user-space happens outside of it.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	int			binary;	/* payloads carry no priority/tag */
+	unsigned int		nr_filtered; /* readers with a filter */
+	atomic_t		pending; /* entries written since last wakeup */
+	unsigned long		flags;	/* LOGGER_WAKE_ARMED */
+	struct hrtimer		wake_timer; /* delivers batched wakeups */
+	struct logger_chunk	*evict;	/* chunk collecting evicted entries */
+	struct list_head	spare;	/* empty chunks for archive_entries() */
+	unsigned int		nr_spare; /* chunks on 'spare' */
+	struct list_head	raw;	/* full chunks awaiting compression */
+	struct logger_chunk	*compressing; /* 'raw' chunk being compressed */
+	struct list_head	archive; /* compressed chunks, oldest first */
+	size_t			archive_used;  /* compressed bytes retained */
+	size_t			archive_limit; /* 0 disables the archive */
+	u64			next_seq; /* sequence of the next chunk */
+	u64			first_seq; /* older chunks have been flushed */
+	struct work_struct	compress_work; /* compresses 'raw' chunks */
 };
 
+/*
+ * struct logger_chunk - a run of whole entries that fell off the ring
+ *
+ * Entries evicted from a log with a non-zero archive_limit are copied into
+ * a chunk instead of being lost. Full chunks are LZO-compressed from a work
+ * item and kept on log->archive until archive_limit is exceeded. New readers
+ * replay the archive, then the chunks not compressed yet, before starting
+ * on the ring.
+ *
+ * Chunks are allocated ahead of time by the work item, since entries are
+ * evicted under log->lock.
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in log->spare, ->raw or ->archive */
+	u64			seq;	/* order of this chunk within the log */
+	size_t			len;	/* uncompressed length of the entries */
+	size_t			clen;	/* stored length, == len if stored raw */
+	unsigned char		data[0];
+};
+
+/* capacity of a chunk; always holds at least one maximum-sized entry */
+#define LOGGER_CHUNK_SIZE	(16 * 1024 - sizeof(struct logger_chunk))
+
+/* empty chunks kept on log->spare between compress_work runs */
+#define LOGGER_SPARE_CHUNKS	2
+
+/* upper bound on the runtime-configurable ring size */
+#define LOGGER_MAX_LOG_BUF_SIZE	(8 * 1024 * 1024)
+
+/* set while wake_timer is queued, so writers don't keep pushing it out */
+#define LOGGER_WAKE_ARMED	0
+
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The offset is protected by log->lock; 'mutex'
+ * serializes read() calls sharing the bounce buffer. The filter may only be
+ * changed holding both.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* serializes reads on this reader */
+	unsigned char		*bounce; /* entry being copied to user-space */
+	u64			arch_seq; /* next archived chunk to replay */
+	u64			arch_end; /* archive replay stops here */
+	unsigned char		*arch_buf; /* decompressed chunk being replayed */
+	size_t			arch_off; /* next entry within arch_buf */
+	size_t			arch_len; /* valid bytes in arch_buf */
+	struct logger_filter	*filter; /* entries to return, NULL for all */
 };
 
+/*
+ * struct logger_wait - a reader sleeping in read()
+ *
+ * Lets the wake function see which reader a sleeper belongs to, so that
+ * filtered readers with nothing to read are left asleep.
+ */
+struct logger_wait {
+	wait_queue_t		wait;
+	struct logger_reader	*reader;
+};
+
+/* how much of an entry filter_match() needs to look at */
+#define LOGGER_FILTER_PEEK_LEN	\
+	(sizeof(struct logger_entry) + 1 + LOGGER_FILTER_TAG_LEN)
+
+/*
+ * Readers are woken once 'wake_batch' entries have been written, or at the
+ * latest 'wake_delay_us' microseconds after the first unannounced entry.
+ * Setting either to zero wakes readers on every entry.
+ */
+static unsigned int logger_wake_batch = 16;
+module_param_named(wake_batch, logger_wake_batch, uint, S_IRUGO | S_IWUSR);
+
+static unsigned int logger_wake_delay_us = 2000;
+module_param_named(wake_delay_us, logger_wake_delay_us, uint,
+		   S_IRUGO | S_IWUSR);
+
+/* entries up to this size are assembled on the writer's stack */
+#define LOGGER_STACK_ENTRY_LEN	256
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -89,7 +184,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,38 +203,240 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * filter_match - does the entry pass the filter? Only the first 'avail'
+ * bytes of the entry, header included, need to be present at 'entry'.
+ */
+static int filter_match(const struct logger_filter *filter,
+			const struct logger_entry *entry, size_t avail)
+{
+	size_t len = min_t(size_t, entry->len,
+			   avail - sizeof(struct logger_entry));
+	size_t tag_len;
+	unsigned int i;
+
+	if (filter->nr_pids) {
+		for (i = 0; i < filter->nr_pids; i++)
+			if (filter->pids[i] == entry->pid)
+				break;
+		if (i == filter->nr_pids)
+			return 0;
+	}
+
+	if (filter->min_prio && (!len ||
+	    (unsigned char) entry->msg[0] < filter->min_prio))
+		return 0;
+
+	if (filter->nr_tags) {
+		if (!len)
+			return 0;
+		tag_len = strnlen(entry->msg + 1, len - 1);
+		for (i = 0; i < filter->nr_tags; i++) {
+			size_t n = strnlen(filter->tags[i],
+					   LOGGER_FILTER_TAG_LEN);
+
+			if (n <= tag_len && !memcmp(entry->msg + 1,
+						    filter->tags[i], n))
+				break;
+		}
+		if (i == filter->nr_tags)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void copy_from_log(struct logger_log *log, void *buf, size_t off,
+			  size_t count);
+
+/*
+ * skip_filtered - advance a filtered reader past any entries its filter
+ * rejects, so that r_off == w_off again means "nothing to read"
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static void skip_filtered(struct logger_log *log, struct logger_reader *reader)
+{
+	unsigned char peek[LOGGER_FILTER_PEEK_LEN] __aligned(4);
+
+	if (likely(!reader->filter))
+		return;
+
+	while (reader->r_off != log->w_off) {
+		size_t len = get_entry_len(log, reader->r_off);
+		size_t avail = min_t(size_t, len, sizeof(peek));
+
+		copy_from_log(log, peek, reader->r_off, avail);
+		if (filter_match(reader->filter,
+				 (struct logger_entry *) peek, avail))
+			break;
+		reader->r_off = logger_offset(reader->r_off + len);
+	}
+}
+
+/*
+ * copy_from_log - copies exactly 'count' bytes starting at offset 'off' of
+ * 'log' into 'buf', unwrapping the ring.
+ *
+ * Caller must hold log->lock.
+ */
+static void copy_from_log(struct logger_log *log, void *buf, size_t off,
+			  size_t count)
 {
 	size_t len;
 
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
-	 * the current read head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
+	 * 'off' up to 'count' bytes or to the end of the log, whichever comes
+	 * first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+		memcpy(buf + len, log->buffer, count - len);
+}
 
+/*
+ * do_read_log - reads exactly 'count' bytes from 'log' into the reader's
+ * bounce buffer and advances its read head past them.
+ *
+ * Caller must hold log->lock.
+ */
+static void do_read_log(struct logger_log *log, struct logger_reader *reader,
+			size_t count)
+{
+	copy_from_log(log, reader->bounce, reader->r_off, count);
 	reader->r_off = logger_offset(reader->r_off + count);
+}
 
-	return count;
+/*
+ * find_chunk - returns the oldest chunk of history with a sequence number
+ * in ['seq', 'end'), whether it is archived, waiting to be compressed or
+ * still collecting evicted entries. Chunks are numbered in that order.
+ *
+ * Caller must hold log->lock.
+ */
+static struct logger_chunk *find_chunk(struct logger_log *log, u64 seq,
+				       u64 end)
+{
+	struct logger_chunk *chunk;
+
+	/* the chunk being compressed may have been flushed meanwhile */
+	if (seq < log->first_seq)
+		seq = log->first_seq;
+
+	list_for_each_entry(chunk, &log->archive, list)
+		if (chunk->seq >= seq)
+			goto found;
+	list_for_each_entry(chunk, &log->raw, list)
+		if (chunk->seq >= seq)
+			goto found;
+	chunk = log->evict;
+	if (!chunk || chunk->seq < seq)
+		return NULL;
+found:
+	return chunk->seq < end ? chunk : NULL;
+}
+
+/*
+ * logger_read_archive - replays one archived entry to a new reader
+ *
+ * Returns the size of the entry copied to 'buf', zero once the reader has
+ * caught up with the archive and should move on to the ring, or a negative
+ * error code.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t logger_read_archive(struct logger_log *log,
+				   struct logger_reader *reader,
+				   char __user *buf, size_t count)
+{
+	struct logger_entry *entry;
+	struct logger_chunk *chunk;
+	size_t len, clen;
+	ssize_t ret;
+
+again:
+	if (reader->arch_off >= reader->arch_len) {
+		if (!reader->arch_buf) {
+			reader->arch_buf = vmalloc(2 * LOGGER_CHUNK_SIZE);
+			if (!reader->arch_buf)
+				return -ENOMEM;
+		}
+
+		/*
+		 * Copy the stored chunk out under the lock; it may be trimmed
+		 * from the archive, or replaced by its compressed copy, as
+		 * soon as the lock is dropped.
+		 */
+		clen = 0;
+		spin_lock(&log->lock);
+		chunk = find_chunk(log, reader->arch_seq, reader->arch_end);
+		if (chunk) {
+			reader->arch_seq = chunk->seq + 1;
+			len = chunk->len;
+			clen = chunk->clen;
+			memcpy(reader->arch_buf + (clen == len ? 0 :
+			       LOGGER_CHUNK_SIZE), chunk->data, clen);
+		}
+		spin_unlock(&log->lock);
+
+		if (!clen) {
+			reader->arch_seq = reader->arch_end;
+			return 0;
+		}
+
+		if (clen != len) {
+			ret = lzo1x_decompress_safe(reader->arch_buf +
+						    LOGGER_CHUNK_SIZE, clen,
+						    reader->arch_buf, &len);
+			if (unlikely(ret != LZO_E_OK))
+				return -EIO;
+		}
+
+		reader->arch_off = 0;
+		reader->arch_len = len;
+	}
+
+	entry = (struct logger_entry *) (reader->arch_buf + reader->arch_off);
+	len = sizeof(struct logger_entry) + entry->len;
+	if (reader->filter && !filter_match(reader->filter, entry, len)) {
+		reader->arch_off += len;
+		goto again;
+	}
+
+	if (count < len)
+		return -EINVAL;
+
+	if (copy_to_user(buf, entry, len))
+		return -EFAULT;
+
+	reader->arch_off += len;
+
+	return len;
+}
+
+/*
+ * logger_reader_wake - wake function for readers sleeping in read()
+ *
+ * Writers skip filtered readers past entries they don't want, so a filtered
+ * reader that is still caught up has nothing to read and is not woken.
+ */
+static int logger_reader_wake(wait_queue_t *wait, unsigned mode, int sync,
+			      void *key)
+{
+	struct logger_reader *reader =
+		container_of(wait, struct logger_wait, wait)->reader;
+
+	if (reader->filter &&
+	    ACCESS_ONCE(reader->r_off) == ACCESS_ONCE(reader->log->w_off))
+		return 0;
+
+	return autoremove_wake_function(wait, mode, sync, key);
 }
 
 /*
@@ -160,15 +457,43 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
-	DEFINE_WAIT(wait);
+	struct logger_wait wait = {
+		.wait = {
+			.private	= current,
+			.func		= logger_reader_wake,
+			.task_list	= LIST_HEAD_INIT(wait.wait.task_list),
+		},
+		.reader = reader,
+	};
+
+	/* new readers first replay whatever history was archived */
+	if (unlikely(reader->arch_seq < reader->arch_end ||
+		     reader->arch_off < reader->arch_len)) {
+		mutex_lock(&reader->mutex);
+		ret = 0;
+		while (reader->arch_seq < reader->arch_end ||
+		       reader->arch_off < reader->arch_len) {
+			ret = logger_read_archive(log, reader, buf, count);
+			if (ret)
+				break;
+		}
+		if (!ret) {
+			vfree(reader->arch_buf);
+			reader->arch_buf = NULL;
+		}
+		mutex_unlock(&reader->mutex);
+		if (ret)
+			return ret;
+	}
 
 start:
 	while (1) {
-		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
+		prepare_to_wait(&log->wq, &wait.wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
+		skip_filtered(log, reader);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -185,30 +510,41 @@ start:
 		schedule();
 	}
 
-	finish_wait(&log->wq, &wait);
+	finish_wait(&log->wq, &wait.wait);
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	mutex_lock(&reader->mutex);
+	spin_lock(&log->lock);
+	skip_filtered(log, reader);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+		mutex_unlock(&reader->mutex);
 		goto start;
 	}
 
 	/* get the size of the next entry */
 	ret = get_entry_len(log, reader->r_off);
 	if (count < ret) {
+		spin_unlock(&log->lock);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/*
+	 * Get exactly one entry from the log. It is staged in the bounce
+	 * buffer so that a faulting user buffer never stalls writers.
+	 */
+	do_read_log(log, reader, ret);
+	spin_unlock(&log->lock);
+
+	if (copy_to_user(buf, reader->bounce, ret))
+		ret = -EFAULT;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -217,7 +553,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -249,13 +585,56 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * archive_entries - saves the entries between 'off' and 'end', which are
+ * about to be overwritten, into the log's archive chunks. Entries are
+ * dropped, as they always were, if compress_work has not provided a spare
+ * chunk in time.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void archive_entries(struct logger_log *log, size_t off, size_t end)
+{
+	struct logger_chunk *chunk = log->evict;
+
+	while (off != end) {
+		size_t nr = get_entry_len(log, off);
+
+		if (!chunk || chunk->len + nr > LOGGER_CHUNK_SIZE) {
+			if (chunk)
+				list_add_tail(&chunk->list, &log->raw);
+			chunk = NULL;
+			if (log->nr_spare) {
+				chunk = list_first_entry(&log->spare,
+							 struct logger_chunk,
+							 list);
+				list_del(&chunk->list);
+				log->nr_spare--;
+				chunk->seq = log->next_seq++;
+				chunk->len = 0;
+			}
+			/* compress the full chunk and refill the spares */
+			schedule_work(&log->compress_work);
+		}
+
+		if (chunk) {
+			copy_from_log(log, chunk->data + chunk->len, off, nr);
+			chunk->len += nr;
+			chunk->clen = chunk->len;
+		}
+		off = logger_offset(off + nr);
+	}
+
+	log->evict = chunk;
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -263,8 +642,13 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		if (log->archive_limit)
+			archive_entries(log, log->head, head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -274,7 +658,7 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -291,94 +675,388 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * logger_wake_timer - delivers the wakeup for entries that did not fill a
+ * whole batch within wake_delay_us.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static enum hrtimer_restart logger_wake_timer(struct hrtimer *timer)
 {
-	size_t len;
+	struct logger_log *log = container_of(timer, struct logger_log,
+					      wake_timer);
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	atomic_set(&log->pending, 0);
+	clear_bit(LOGGER_WAKE_ARMED, &log->flags);
+	smp_mb__after_clear_bit();
+	wake_up_interruptible(&log->wq);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	return HRTIMER_NORESTART;
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * logger_wake_readers - tell readers about a newly written entry
+ *
+ * Wakeups are coalesced: readers are woken directly once a full batch of
+ * entries is pending, otherwise the wake timer is armed (if it is not
+ * already) so that a lone entry is still delivered promptly.
+ */
+static void logger_wake_readers(struct logger_log *log)
+{
+	unsigned int batch = logger_wake_batch;
+	unsigned int delay = logger_wake_delay_us;
+
+	if (batch <= 1 || !delay ||
+	    atomic_inc_return(&log->pending) >= batch) {
+		atomic_set(&log->pending, 0);
+		wake_up_interruptible(&log->wq);
+		return;
+	}
 
-	return count;
+	if (!test_and_set_bit(LOGGER_WAKE_ARMED, &log->flags))
+		hrtimer_start(&log->wake_timer,
+			      ns_to_ktime((u64)delay * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled privately first, so that faulting in the caller's
+ * buffer happens without any lock held. Only the final memcpy() into the
+ * ring, which cannot sleep, is done under log->lock.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	u32 stack_buf[LOGGER_STACK_ENTRY_LEN / sizeof(u32)];
+	struct logger_entry *entry;
 	struct timespec now;
+	size_t len, total;
 	ssize_t ret = 0;
 
-	now = current_kernel_time();
-
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	total = sizeof(struct logger_entry) + len;
+	if (total <= sizeof(stack_buf))
+		entry = (struct logger_entry *) stack_buf;
+	else {
+		entry = kmalloc(total, GFP_KERNEL);
+		if (!entry)
+			return -ENOMEM;
+	}
+
+	while (nr_segs-- > 0 && ret < len) {
+		/* figure out how much of this vector we can keep */
+		size_t nr = min_t(size_t, iov->iov_len, len - ret);
+
+		/* gather this segment's payload */
+		if (unlikely(copy_from_user(entry->msg + ret, iov->iov_base,
+					    nr))) {
+			ret = -EFAULT;
+			goto out;
+		}
+
+		iov++;
+		ret += nr;
+	}
+
+	entry->len = len;
+	entry->__pad = 0;
+	entry->pid = current->tgid;
+	entry->tid = current->pid;
+
+	spin_lock(&log->lock);
+
+	/*
+	 * Stamp the entry under the lock, so that the order of entries in the
+	 * ring is also their timestamp order, no matter which CPU the writers
+	 * ran on.
+	 */
+	now = current_kernel_time();
+	entry->sec = now.tv_sec;
+	entry->nsec = now.tv_nsec;
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * entry after (what will be) the new write offset.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	fix_up_readers(log, total);
+	do_write_log(log, entry, total);
+
+	/*
+	 * Caught-up readers that don't want this entry are moved past it
+	 * right away, so the wakeup below leaves them asleep.
+	 */
+	if (unlikely(log->nr_filtered)) {
+		struct logger_reader *reader;
+		size_t old = logger_offset(log->w_off - total);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+		list_for_each_entry(reader, &log->readers, list)
+			if (reader->filter && reader->r_off == old &&
+			    !filter_match(reader->filter, entry, total))
+				reader->r_off = log->w_off;
+	}
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	spin_unlock(&log->lock);
 
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+	/* wake up any blocked readers, in batches */
+	logger_wake_readers(log);
+
+out:
+	if (entry != (struct logger_entry *) stack_buf)
+		kfree(entry);
+
+	return ret;
+}
+
+/* LZO state shared by all logs; also serializes compress_work runs */
+static DEFINE_MUTEX(logger_compress_mutex);
+static void *logger_lzo_wrkmem;
+static unsigned char *logger_lzo_dst;
+
+/*
+ * trim_archive - drop the oldest archived chunks until the archive fits in
+ * its limit again. The chunks are moved to 'dead' for the caller to free.
+ *
+ * The caller needs to hold log->lock.
+ */
+static void trim_archive(struct logger_log *log, struct list_head *dead)
+{
+	struct logger_chunk *chunk, *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, &log->archive, list) {
+		if (log->archive_used <= log->archive_limit)
+			break;
+		log->archive_used -= chunk->clen;
+		list_move_tail(&chunk->list, dead);
+	}
+}
+
+static void free_chunks(struct list_head *list)
+{
+	struct logger_chunk *chunk, *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, list, list)
+		kfree(chunk);
+}
+
+/*
+ * trim_spare - keep no more than 'nr' spare chunks, moving the others to
+ * 'dead' for the caller to free
+ *
+ * The caller needs to hold log->lock.
+ */
+static void trim_spare(struct logger_log *log, unsigned int nr,
+		       struct list_head *dead)
+{
+	while (log->nr_spare > nr) {
+		list_move(log->spare.next, dead);
+		log->nr_spare--;
+	}
+}
+
+/*
+ * fill_spare - allocates spare chunks until the log has 'nr' of them, so
+ * that archive_entries() never needs to allocate under log->lock
+ */
+static void fill_spare(struct logger_log *log, unsigned int nr)
+{
+	struct logger_chunk *chunk;
+
+	while (1) {
+		spin_lock(&log->lock);
+		if (!log->archive_limit || log->nr_spare >= nr) {
+			spin_unlock(&log->lock);
+			break;
 		}
+		spin_unlock(&log->lock);
 
-		iov++;
-		ret += nr;
+		chunk = kmalloc(sizeof(*chunk) + LOGGER_CHUNK_SIZE, GFP_KERNEL);
+		if (!chunk)
+			break;
+
+		spin_lock(&log->lock);
+		list_add(&chunk->list, &log->spare);
+		log->nr_spare++;
+		spin_unlock(&log->lock);
 	}
+}
 
-	mutex_unlock(&log->mutex);
+/*
+ * logger_compress_work - compresses full chunks of evicted entries and adds
+ * them to the archive, then refills the log's spare chunks
+ *
+ * A chunk stays on log->raw, where readers find it, until its compressed
+ * copy replaces it. A flush in the meantime leaves it there for us to drop.
+ */
+static void logger_compress_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      compress_work);
+	struct logger_chunk *raw, *chunk;
+	LIST_HEAD(dead);
+
+	mutex_lock(&logger_compress_mutex);
+
+	if (!logger_lzo_wrkmem) {
+		logger_lzo_wrkmem = vmalloc(LZO1X_MEM_COMPRESS);
+		logger_lzo_dst = vmalloc(lzo1x_worst_compress(LOGGER_CHUNK_SIZE));
+		if (!logger_lzo_wrkmem || !logger_lzo_dst) {
+			vfree(logger_lzo_wrkmem);
+			vfree(logger_lzo_dst);
+			logger_lzo_wrkmem = NULL;
+			logger_lzo_dst = NULL;
+		}
+	}
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	while (1) {
+		size_t clen = 0;
+		const void *src;
 
-	return ret;
+		spin_lock(&log->lock);
+		if (list_empty(&log->raw)) {
+			spin_unlock(&log->lock);
+			break;
+		}
+		raw = list_first_entry(&log->raw, struct logger_chunk, list);
+		log->compressing = raw;
+		spin_unlock(&log->lock);
+
+		/* store the chunk as it is if it doesn't get any smaller */
+		src = raw->data;
+		if (logger_lzo_wrkmem &&
+		    lzo1x_1_compress(raw->data, raw->len, logger_lzo_dst,
+				     &clen, logger_lzo_wrkmem) == LZO_E_OK &&
+		    clen < raw->len)
+			src = logger_lzo_dst;
+		else
+			clen = raw->len;
+
+		chunk = kmalloc(sizeof(*chunk) + clen, GFP_KERNEL);
+		if (chunk) {
+			chunk->seq = raw->seq;
+			chunk->len = raw->len;
+			chunk->clen = clen;
+			memcpy(chunk->data, src, clen);
+		}
+
+		spin_lock(&log->lock);
+		log->compressing = NULL;
+		list_del(&raw->list);
+		if (chunk && raw->seq >= log->first_seq) {
+			list_add_tail(&chunk->list, &log->archive);
+			log->archive_used += clen;
+			trim_archive(log, &dead);
+		} else if (chunk)
+			list_add(&chunk->list, &dead);
+		spin_unlock(&log->lock);
+
+		kfree(raw);
+	}
+
+	mutex_unlock(&logger_compress_mutex);
+
+	fill_spare(log, LOGGER_SPARE_CHUNKS);
+
+	free_chunks(&dead);
+}
+
+/*
+ * logger_set_size - replaces the log's ring with a 'size' byte one
+ *
+ * The newest entries that fit are carried over to the new ring; when
+ * shrinking, the oldest ones are archived (or dropped) as if the writer had
+ * lapped them. Readers keep their position relative to the surviving
+ * entries.
+ */
+static int logger_set_size(struct logger_log *log, size_t size)
+{
+	struct logger_reader *reader;
+	unsigned char *buffer;
+	size_t used, skip, off, room, start;
+	LIST_HEAD(dead);
+
+	if (!is_power_of_2(size) || size <= LOGGER_ENTRY_MAX_LEN ||
+	    size > LOGGER_MAX_LOG_BUF_SIZE)
+		return -EINVAL;
+
+	buffer = vmalloc(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	/* enough chunks to archive everything shrinking may drop */
+	if (size < log->size)
+		fill_spare(log, LOGGER_SPARE_CHUNKS + 1 +
+			   DIV_ROUND_UP(log->size - size + LOGGER_ENTRY_MAX_LEN,
+					LOGGER_CHUNK_SIZE - LOGGER_ENTRY_MAX_LEN));
+
+	spin_lock(&log->lock);
+
+	used = logger_offset(log->w_off - log->head);
+	skip = 0;
+	while (used - skip >= size)
+		skip += get_entry_len(log, logger_offset(log->head + skip));
+
+	off = logger_offset(log->head + skip);
+	if (skip && log->archive_limit) {
+		/* if the spares run short, rather lose the oldest entries */
+		room = log->nr_spare * (LOGGER_CHUNK_SIZE - LOGGER_ENTRY_MAX_LEN);
+		start = 0;
+		while (skip - start > room)
+			start += get_entry_len(log,
+					logger_offset(log->head + start));
+		archive_entries(log, logger_offset(log->head + start), off);
+		trim_spare(log, LOGGER_SPARE_CHUNKS, &dead);
+	}
+	copy_from_log(log, buffer, off, used - skip);
+
+	list_for_each_entry(reader, &log->readers, list) {
+		size_t rel = logger_offset(reader->r_off - log->head);
+
+		reader->r_off = rel > skip ? rel - skip : 0;
+	}
+
+	swap(log->buffer, buffer);
+	log->size = size;
+	log->head = 0;
+	log->w_off = used - skip;
+
+	spin_unlock(&log->lock);
+
+	vfree(buffer);
+	free_chunks(&dead);
+
+	return 0;
+}
+
+/*
+ * logger_set_archive_limit - sets how many bytes of compressed history the
+ * log keeps; zero disables archiving and frees the archive
+ */
+static void logger_set_archive_limit(struct logger_log *log, size_t limit)
+{
+	struct logger_chunk *evict = NULL;
+	LIST_HEAD(dead);
+
+	spin_lock(&log->lock);
+	log->archive_limit = limit;
+	trim_archive(log, &dead);
+	if (!limit) {
+		evict = log->evict;
+		log->evict = NULL;
+		trim_spare(log, 0, &dead);
+	}
+	spin_unlock(&log->lock);
+
+	kfree(evict);
+	free_chunks(&dead);
+
+	fill_spare(log, LOGGER_SPARE_CHUNKS);
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -408,13 +1086,32 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->bounce = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->bounce) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
-
-		mutex_lock(&log->mutex);
+		mutex_init(&reader->mutex);
+		reader->arch_buf = NULL;
+		reader->arch_off = 0;
+		reader->arch_len = 0;
+		reader->filter = NULL;
+
+		/*
+		 * History runs up to the chunk collecting evicted entries, so
+		 * it joins up with log->head.
+		 */
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
+		reader->arch_seq = log->first_seq;
+		reader->arch_end = list_empty(&log->archive) &&
+				   list_empty(&log->raw) && !log->evict ?
+				   log->first_seq : log->next_seq;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -433,9 +1130,14 @@ static int logger_release(struct inode *ignored, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		if (reader->filter)
+			log->nr_filtered--;
+		spin_unlock(&log->lock);
+		kfree(reader->filter);
+		vfree(reader->arch_buf);
+		kfree(reader->bounce);
 		kfree(reader);
 	}
 
@@ -465,21 +1167,82 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	skip_filtered(log, reader);
+	if (log->w_off != reader->r_off ||
+	    reader->arch_seq < reader->arch_end ||
+	    reader->arch_off < reader->arch_len)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_set_filter - installs 'filter' on the reader, or removes the
+ * current one if 'filter' is NULL. Takes ownership of 'filter'.
+ */
+static long logger_set_filter(struct logger_reader *reader,
+			      struct logger_filter *filter)
+{
+	struct logger_log *log = reader->log;
+	struct logger_filter *old;
+
+	if (filter && (filter->nr_pids > LOGGER_FILTER_MAX_PIDS ||
+		       filter->nr_tags > LOGGER_FILTER_MAX_TAGS ||
+		       (log->binary && (filter->min_prio || filter->nr_tags)))) {
+		kfree(filter);
+		return -EINVAL;
+	}
+
+	mutex_lock(&reader->mutex);
+	spin_lock(&log->lock);
+	old = reader->filter;
+	reader->filter = filter;
+	log->nr_filtered += !!filter - !!old;
+	spin_unlock(&log->lock);
+	mutex_unlock(&reader->mutex);
+
+	kfree(old);
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_chunk *evict = NULL, *chunk, *tmp;
+	LIST_HEAD(dead);
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_SET_LOG_BUF_SIZE) {
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return logger_set_size(log, arg);
+	}
+
+	if (cmd == LOGGER_SET_FILTER || cmd == LOGGER_CLEAR_FILTER) {
+		struct logger_filter *filter = NULL;
+
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+
+		if (cmd == LOGGER_SET_FILTER) {
+			filter = kmalloc(sizeof(*filter), GFP_KERNEL);
+			if (!filter)
+				return -ENOMEM;
+			if (copy_from_user(filter, (void __user *) arg,
+					   sizeof(*filter))) {
+				kfree(filter);
+				return -EFAULT;
+			}
+		}
+
+		return logger_set_filter(file->private_data, filter);
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -502,6 +1265,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		skip_filtered(log, reader);
 		if (log->w_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
@@ -515,11 +1279,23 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
+		list_splice_init(&log->archive, &dead);
+		log->archive_used = 0;
+		/* compress_work drops the chunk it is working on itself */
+		list_for_each_entry_safe(chunk, tmp, &log->raw, list)
+			if (chunk != log->compressing)
+				list_move_tail(&chunk->list, &dead);
+		evict = log->evict;
+		log->evict = NULL;
+		log->first_seq = log->next_seq;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	kfree(evict);
+	free_chunks(&dead);
 
 	return ret;
 }
@@ -535,15 +1311,89 @@ static const struct file_operations logger_fops = {
 	.release = logger_release,
 };
 
+static struct logger_log *dev_get_log(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct logger_log, misc);
+}
+
+static ssize_t buffer_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%zu\n", dev_get_log(dev)->size);
+}
+
+static ssize_t buffer_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	unsigned long size;
+	int ret;
+
+	if (strict_strtoul(buf, 0, &size))
+		return -EINVAL;
+
+	ret = logger_set_size(dev_get_log(dev), size);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(buffer_size, S_IRUGO | S_IWUSR, buffer_size_show,
+		   buffer_size_store);
+
+static ssize_t archive_size_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%zu\n", dev_get_log(dev)->archive_limit);
+}
+
+static ssize_t archive_size_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	unsigned long limit;
+
+	if (strict_strtoul(buf, 0, &limit))
+		return -EINVAL;
+
+	logger_set_archive_limit(dev_get_log(dev), limit);
+
+	return count;
+}
+
+static DEVICE_ATTR(archive_size, S_IRUGO | S_IWUSR, archive_size_show,
+		   archive_size_store);
+
+static ssize_t archive_used_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%zu\n", dev_get_log(dev)->archive_used);
+}
+
+static DEVICE_ATTR(archive_used, S_IRUGO, archive_used_show, NULL);
+
+static struct attribute *logger_attrs[] = {
+	&dev_attr_buffer_size.attr,
+	&dev_attr_archive_size.attr,
+	&dev_attr_archive_used.attr,
+	NULL,
+};
+
+static const struct attribute_group logger_attr_group = {
+	.attrs = logger_attrs,
+};
+
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' and an initial size of 'SIZE'
+ * bytes, which must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and
+ * no more than LOGGER_MAX_LOG_BUF_SIZE. The ring itself is vmalloc()ed when
+ * the log is registered, and can be resized later through
+ * LOGGER_SET_LOG_BUF_SIZE or the 'buffer_size' sysfs attribute. 'BINARY'
+ * marks logs whose payloads are not priority/tag/message text.
  */
-#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE, BINARY) \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -552,17 +1402,24 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.binary = BINARY, \
+	.pending = ATOMIC_INIT(0), \
+	.spare = LIST_HEAD_INIT(VAR .spare), \
+	.raw = LIST_HEAD_INIT(VAR .raw), \
+	.archive = LIST_HEAD_INIT(VAR .archive), \
+	.compress_work = __WORK_INITIALIZER(VAR .compress_work, \
+					    logger_compress_work), \
 };
 
-DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
-DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024)
-DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024)
-DEFINE_LOGGER_DEVICE(log_kernel, LOGGER_LOG_KERNEL, 64*1024)
+DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024, 0)
+DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024, 1)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024, 0)
+DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024, 0)
+DEFINE_LOGGER_DEVICE(log_kernel, LOGGER_LOG_KERNEL, 64*1024, 0)
 
 static struct logger_log *get_log_from_minor(int minor)
 {
@@ -583,13 +1440,30 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	hrtimer_init(&log->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	log->wake_timer.function = logger_wake_timer;
+
+	log->buffer = vmalloc(log->size);
+	if (unlikely(!log->buffer)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->buffer);
 		return ret;
 	}
 
+	ret = sysfs_create_group(&log->misc.this_device->kobj,
+				 &logger_attr_group);
+	if (unlikely(ret))
+		printk(KERN_WARNING "logger: failed to create sysfs "
+		       "attributes for log '%s'\n", log->misc.name);
+
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
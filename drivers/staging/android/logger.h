@@ -40,11 +40,35 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+#define LOGGER_FILTER_MAX_PIDS	16
+#define LOGGER_FILTER_MAX_TAGS	8
+#define LOGGER_FILTER_TAG_LEN	32
+
+/*
+ * struct logger_filter - entries a reader wants to see
+ *
+ * An entry is returned only if it passes every enabled test. A zero count
+ * or priority disables the corresponding test. Priority and tags are only
+ * understood for text logs, where the payload starts with a priority byte
+ * followed by a NUL-terminated tag.
+ */
+struct logger_filter {
+	__s32	pids[LOGGER_FILTER_MAX_PIDS];	/* generating process in set */
+	__u32	nr_pids;			/* valid entries in pids[] */
+	__u32	min_prio;			/* priority at least this */
+	__u32	nr_tags;			/* valid entries in tags[] */
+	char	tags[LOGGER_FILTER_MAX_TAGS][LOGGER_FILTER_TAG_LEN];
+						/* tag starts with one of these */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_LOG_BUF_SIZE		_IO(__LOGGERIO, 5) /* resize log */
+#define LOGGER_SET_FILTER		_IOW(__LOGGERIO, 6, struct logger_filter)
+#define LOGGER_CLEAR_FILTER		_IO(__LOGGERIO, 7) /* see everything */
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,15 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in per-oom_adj buckets, updated as processes are forked,
+ * exit or have their oom_adj written, so that picking a victim only looks at
+ * the highest non-empty bucket instead of every process in the system.
+ *
+ * Free memory is also compared against the thresholds as it is predicted to
+ * be /sys/module/lowmemorykiller/parameters/predict_ms from now, from the
+ * rate at which it has been falling, so that a fast-growing app is answered
+ * before free memory actually crosses minfree. Write 0 to disable this.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +44,7 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/jiffies.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +65,33 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static DEFINE_SPINLOCK(lowmem_deathpending_lock);
 
+static uint32_t lowmem_predict_ms = 200;
+
+/*
+ * Thread group leaders by oom_adj, from OOM_DISABLE up to OOM_ADJUST_MAX.
+ * Leaders are only ever added and removed from process context, through
+ * lowmem_oom_adj_notify().
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_buckets[LOWMEM_ADJ_BUCKETS];
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+/*
+ * lowmem_trend - how fast a page count has been changing
+ *
+ * 'rate' is a moving average in pages per second; negative while the count
+ * is falling.
+ */
+struct lowmem_trend {
+	unsigned long stamp;	/* jiffies of the last sample */
+	int last;		/* page count at 'stamp' */
+	int rate;		/* pages per second */
+};
+
+static struct lowmem_trend lowmem_free_trend;
+static struct lowmem_trend lowmem_file_trend;
+static DEFINE_SPINLOCK(lowmem_trend_lock);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -69,6 +106,13 @@ static struct notifier_block task_nb = {
 };
 
 
+static int lowmem_oom_adj_notify(struct notifier_block *self,
+				 unsigned long event, void *data);
+
+static struct notifier_block lowmem_oom_adj_nb = {
+	.notifier_call	= lowmem_oom_adj_notify,
+};
+
 static void task_free_fn(struct work_struct *work)
 {
 	unsigned long flags;
@@ -91,6 +135,64 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static int
+lowmem_oom_adj_notify(struct notifier_block *self, unsigned long event,
+		      void *data)
+{
+	struct task_struct *task = data;
+	int oom_adj;
+
+	if (!thread_group_leader(task))
+		return NOTIFY_DONE;
+
+	spin_lock(&lowmem_bucket_lock);
+	if (event == OOM_ADJ_NOTIFY_EXIT || (task->flags & PF_EXITING)) {
+		/*
+		 * Checking PF_EXITING under the lock means a leader that has
+		 * already been taken out on exit is never put back.
+		 */
+		list_del_init(&task->oom_adj_node);
+	} else {
+		oom_adj = task->signal->oom_adj;
+		if (oom_adj >= OOM_DISABLE && oom_adj <= OOM_ADJUST_MAX)
+			list_move_tail(&task->oom_adj_node,
+				       &lowmem_buckets[oom_adj - OOM_DISABLE]);
+	}
+	spin_unlock(&lowmem_bucket_lock);
+
+	return NOTIFY_OK;
+}
+
+/*
+ * lowmem_predict - update 'trend' with the current page count 'pages' and
+ * return the count predicted lowmem_predict_ms from now. A count that is not
+ * falling is returned unchanged.
+ */
+static int lowmem_predict(struct lowmem_trend *trend, int pages)
+{
+	unsigned long now = jiffies;
+	long elapsed = now - trend->stamp;
+	int rate;
+
+	/* samples closer than a couple of ticks apart are mostly noise */
+	if (elapsed >= 2) {
+		rate = (long)(pages - trend->last) * HZ / elapsed;
+		if (elapsed > HZ)
+			trend->rate = rate;
+		else
+			trend->rate = (3 * trend->rate + rate) / 4;
+		trend->last = pages;
+		trend->stamp = now;
+	}
+
+	if (!lowmem_predict_ms || trend->rate >= 0)
+		return pages;
+
+	pages += (long)trend->rate * (long)lowmem_predict_ms / MSEC_PER_SEC;
+
+	return max(pages, 0);
+}
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
@@ -104,6 +206,7 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
+	int predicted_free, predicted_file;
 	unsigned long flags;
 
 	/*
@@ -120,17 +223,24 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+
+	spin_lock(&lowmem_trend_lock);
+	predicted_free = lowmem_predict(&lowmem_free_trend, other_free);
+	predicted_file = lowmem_predict(&lowmem_file_trend, other_file);
+	spin_unlock(&lowmem_trend_lock);
+
 	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-				other_file < lowmem_minfree[i]) {
+		if (predicted_free < lowmem_minfree[i] &&
+				predicted_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
 			break;
 		}
 	}
 	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
+		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, "
+			     "predicted %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
-			     min_adj);
+			     predicted_free, predicted_file, min_adj);
 	rem = global_page_state(NR_ACTIVE_ANON) +
 		global_page_state(NR_ACTIVE_FILE) +
 		global_page_state(NR_INACTIVE_ANON) +
@@ -142,40 +252,35 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+	/*
+	 * Only the highest non-empty bucket at or above min_adj is searched;
+	 * within it, the largest process is the victim.
+	 */
+	spin_lock(&lowmem_bucket_lock);
+	for (i = OOM_ADJUST_MAX; i >= max(min_adj, OOM_DISABLE) && !selected;
+	     i--) {
+		list_for_each_entry(p, &lowmem_buckets[i - OOM_DISABLE],
+				    oom_adj_node) {
+			struct mm_struct *mm;
+
+			task_lock(p);
+			mm = p->mm;
+			if (!mm) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			if (tasksize <= 0)
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			if (selected && tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = i;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", p->pid, p->comm, i, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
 
 	if (selected) {
@@ -194,7 +299,7 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
+	spin_unlock(&lowmem_bucket_lock);
 	return rem;
 }
 
@@ -205,13 +310,40 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	/*
+	 * Register first, so that nothing forked while we sort the existing
+	 * processes into their buckets is missed.
+	 */
+	register_oom_adj_notifier(&lowmem_oom_adj_nb);
+	read_lock(&tasklist_lock);
+	for_each_process(p)
+		lowmem_oom_adj_notify(NULL, OOM_ADJ_NOTIFY_SET, p);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct task_struct *p, *tmp;
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&lowmem_oom_adj_nb);
+
+	spin_lock(&lowmem_bucket_lock);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		list_for_each_entry_safe(p, tmp, &lowmem_buckets[i],
+					 oom_adj_node)
+			list_del_init(&p->oom_adj_node);
+	spin_unlock(&lowmem_bucket_lock);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -220,6 +352,7 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(predict_ms, lowmem_predict_ms, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -23,8 +23,8 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
@@ -38,6 +38,8 @@ static struct ramzswap *devices;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static char compressor[RZS_COMPRESSOR_NAME_LEN] = RZS_DEFAULT_COMPRESSOR;
+static int dedup = 1;
 
 static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
@@ -57,18 +59,23 @@ static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check if the page is a single word repeated (typically zero) and if so,
+ * return that word in 'element'.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -126,7 +133,7 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
 
-	mem_used = xv_get_total_size_bytes(rzs->mem_pool)
+	mem_used = zs_get_total_size_bytes(rzs->mem_pool)
 			+ (rs->pages_expand << PAGE_SHIFT);
 	succ_writes = rzs_stat64_read(rzs, &rs->num_writes) -
 			rzs_stat64_read(rzs, &rs->failed_writes);
@@ -145,6 +152,8 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	s->invalid_io = rzs_stat64_read(rzs, &rs->invalid_io);
 	s->notify_free = rzs_stat64_read(rzs, &rs->notify_free);
 	s->pages_zero = rs->pages_zero;
+	s->pages_same = rs->pages_same;
+	s->pages_dup = rs->pages_dup;
 
 	s->good_compress_pct = good_compress_perc;
 	s->pages_expand_pct = no_compress_perc;
@@ -154,43 +163,160 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
 	s->compr_data_size = rs->compr_size;
 	s->mem_used_total = mem_used;
+	s->mem_slack = zs_get_slack_bytes(rzs->mem_pool);
+	s->pages_compacted = zs_get_pages_compacted(rzs->mem_pool);
+	s->pages_wb = rs->pages_wb;
+	s->wb_writes = rzs_stat64_read(rzs, &rs->wb_writes);
+	s->wb_reads = rzs_stat64_read(rzs, &rs->wb_reads);
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+/*
+ * Look for a stored object with the same compressed data.
+ *
+ * Caller must hold rzs->lock.
+ */
+static struct rzs_entry *rzs_find_entry(struct ramzswap *rzs,
+			const void *mem, size_t len, u32 checksum)
+{
+	struct rb_node *node = rzs->dedup_root.rb_node;
+	struct rb_node *prev;
+	struct rzs_entry *entry;
+	unsigned char *cmem;
+	int same;
+
+	while (node) {
+		entry = rb_entry(node, struct rzs_entry, node);
+		if (checksum < entry->checksum)
+			node = node->rb_left;
+		else if (checksum > entry->checksum)
+			node = node->rb_right;
+		else
+			break;
+	}
+	if (!node)
+		return NULL;
+
+	/* Entries with the same checksum are adjacent in tree order */
+	while ((prev = rb_prev(node)) &&
+		rb_entry(prev, struct rzs_entry, node)->checksum == checksum)
+		node = prev;
+
+	for (; node; node = rb_next(node)) {
+		entry = rb_entry(node, struct rzs_entry, node);
+		if (entry->checksum != checksum)
+			break;
+		if (entry->len != len)
+			continue;
+
+		cmem = zs_map_object(rzs->mem_pool, entry->handle, ZS_MM_RO);
+		same = !memcmp(cmem, mem, len);
+		zs_unmap_object(rzs->mem_pool, entry->handle);
+		if (same)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Caller must hold rzs->lock */
+static void rzs_insert_entry(struct ramzswap *rzs, struct rzs_entry *new)
+{
+	struct rb_node **link = &rzs->dedup_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct rzs_entry *entry;
+
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct rzs_entry, node);
+		if (new->checksum < entry->checksum)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &rzs->dedup_root);
+}
+
+/*
+ * Drop a slot's reference to a shared object, freeing it with the last one.
+ *
+ * Caller must hold rzs->lock.
+ */
+static void rzs_put_entry(struct ramzswap *rzs, struct rzs_entry *entry)
+{
+	if (entry->len <= PAGE_SIZE / 2)
+		rzs_stat_dec(&rzs->stats.good_compress);
+
+	if (--entry->refcount) {
+		rzs_stat_dec(&rzs->stats.pages_dup);
+		return;
+	}
+
+	rb_erase(&entry->node, &rzs->dedup_root);
+	zs_free(rzs->mem_pool, entry->handle);
+	rzs->stats.compr_size -= entry->len;
+	kfree(entry);
+}
+
+/*
+ * Free whatever is stored at 'index'.
+ *
+ * Caller must hold rzs->lock.
+ */
+static void __ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
 	u32 clen;
-	void *obj;
-
-	struct page *page = rzs->table[index].page;
-	u32 offset = rzs->table[index].offset;
-
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (rzs_test_flag(rzs, index, RZS_ZERO)) {
-			rzs_clear_flag(rzs, index, RZS_ZERO);
+
+	/* A writeback in progress must not install this slot's old data */
+	rzs_clear_flag(rzs, index, RZS_UNDER_WB);
+	rzs->table[index].age = 0;
+
+	if (rzs_test_flag(rzs, index, RZS_WB)) {
+		clear_bit(rzs->table[index].element, rzs->wb_bitmap);
+		rzs_clear_flag(rzs, index, RZS_WB);
+		rzs_stat_dec(&rzs->stats.pages_wb);
+		rzs->table[index].element = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for single word filled pages.
+	 * Simply clear the flag.
+	 */
+	if (rzs_test_flag(rzs, index, RZS_SAME)) {
+		if (rzs->table[index].element)
+			rzs_stat_dec(&rzs->stats.pages_same);
+		else
 			rzs_stat_dec(&rzs->stats.pages_zero);
-		}
+		rzs_clear_flag(rzs, index, RZS_SAME);
+		rzs->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!rzs->table[index].handle))
+		return;
+
+	if (rzs_test_flag(rzs, index, RZS_SHARED)) {
+		rzs_put_entry(rzs, rzs->table[index].entry);
+		rzs_clear_flag(rzs, index, RZS_SHARED);
+		rzs_stat_dec(&rzs->stats.pages_stored);
+		rzs->table[index].entry = NULL;
 		return;
 	}
 
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(rzs->table[index].page);
 		rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
 		rzs_stat_dec(&rzs->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(rzs->mem_pool, page, offset);
+	clen = rzs->table[index].size;
+	zs_free(rzs->mem_pool, rzs->table[index].handle);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_dec(&rzs->stats.good_compress);
 
@@ -198,17 +324,107 @@ out:
 	rzs->stats.compr_size -= clen;
 	rzs_stat_dec(&rzs->stats.pages_stored);
 
-	rzs->table[index].page = NULL;
-	rzs->table[index].offset = 0;
+	rzs->table[index].handle = 0;
+	rzs->table[index].size = 0;
+}
+
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
+	spin_lock(&rzs->lock);
+	__ramzswap_free_page(rzs, index);
+	spin_unlock(&rzs->lock);
+}
+
+/*
+ * Take an idle compression stream, waiting for a writer on another CPU
+ * to return one if they are all in use.
+ */
+static struct rzs_stream *rzs_stream_get(struct ramzswap *rzs)
+{
+	struct rzs_stream *stream;
+
+	while (1) {
+		spin_lock(&rzs->stream_lock);
+		if (!list_empty(&rzs->idle_streams)) {
+			stream = list_first_entry(&rzs->idle_streams,
+					struct rzs_stream, list);
+			list_del(&stream->list);
+			spin_unlock(&rzs->stream_lock);
+			return stream;
+		}
+		spin_unlock(&rzs->stream_lock);
+
+		wait_event(rzs->stream_wait,
+			!list_empty(&rzs->idle_streams));
+	}
+}
+
+static void rzs_stream_put(struct ramzswap *rzs, struct rzs_stream *stream)
+{
+	spin_lock(&rzs->stream_lock);
+	list_add(&stream->list, &rzs->idle_streams);
+	spin_unlock(&rzs->stream_lock);
+
+	wake_up(&rzs->stream_wait);
+}
+
+static void rzs_free_streams(struct ramzswap *rzs)
+{
+	struct rzs_stream *stream, *tmp;
+
+	list_for_each_entry_safe(stream, tmp, &rzs->idle_streams, list) {
+		crypto_free_comp(stream->tfm);
+		free_pages((unsigned long)stream->buffer, 1);
+		kfree(stream);
+	}
+	INIT_LIST_HEAD(&rzs->idle_streams);
+	rzs->num_streams = 0;
+}
+
+static int rzs_alloc_streams(struct ramzswap *rzs)
+{
+	struct rzs_stream *stream;
+	int i;
+
+	for (i = 0; i < num_online_cpus(); i++) {
+		stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+		if (!stream)
+			goto fail;
+
+		list_add(&stream->list, &rzs->idle_streams);
+
+		stream->tfm = crypto_alloc_comp(rzs->compressor, 0, 0);
+		if (IS_ERR(stream->tfm)) {
+			stream->tfm = NULL;
+			goto fail;
+		}
+
+		stream->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!stream->buffer)
+			goto fail;
+
+		rzs->num_streams++;
+	}
+
+	return 0;
+
+fail:
+	rzs_free_streams(rzs);
+	return -ENOMEM;
 }
 
-static int handle_zero_page(struct bio *bio)
+static int handle_same_page(struct bio *bio, unsigned long element)
 {
-	void *user_mem;
+	unsigned int pos;
+	unsigned long *user_mem;
 	struct page *page = bio->bi_io_vec[0].bv_page;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element)
+		memset(user_mem, 0, PAGE_SIZE);
+	else
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+			user_mem[pos] = element;
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -218,28 +434,23 @@ static int handle_zero_page(struct bio *bio)
 	return 0;
 }
 
-static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
+/*
+ * Copy out a page stored uncompressed. The bio is completed by the caller,
+ * once rzs->lock is dropped.
+ *
+ * Caller must hold rzs->lock.
+ */
+static void handle_uncompressed_page(struct ramzswap *rzs, u32 index,
+				struct page *page)
 {
-	u32 index;
-	struct page *page;
 	unsigned char *user_mem, *cmem;
 
-	page = bio->bi_io_vec[0].bv_page;
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(rzs->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
-
-	flush_dcache_page(page);
-
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return 0;
 }
 
 /*
@@ -265,9 +476,10 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
 	u32 index;
-	size_t clen;
+	unsigned int clen, dlen;
+	unsigned long handle, element;
 	struct page *page;
-	struct zobj_header *zheader;
+	struct rzs_stream *stream = NULL;
 	unsigned char *user_mem, *cmem;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
@@ -275,45 +487,101 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	if (rzs_test_flag(rzs, index, RZS_ZERO))
-		return handle_zero_page(bio);
+	/*
+	 * Writeback frees slots under rzs->lock, so the slot is looked up and
+	 * its data copied out with the lock held. Decompression is done from
+	 * the copy, after the lock is dropped.
+	 */
+again:
+	spin_lock(&rzs->lock);
+
+	rzs->table[index].age = 0;
+
+	if (rzs_test_flag(rzs, index, RZS_SAME)) {
+		element = rzs->table[index].element;
+		spin_unlock(&rzs->lock);
+		ret = handle_same_page(bio, element);
+		goto out_stream;
+	}
+
+	/* Page was written back: let the backing device serve the read */
+	if (rzs_test_flag(rzs, index, RZS_WB)) {
+		rzs_stat64_inc(rzs, &rzs->stats.wb_reads);
+		bio->bi_bdev = rzs->backing_bdev;
+		bio->bi_sector = (sector_t)rzs->table[index].element
+					<< SECTORS_PER_PAGE_SHIFT;
+		spin_unlock(&rzs->lock);
+		ret = 1;
+		goto out_stream;
+	}
 
 	/* Requested page is not present in compressed area */
-	if (!rzs->table[index].page)
-		return handle_ramzswap_fault(rzs, bio);
+	if (!rzs->table[index].handle) {
+		spin_unlock(&rzs->lock);
+		ret = handle_ramzswap_fault(rzs, bio);
+		goto out_stream;
+	}
 
 	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		return handle_uncompressed_page(rzs, bio);
+	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+		handle_uncompressed_page(rzs, index, page);
+		spin_unlock(&rzs->lock);
+		if (stream)
+			rzs_stream_put(rzs, stream);
+		goto out_done;
+	}
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
+	/* Getting a stream may sleep: drop the lock and look again */
+	if (!stream) {
+		spin_unlock(&rzs->lock);
+		stream = rzs_stream_get(rzs);
+		goto again;
+	}
+
+	if (rzs_test_flag(rzs, index, RZS_SHARED)) {
+		handle = rzs->table[index].entry->handle;
+		clen = rzs->table[index].entry->len;
+	} else {
+		handle = rzs->table[index].handle;
+		clen = rzs->table[index].size;
+	}
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = zs_map_object(rzs->mem_pool, handle, ZS_MM_RO);
+	memcpy(stream->buffer, cmem, clen);
+	zs_unmap_object(rzs->mem_pool, handle);
 
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+	spin_unlock(&rzs->lock);
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	dlen = PAGE_SIZE;
+
+	ret = crypto_comp_decompress(stream->tfm, stream->buffer, clen,
+				user_mem, &dlen);
 
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
+
+	rzs_stream_put(rzs, stream);
 
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret || dlen != PAGE_SIZE)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_reads);
 		goto out;
 	}
 
+out_done:
 	flush_dcache_page(page);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
+out_stream:
+	if (stream)
+		rzs_stream_put(rzs, stream);
+	return ret;
+
 out:
 	bio_io_error(bio);
 	return 0;
@@ -322,9 +590,11 @@ out:
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 offset, index;
-	size_t clen;
-	struct zobj_header *zheader;
+	u32 index, checksum = 0;
+	unsigned int clen;
+	unsigned long element, handle;
+	struct rzs_stream *stream;
+	struct rzs_entry *entry = NULL;
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src;
 
@@ -333,29 +603,41 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
-	if (page_zero_filled(user_mem)) {
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
-		rzs_stat_inc(&rzs->stats.pages_zero);
-		rzs_set_flag(rzs, index, RZS_ZERO);
+
+		spin_lock(&rzs->lock);
+		__ramzswap_free_page(rzs, index);
+		if (element)
+			rzs_stat_inc(&rzs->stats.pages_same);
+		else
+			rzs_stat_inc(&rzs->stats.pages_zero);
+		rzs->table[index].element = element;
+		rzs_set_flag(rzs, index, RZS_SAME);
+		spin_unlock(&rzs->lock);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	kunmap_atomic(user_mem, KM_USER0);
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	/*
+	 * Compression and allocation happen without rzs->lock held; only
+	 * the table update at the end is serialized.
+	 */
+	stream = rzs_stream_get(rzs);
+	src = stream->buffer;
 
+	user_mem = kmap_atomic(page, KM_USER0);
+	clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(stream->tfm, user_mem, PAGE_SIZE,
+				src, &clen);
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+	if (unlikely(ret)) {
+		rzs_stream_put(rzs, stream);
 		pr_err("Compression failed! err=%d\n", ret);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -370,59 +652,97 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
+			rzs_stream_put(rzs, stream);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 			goto out;
 		}
 
-		offset = 0;
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, user_mem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		spin_lock(&rzs->lock);
+		__ramzswap_free_page(rzs, index);
+		rzs->table[index].page = page_store;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
 		rzs_stat_inc(&rzs->stats.pages_expand);
-		rzs->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		rzs->stats.compr_size += clen;
+		goto update_stats;
 	}
 
-	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
-			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
+	/*
+	 * If an identical compressed page is already stored, just take
+	 * another reference to it.
+	 */
+	if (rzs->dedup) {
+		checksum = jhash(src, clen, 0);
+
+		spin_lock(&rzs->lock);
+		entry = rzs_find_entry(rzs, src, clen, checksum);
+		if (entry) {
+			entry->refcount++;
+			__ramzswap_free_page(rzs, index);
+			rzs->table[index].entry = entry;
+			rzs_set_flag(rzs, index, RZS_SHARED);
+			rzs_stat_inc(&rzs->stats.pages_dup);
+			goto update_stats;
+		}
+		spin_unlock(&rzs->lock);
+
+		entry = kmalloc(sizeof(*entry), GFP_NOIO);
+		if (unlikely(!entry)) {
+			rzs_stream_put(rzs, stream);
+			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
+			goto out;
+		}
+	}
+
+	handle = zs_malloc(rzs->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM);
+	if (unlikely(!handle)) {
+		rzs_stream_put(rzs, stream);
+		kfree(entry);
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
 	}
 
-memstore:
-	rzs->table[index].offset = offset;
+	cmem = zs_map_object(rzs->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, src, clen);
+	zs_unmap_object(rzs->mem_pool, handle);
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	spin_lock(&rzs->lock);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
-#endif
+	/* Drop what the slot held before, if it is being overwritten */
+	__ramzswap_free_page(rzs, index);
 
-	memcpy(cmem, src, clen);
+	if (entry) {
+		entry->checksum = checksum;
+		entry->len = clen;
+		entry->handle = handle;
+		entry->refcount = 1;
+		rzs_insert_entry(rzs, entry);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
-
-	/* Update stats */
+		rzs->table[index].entry = entry;
+		rzs_set_flag(rzs, index, RZS_SHARED);
+	} else {
+		rzs->table[index].handle = handle;
+		rzs->table[index].size = clen;
+	}
 	rzs->stats.compr_size += clen;
+
+update_stats:
 	rzs_stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_inc(&rzs->stats.good_compress);
 
-	mutex_unlock(&rzs->lock);
+	spin_unlock(&rzs->lock);
+
+	rzs_stream_put(rzs, stream);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -492,33 +812,28 @@ static void reset_device(struct ramzswap *rzs)
 	rzs->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
-
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	rzs_free_streams(rzs);
 
 	/* Free all pages that are still in this ramzswap device */
-	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = rzs->table[index].page;
-		offset = rzs->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(rzs->mem_pool, page, offset);
-	}
+	if (rzs->table)
+		for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++)
+			__ramzswap_free_page(rzs, index);
+	rzs->dedup_root = RB_ROOT;
 
 	vfree(rzs->table);
 	rzs->table = NULL;
 
-	xv_destroy_pool(rzs->mem_pool);
+	vfree(rzs->wb_bitmap);
+	rzs->wb_bitmap = NULL;
+	rzs->nr_wb_blocks = 0;
+
+	if (rzs->backing_bdev)
+		close_bdev_exclusive(rzs->backing_bdev,
+					FMODE_READ | FMODE_WRITE);
+	rzs->backing_bdev = NULL;
+
+	if (rzs->mem_pool)
+		zs_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
 
 	/* Reset stats */
@@ -527,6 +842,44 @@ static void reset_device(struct ramzswap *rzs)
 	rzs->disksize = 0;
 }
 
+/*
+ * Open the backing device and set up the bitmap of its page sized blocks.
+ * Block 0 is never used, so that table[].element of a written back page
+ * is never 0.
+ */
+static int ramzswap_setup_backing_dev(struct ramzswap *rzs)
+{
+	size_t bitmap_size;
+	struct block_device *bdev;
+
+	bdev = open_bdev_exclusive(rzs->backing_name,
+				FMODE_READ | FMODE_WRITE, rzs);
+	if (IS_ERR(bdev)) {
+		pr_err("Error opening backing device %s\n", rzs->backing_name);
+		return PTR_ERR(bdev);
+	}
+	rzs->backing_bdev = bdev;
+
+	rzs->nr_wb_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (rzs->nr_wb_blocks < 2) {
+		pr_err("Backing device %s is too small\n", rzs->backing_name);
+		return -EINVAL;
+	}
+
+	bitmap_size = BITS_TO_LONGS(rzs->nr_wb_blocks) * sizeof(long);
+	rzs->wb_bitmap = vmalloc(bitmap_size);
+	if (!rzs->wb_bitmap) {
+		pr_err("Error allocating backing device bitmap\n");
+		return -ENOMEM;
+	}
+	memset(rzs->wb_bitmap, 0, bitmap_size);
+	set_bit(0, rzs->wb_bitmap);
+
+	pr_info("Using %s for writeback (%lu pages)\n",
+		rzs->backing_name, rzs->nr_wb_blocks - 1);
+	return 0;
+}
+
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 {
 	int ret;
@@ -541,19 +894,13 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = rzs_alloc_streams(rzs);
+	if (ret) {
+		pr_err("Error allocating %s compression streams\n",
+			rzs->compressor);
 		goto fail;
 	}
+	rzs->dedup = dedup;
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 	rzs->table = vmalloc(num_pages * sizeof(*rzs->table));
@@ -566,6 +913,12 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	if (rzs->backing_name[0]) {
+		ret = ramzswap_setup_backing_dev(rzs);
+		if (ret)
+			goto fail;
+	}
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
@@ -584,7 +937,7 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	/* ramzswap devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, rzs->disk->queue);
 
-	rzs->mem_pool = xv_create_pool();
+	rzs->mem_pool = zs_create_pool();
 	if (!rzs->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -605,12 +958,324 @@ fail:
 
 static int ramzswap_ioctl_reset_device(struct ramzswap *rzs)
 {
+	down_write(&rzs->init_lock);
 	if (rzs->init_done)
 		reset_device(rzs);
+	up_write(&rzs->init_lock);
 
 	return 0;
 }
 
+/*
+ * Start a new aging period: every slot not accessed since the last one
+ * gets one period older. Reads and writes reset a slot's age to 0.
+ */
+static void ramzswap_age_pages(struct ramzswap *rzs)
+{
+	size_t index, num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	spin_lock(&rzs->lock);
+	for (index = 1; index < num_pages; index++) {
+		if (rzs->table[index].age < RZS_MAX_AGE)
+			rzs->table[index].age++;
+
+		if (!(index % 1024)) {
+			spin_unlock(&rzs->lock);
+			cond_resched();
+			spin_lock(&rzs->lock);
+		}
+	}
+	spin_unlock(&rzs->lock);
+}
+
+/* A slot picked for writeback and its copy of the data */
+struct rzs_wb_slot {
+	size_t index;
+	struct page *page;
+	unsigned int clen;	/* PAGE_SIZE if page holds the data as-is */
+};
+
+/* Caller must hold rzs->lock */
+static int rzs_wb_candidate(struct ramzswap *rzs, size_t index,
+			struct ramzswap_ioctl_writeback *wb)
+{
+	int idle;
+
+	if (!rzs->table[index].handle ||
+		rzs_test_flag(rzs, index, RZS_SAME) ||
+		rzs_test_flag(rzs, index, RZS_WB) ||
+		rzs_test_flag(rzs, index, RZS_UNDER_WB))
+		return 0;
+
+	idle = (wb->flags & RZS_WB_IDLE) &&
+		rzs->table[index].age >= wb->min_age;
+
+	if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))
+		return idle || (wb->flags & RZS_WB_INCOMPRESSIBLE);
+
+	/* Writing back one of several users of an object frees nothing */
+	if (rzs_test_flag(rzs, index, RZS_SHARED) &&
+		rzs->table[index].entry->refcount > 1)
+		return 0;
+
+	return idle;
+}
+
+/*
+ * Copy the data stored at 'index' to 'page': the page itself if it is
+ * stored uncompressed, else the compressed object. Returns its size.
+ *
+ * Caller must hold rzs->lock.
+ */
+static unsigned int rzs_wb_copy(struct ramzswap *rzs, size_t index,
+			struct page *page)
+{
+	unsigned int clen;
+	unsigned long handle;
+	unsigned char *mem, *cmem;
+
+	mem = kmap_atomic(page, KM_USER0);
+
+	if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+		clen = PAGE_SIZE;
+		cmem = kmap_atomic(rzs->table[index].page, KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		goto out;
+	}
+
+	if (rzs_test_flag(rzs, index, RZS_SHARED)) {
+		handle = rzs->table[index].entry->handle;
+		clen = rzs->table[index].entry->len;
+	} else {
+		handle = rzs->table[index].handle;
+		clen = rzs->table[index].size;
+	}
+
+	cmem = zs_map_object(rzs->mem_pool, handle, ZS_MM_RO);
+	memcpy(mem, cmem, clen);
+	zs_unmap_object(rzs->mem_pool, handle);
+
+out:
+	kunmap_atomic(mem, KM_USER0);
+	return clen;
+}
+
+static void rzs_wb_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Decompress the batch in place and write it to consecutive blocks of the
+ * backing device, starting at 'block'. Uses as few bios as the backing
+ * queue allows.
+ */
+static int rzs_wb_write(struct ramzswap *rzs, struct rzs_wb_slot *slots,
+			int nr, unsigned long block)
+{
+	int i, ret = 0;
+	unsigned int dlen;
+	unsigned char *mem;
+	struct bio *bio;
+	struct rzs_stream *stream;
+	struct completion done;
+
+	stream = rzs_stream_get(rzs);
+	for (i = 0; i < nr; i++) {
+		if (slots[i].clen == PAGE_SIZE)
+			continue;
+
+		mem = kmap_atomic(slots[i].page, KM_USER0);
+		memcpy(stream->buffer, mem, slots[i].clen);
+		dlen = PAGE_SIZE;
+		ret = crypto_comp_decompress(stream->tfm, stream->buffer,
+					slots[i].clen, mem, &dlen);
+		kunmap_atomic(mem, KM_USER0);
+
+		if (unlikely(ret || dlen != PAGE_SIZE)) {
+			pr_err("Decompression failed! err=%d, page=%zu\n",
+				ret, slots[i].index);
+			ret = -EIO;
+			break;
+		}
+	}
+	rzs_stream_put(rzs, stream);
+
+	for (i = 0; !ret && i < nr; ) {
+		bio = bio_alloc(GFP_KERNEL, nr - i);
+		if (!bio)
+			return -ENOMEM;
+
+		bio->bi_bdev = rzs->backing_bdev;
+		bio->bi_sector = (sector_t)(block + i) << SECTORS_PER_PAGE_SHIFT;
+		for (; i < nr; i++)
+			if (bio_add_page(bio, slots[i].page, PAGE_SIZE, 0)
+					!= PAGE_SIZE)
+				break;
+
+		init_completion(&done);
+		bio->bi_private = &done;
+		bio->bi_end_io = rzs_wb_end_io;
+		submit_bio(WRITE, bio);
+		wait_for_completion(&done);
+
+		if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+			ret = -EIO;
+		bio_put(bio);
+	}
+
+	return ret;
+}
+
+/*
+ * Move pages selected by 'wb' to the backing device, RZS_WB_BATCH at a
+ * time. Each batch goes to a run of free blocks. Slots freed or
+ * overwritten while their batch is being written keep their new contents;
+ * their blocks are released again.
+ */
+static int ramzswap_writeback(struct ramzswap *rzs,
+			struct ramzswap_ioctl_writeback *wb)
+{
+	int i, nr, ret = 0;
+	size_t slot, index = 1, num_pages = rzs->disksize >> PAGE_SHIFT;
+	unsigned long block, max, written = 0;
+	struct rzs_wb_slot *slots;
+
+	if (!rzs->backing_bdev)
+		return -ENODEV;
+
+	slots = kcalloc(RZS_WB_BATCH, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < RZS_WB_BATCH; i++) {
+		slots[i].page = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+		if (!slots[i].page) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	mutex_lock(&rzs->wb_lock);
+
+	while (index < num_pages) {
+		nr = 0;
+
+		spin_lock(&rzs->lock);
+		block = find_next_zero_bit(rzs->wb_bitmap,
+					rzs->nr_wb_blocks, 1);
+		if (block >= rzs->nr_wb_blocks) {
+			spin_unlock(&rzs->lock);
+			ret = -ENOSPC;
+			break;
+		}
+		max = find_next_bit(rzs->wb_bitmap, rzs->nr_wb_blocks, block)
+			- block;
+		max = min_t(unsigned long, max, RZS_WB_BATCH);
+		if (wb->max_pages)
+			max = min_t(unsigned long, max,
+					wb->max_pages - written);
+
+		for (; index < num_pages && nr < max; index++) {
+			if (!rzs_wb_candidate(rzs, index, wb))
+				continue;
+
+			rzs_set_flag(rzs, index, RZS_UNDER_WB);
+			slots[nr].index = index;
+			slots[nr].clen = rzs_wb_copy(rzs, index, slots[nr].page);
+			nr++;
+		}
+		bitmap_set(rzs->wb_bitmap, block, nr);
+		spin_unlock(&rzs->lock);
+
+		if (!nr)
+			break;
+
+		ret = rzs_wb_write(rzs, slots, nr, block);
+
+		spin_lock(&rzs->lock);
+		for (i = 0; i < nr; i++) {
+			slot = slots[i].index;
+			if (ret || !rzs_test_flag(rzs, slot, RZS_UNDER_WB)) {
+				rzs_clear_flag(rzs, slot, RZS_UNDER_WB);
+				clear_bit(block + i, rzs->wb_bitmap);
+				continue;
+			}
+
+			__ramzswap_free_page(rzs, slot);
+			rzs->table[slot].element = block + i;
+			rzs_set_flag(rzs, slot, RZS_WB);
+			rzs_stat_inc(&rzs->stats.pages_wb);
+		}
+		spin_unlock(&rzs->lock);
+
+		if (ret)
+			break;
+
+		rzs_stat64_add(rzs, &rzs->stats.wb_writes, nr);
+		written += nr;
+		if (wb->max_pages && written >= wb->max_pages)
+			break;
+
+		cond_resched();
+	}
+
+	mutex_unlock(&rzs->wb_lock);
+
+	if (written)
+		pr_debug("Wrote back %lu pages\n", written);
+out:
+	for (i = 0; i < RZS_WB_BATCH; i++)
+		if (slots[i].page)
+			__free_page(slots[i].page);
+	kfree(slots);
+
+	return ret;
+}
+
+static unsigned long ramzswap_compact(struct ramzswap *rzs)
+{
+	unsigned long freed;
+
+	freed = zs_compact(rzs->mem_pool);
+	if (freed)
+		pr_debug("Compaction freed %lu pages\n", freed);
+
+	return freed;
+}
+
+/*
+ * Objects in the pool can be moved, so under memory pressure empty out
+ * sparsely used zspages. Devices being initialized or reset are skipped.
+ */
+static int ramzswap_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct ramzswap *rzs;
+	unsigned long pages = 0;
+	int i;
+
+	for (i = 0; i < num_devices; i++) {
+		rzs = &devices[i];
+
+		if (!down_read_trylock(&rzs->init_lock))
+			continue;
+		if (rzs->init_done) {
+			if (nr_to_scan)
+				ramzswap_compact(rzs);
+			pages += zs_can_compact(rzs->mem_pool);
+		}
+		up_read(&rzs->init_lock);
+	}
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+static struct shrinker ramzswap_shrinker = {
+	.shrink = ramzswap_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 			unsigned int cmd, unsigned long arg)
 {
@@ -634,6 +1299,44 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_info("Disk size set to %zu kB\n", disksize_kb);
 		break;
 
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[RZS_COMPRESSOR_NAME_LEN];
+
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(name, (void *)arg, sizeof(name))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[sizeof(name) - 1] = '\0';
+		if (!crypto_has_comp(name, 0, 0)) {
+			pr_info("Compressor %s is not available\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		strcpy(rzs->compressor, name);
+		pr_info("Compressor set to %s\n", name);
+		break;
+	}
+
+	case RZSIO_SET_BACKING_DEV:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(rzs->backing_name, (void *)arg,
+					sizeof(rzs->backing_name))) {
+			rzs->backing_name[0] = '\0';
+			ret = -EFAULT;
+			goto out;
+		}
+		rzs->backing_name[sizeof(rzs->backing_name) - 1] = '\0';
+		pr_info("Backing device set to %s\n", rzs->backing_name);
+		break;
+
 	case RZSIO_GET_STATS:
 	{
 		struct ramzswap_ioctl_stats *stats;
@@ -656,9 +1359,46 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		break;
 	}
 	case RZSIO_INIT:
+		down_write(&rzs->init_lock);
 		ret = ramzswap_ioctl_init_device(rzs);
+		up_write(&rzs->init_lock);
 		break;
 
+	case RZSIO_COMPACT:
+		down_read(&rzs->init_lock);
+		if (rzs->init_done)
+			ramzswap_compact(rzs);
+		else
+			ret = -ENOTTY;
+		up_read(&rzs->init_lock);
+		break;
+
+	case RZSIO_AGE_PAGES:
+		down_read(&rzs->init_lock);
+		if (rzs->init_done)
+			ramzswap_age_pages(rzs);
+		else
+			ret = -ENOTTY;
+		up_read(&rzs->init_lock);
+		break;
+
+	case RZSIO_WRITEBACK:
+	{
+		struct ramzswap_ioctl_writeback wb;
+
+		if (copy_from_user(&wb, (void *)arg, sizeof(wb))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		down_read(&rzs->init_lock);
+		if (rzs->init_done)
+			ret = ramzswap_writeback(rzs, &wb);
+		else
+			ret = -ENOTTY;
+		up_read(&rzs->init_lock);
+		break;
+	}
+
 	case RZSIO_RESET:
 		/* Do not reset an active device! */
 		if (bdev->bd_holders) {
@@ -703,8 +1443,15 @@ static int create_device(struct ramzswap *rzs, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&rzs->lock);
+	init_rwsem(&rzs->init_lock);
+	spin_lock_init(&rzs->lock);
 	spin_lock_init(&rzs->stat64_lock);
+	spin_lock_init(&rzs->stream_lock);
+	INIT_LIST_HEAD(&rzs->idle_streams);
+	init_waitqueue_head(&rzs->stream_wait);
+	mutex_init(&rzs->wb_lock);
+	rzs->dedup_root = RB_ROOT;
+	strlcpy(rzs->compressor, compressor, sizeof(rzs->compressor));
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!rzs->queue) {
@@ -796,6 +1543,8 @@ static int __init ramzswap_init(void)
 			goto free_devices;
 	}
 
+	register_shrinker(&ramzswap_shrinker);
+
 	return 0;
 
 free_devices:
@@ -812,6 +1561,8 @@ static void __exit ramzswap_exit(void)
 	int i;
 	struct ramzswap *rzs;
 
+	unregister_shrinker(&ramzswap_shrinker);
+
 	for (i = 0; i < num_devices; i++) {
 		rzs = &devices[i];
 
@@ -828,6 +1579,12 @@ static void __exit ramzswap_exit(void)
 
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
+module_param_string(compressor, compressor, sizeof(compressor), 0);
+MODULE_PARM_DESC(compressor, "Default compressor (crypto API name, e.g. "
+	"lzo, lz4, deflate)");
+module_param(dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "Share identical compressed pages "
+	"(takes effect when a device is initialized)");
 
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
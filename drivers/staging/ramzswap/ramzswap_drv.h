@@ -16,10 +16,15 @@
 #define _RAMZSWAP_DRV_H_
 
 #include <linux/spinlock.h>
+#include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
 
 #include "ramzswap_ioctl.h"
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -27,23 +32,14 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default ramzswap disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compressor, unless changed with the compressor module param */
+#define RZS_DEFAULT_COMPRESSOR	"lzo"
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -52,10 +48,13 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
+/* Max no. of pages written to the backing device with a single bio */
+#define RZS_WB_BATCH		32
+
 /*-- End of configurable params */
 
 #define SECTOR_SHIFT		9
@@ -63,27 +62,57 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
 #define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
 
+/* table[].age saturates here */
+#define RZS_MAX_AGE		255
+
 /* Flags for ramzswap pages (table[page_no].flags) */
 enum rzs_pageflags {
 	/* Page is stored uncompressed */
 	RZS_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	RZS_ZERO,
+	/* Page is one word repeated, kept in table[page_no].element */
+	RZS_SAME,
+
+	/* Page shares a compressed object: see table[page_no].entry */
+	RZS_SHARED,
+
+	/* Page is on the backing device, in block table[page_no].element */
+	RZS_WB,
+
+	/* Page is being written back; cleared if the slot is freed */
+	RZS_UNDER_WB,
 
 	__NR_RZS_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object that may be shared by several slots holding the same
+ * data. Entries are kept in an rbtree keyed by a hash of the compressed
+ * data, so that a newly written page can find an identical copy.
+ */
+struct rzs_entry {
+	struct rb_node node;
+	u32 checksum;
+	u16 len;		/* compressed size */
+	unsigned int refcount;	/* no. of slots using this object */
+	unsigned long handle;
+};
+
 /*
  * Allocated for each swap slot, indexed by page no.
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		unsigned long handle;		/* zsmalloc object */
+		struct page *page;		/* RZS_UNCOMPRESSED */
+		struct rzs_entry *entry;	/* RZS_SHARED */
+		unsigned long element;		/* RZS_SAME, RZS_WB */
+	};
+	u16 size;	/* compressed size of a zsmalloc object */
+	u8 age;		/* aging periods since last access */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -100,26 +129,54 @@ struct ramzswap_stats {
 	u64 invalid_io;		/* non-swap I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other single-word filled pages */
+	u32 pages_dup;		/* no. of slots sharing another's object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_wb;		/* no. of pages on the backing device */
+	u64 wb_writes;		/* no. of pages written back */
+	u64 wb_reads;		/* no. of reads from the backing device */
 #endif
 };
 
+/*
+ * Compression context: a transform of the device's compressor and a buffer
+ * for the compressed page. Each device has one per online CPU, so that
+ * concurrent writers compress in parallel.
+ */
+struct rzs_stream {
+	struct list_head list;	/* entry in idle_streams */
+	struct crypto_comp *tfm;
+	void *buffer;
+};
+
 struct ramzswap {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct list_head idle_streams;	/* streams not in use by a writer */
+	spinlock_t stream_lock;		/* protects idle_streams */
+	wait_queue_head_t stream_wait;	/* writers waiting for a stream */
+	int num_streams;
+	char compressor[RZS_COMPRESSOR_NAME_LEN];
+	int dedup;			/* share identical compressed pages */
+	struct rb_root dedup_root;	/* rzs_entry objects, by checksum */
+	char backing_name[RZS_BACKING_NAME_LEN];
+	struct block_device *backing_bdev;
+	unsigned long *wb_bitmap;	/* blocks in use on backing_bdev */
+	unsigned long nr_wb_blocks;
+	struct mutex wb_lock;		/* serializes writeback */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	spinlock_t lock;	/* protects table entries, dedup_root,
+				 * wb_bitmap and 32-bit stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
+	struct rw_semaphore init_lock;	/* protects init_done and mem_pool
+					 * against the shrinker */
 	int init_done;
 	/*
 	 * This is limit on amount of *uncompressed* worth of data
-	 * we can hold. When backing swap device is provided, it is
-	 * set equal to device size.
+	 * we can hold.
 	 */
 	size_t disksize;	/* bytes */
 
@@ -147,6 +204,13 @@ static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
 	spin_unlock(&rzs->stat64_lock);
 }
 
+static void rzs_stat64_add(struct ramzswap *rzs, u64 *v, u64 n)
+{
+	spin_lock(&rzs->stat64_lock);
+	*v = *v + n;
+	spin_unlock(&rzs->stat64_lock);
+}
+
 static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 {
 	u64 val;
@@ -161,6 +225,7 @@ static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 #define rzs_stat_inc(v)
 #define rzs_stat_dec(v)
 #define rzs_stat64_inc(r, v)
+#define rzs_stat64_add(r, v, n)
 #define rzs_stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
 
@@ -15,6 +15,9 @@
 #ifndef _RAMZSWAP_IOCTL_H_
 #define _RAMZSWAP_IOCTL_H_
 
+#define RZS_COMPRESSOR_NAME_LEN	32
+#define RZS_BACKING_NAME_LEN	64
+
 struct ramzswap_ioctl_stats {
 	u64 disksize;		/* user specified or equal to backing swap
 				 * size (if present) */
@@ -32,11 +35,37 @@ struct ramzswap_ioctl_stats {
 	u64 orig_data_size;
 	u64 compr_data_size;
 	u64 mem_used_total;
+	u32 pages_same;		/* no. of pages filled with one repeated
+				 * non-zero word */
+	u32 pages_dup;		/* no. of pages sharing a compressed copy
+				 * with another page */
+	u64 mem_slack;		/* free space inside the allocator's pages,
+				 * which compaction can reclaim */
+	u64 pages_compacted;	/* no. of pages freed by compaction */
+	u32 pages_wb;		/* no. of pages on the backing device */
+	u64 wb_writes;		/* no. of pages written back (total) */
+	u64 wb_reads;		/* no. of reads served by the backing
+				 * device */
+} __attribute__ ((packed, aligned(4)));
+
+/* Which pages RZSIO_WRITEBACK moves to the backing device */
+#define RZS_WB_IDLE		(1 << 0)	/* not accessed for min_age */
+#define RZS_WB_INCOMPRESSIBLE	(1 << 1)	/* stored uncompressed */
+
+struct ramzswap_ioctl_writeback {
+	u32 flags;		/* RZS_WB_* */
+	u32 min_age;		/* idle periods (see RZSIO_AGE_PAGES) */
+	u32 max_pages;		/* stop after this many pages (0: no limit) */
 } __attribute__ ((packed, aligned(4)));
 
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_GET_STATS		_IOR('z', 1, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 2)
 #define RZSIO_RESET		_IO('z', 3)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 4, char[RZS_COMPRESSOR_NAME_LEN])
+#define RZSIO_COMPACT		_IO('z', 5)
+#define RZSIO_SET_BACKING_DEV	_IOW('z', 6, char[RZS_BACKING_NAME_LEN])
+#define RZSIO_AGE_PAGES		_IO('z', 7)
+#define RZSIO_WRITEBACK		_IOW('z', 8, struct ramzswap_ioctl_writeback)
 
 #endif
@@ -0,0 +1,725 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped by size into classes 16 bytes apart. Each class
+ * carves its objects out of zspages of one to four pages, chosen to waste
+ * the least space for that size. Callers only ever hold a handle, so a
+ * lightly used zspage can be emptied by moving its objects into fuller
+ * zspages of the same class and then freed (zs_compact()).
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/bit_spinlock.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static void stat_add(u64 *value, u32 n)
+{
+	*value = *value + n;
+}
+
+static void stat_sub(u64 *value, u32 n)
+{
+	*value = *value - n;
+}
+
+/*
+ * Choose the number of pages per zspage that leaves the smallest unused
+ * tail for objects of the given size.
+ */
+static u32 get_pages_per_zspage(u32 size)
+{
+	u32 i, best = 1, best_waste = PAGE_SIZE;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 waste = (i * PAGE_SIZE) % size;
+
+		/* Compare waste per page; prefer fewer pages on a tie */
+		if (waste * best < best_waste * i) {
+			best = i;
+			best_waste = waste;
+		}
+	}
+
+	return best;
+}
+
+static u32 get_size_class_index(u32 size)
+{
+	if (likely(size <= ZS_MIN_ALLOC_SIZE))
+		return 0;
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+static unsigned long obj_location(struct zspage *zspage, u32 idx)
+{
+	return (page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS) | idx;
+}
+
+static struct zspage *location_to_zspage(unsigned long obj, u32 *idx)
+{
+	struct page *page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+
+	*idx = obj & OBJ_INDEX_MASK;
+	return (struct zspage *)page_private(page);
+}
+
+static unsigned long handle_to_obj(unsigned long *handle)
+{
+	return *handle >> 1;
+}
+
+/* Store a new location, leaving the pin bit as it is */
+static void record_obj(unsigned long *handle, unsigned long obj)
+{
+	*handle = (obj << 1) | (*handle & BIT(HANDLE_PIN_BIT));
+}
+
+static void pin_handle(unsigned long *handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, handle);
+}
+
+static int trypin_handle(unsigned long *handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, handle);
+}
+
+static void unpin_handle(unsigned long *handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, handle);
+}
+
+/*
+ * Map the header word of object 'idx'. Headers never straddle a page
+ * since object sizes and PAGE_SIZE are both multiples of
+ * ZS_SIZE_CLASS_DELTA.
+ */
+static unsigned long *get_header_atomic(struct size_class *class,
+			struct zspage *zspage, u32 idx, enum km_type type)
+{
+	unsigned long offset = (unsigned long)idx * class->size;
+	unsigned char *base;
+
+	base = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT], type);
+	return (unsigned long *)(base + (offset & ~PAGE_MASK));
+}
+
+static void put_header_atomic(unsigned long *head, enum km_type type)
+{
+	kunmap_atomic(head, type);
+}
+
+/*
+ * Copy 'len' bytes at 'start' within object 'idx' to (or, if 'to_obj',
+ * from) 'buf', a page at a time.
+ */
+static void copy_object_data(struct size_class *class, struct zspage *zspage,
+			u32 idx, u32 start, char *buf, u32 len, int to_obj)
+{
+	unsigned long offset = (unsigned long)idx * class->size + start;
+	unsigned char *base;
+	u32 off, n;
+
+	while (len) {
+		off = offset & ~PAGE_MASK;
+		n = min_t(u32, len, PAGE_SIZE - off);
+
+		base = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT],
+				KM_USER1);
+		if (to_obj)
+			memcpy(base + off, buf, n);
+		else
+			memcpy(buf, base + off, n);
+		kunmap_atomic(base, KM_USER1);
+
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Copy a whole object between two zspages of the same class */
+static void move_object_data(struct size_class *class,
+			struct zspage *src, u32 sidx,
+			struct zspage *dst, u32 didx)
+{
+	unsigned long soff = (unsigned long)sidx * class->size;
+	unsigned long doff = (unsigned long)didx * class->size;
+	unsigned char *s, *d;
+	u32 len = class->size;
+	u32 n;
+
+	while (len) {
+		n = min_t(u32, len, PAGE_SIZE - (soff & ~PAGE_MASK));
+		n = min_t(u32, n, PAGE_SIZE - (doff & ~PAGE_MASK));
+
+		s = kmap_atomic(src->pages[soff >> PAGE_SHIFT], KM_USER0);
+		d = kmap_atomic(dst->pages[doff >> PAGE_SHIFT], KM_USER1);
+		memcpy(d + (doff & ~PAGE_MASK), s + (soff & ~PAGE_MASK), n);
+		kunmap_atomic(d, KM_USER1);
+		kunmap_atomic(s, KM_USER0);
+
+		soff += n;
+		doff += n;
+		len -= n;
+	}
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+			struct zspage *zspage)
+{
+	if (!zspage->inuse)
+		return ZS_EMPTY;
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+	if (zspage->inuse * 4 >=
+			class->objs_per_zspage * ZS_ALMOST_FULL_QUARTERS)
+		return ZS_ALMOST_FULL;
+	return ZS_ALMOST_EMPTY;
+}
+
+/*
+ * Move the zspage to the list matching its current usage. Empty zspages
+ * are on no list.
+ */
+static void fix_fullness_group(struct size_class *class, struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness)
+		return;
+
+	if (zspage->fullness != ZS_EMPTY)
+		list_del(&zspage->list);
+	if (newfg != ZS_EMPTY)
+		list_add(&zspage->list, &class->fullness_list[newfg]);
+	zspage->fullness = newfg;
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, u32 class_idx,
+			gfp_t flags)
+{
+	struct zspage *zspage;
+	unsigned long *head;
+	struct page *page;
+	u32 i;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		page = alloc_page(flags);
+		if (!page)
+			goto fail;
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	/* Chain all objects on the free list */
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		head = get_header_atomic(class, zspage, i, KM_USER0);
+		if (i + 1 < class->objs_per_zspage)
+			*head = (unsigned long)(i + 1) << 1;
+		else
+			*head = OBJ_FREE_END << 1;
+		put_header_atomic(head, KM_USER0);
+	}
+
+	zspage->freeobj = 0;
+	zspage->class_idx = class_idx;
+	zspage->fullness = ZS_EMPTY;
+
+	return zspage;
+
+fail:
+	while (i--) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct size_class *class, struct zspage *zspage)
+{
+	u32 i;
+
+	BUG_ON(zspage->inuse || zspage->fullness != ZS_EMPTY);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+
+	stat_sub(&class->pages_allocated, class->pages_per_zspage);
+	stat_sub(&class->objs_allocated, class->objs_per_zspage);
+}
+
+/* Find a zspage with free objects, preferring the fullest ones */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	struct list_head *head;
+
+	head = &class->fullness_list[ZS_ALMOST_FULL];
+	if (list_empty(head))
+		head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (list_empty(head))
+		return NULL;
+
+	return list_first_entry(head, struct zspage, list);
+}
+
+/*
+ * Take the first free object of the zspage for 'handle' and return its
+ * location. Caller must hold class->lock.
+ */
+static unsigned long obj_alloc(struct size_class *class, struct zspage *zspage,
+			unsigned long *handle)
+{
+	unsigned long *head;
+	u32 idx = zspage->freeobj;
+
+	BUG_ON(idx == OBJ_FREE_END);
+
+	head = get_header_atomic(class, zspage, idx, KM_USER0);
+	zspage->freeobj = *head >> 1;
+	*head = (unsigned long)handle | OBJ_ALLOCATED_TAG;
+	put_header_atomic(head, KM_USER0);
+
+	zspage->inuse++;
+	stat_add(&class->objs_used, 1);
+
+	return obj_location(zspage, idx);
+}
+
+/* Caller must hold class->lock */
+static void obj_free(struct size_class *class, struct zspage *zspage, u32 idx)
+{
+	unsigned long *head;
+
+	head = get_header_atomic(class, zspage, idx, KM_USER0);
+	*head = (unsigned long)zspage->freeobj << 1;
+	put_header_atomic(head, KM_USER0);
+
+	zspage->freeobj = idx;
+	zspage->inuse--;
+	stat_sub(&class->objs_used, 1);
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ *
+ * This function must be called before anything when using
+ * the zsmalloc allocator.
+ *
+ * On success, a pointer to the newly created pool is returned,
+ * otherwise NULL.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	struct zs_pool *pool;
+	struct size_class *class;
+	u32 i, fg;
+	int cpu;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[i];
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE
+						/ class->size;
+	}
+
+	/* One word per object; a kmalloc-32 object each would add up */
+	pool->handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(unsigned long), 0, 0, NULL);
+	if (!pool->handle_cachep)
+		goto fail;
+
+	pool->area = kcalloc(nr_cpu_ids, sizeof(*pool->area), GFP_KERNEL);
+	if (!pool->area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		pool->area[cpu].buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!pool->area[cpu].buf)
+			goto fail;
+	}
+
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	struct size_class *class;
+	struct zspage *zspage, *tmp;
+	u32 i, fg;
+	int cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[i];
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[fg], list) {
+				pr_info("zsmalloc: freeing zspage with %u "
+					"objects still in use\n",
+					zspage->inuse);
+				list_del(&zspage->list);
+				zspage->inuse = 0;
+				zspage->fullness = ZS_EMPTY;
+				free_zspage(class, zspage);
+			}
+		}
+	}
+
+	if (pool->area) {
+		for_each_possible_cpu(cpu)
+			kfree(pool->area[cpu].buf);
+		kfree(pool->area);
+	}
+	if (pool->handle_cachep)
+		kmem_cache_destroy(pool->handle_cachep);
+	kfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @flags: flags for the pages backing the allocation
+ *
+ * Returns a handle to the new object, or 0 on failure. The handle
+ * stays valid until zs_free(), even if the object is moved.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned long *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long obj;
+	u32 class_idx;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(pool->handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class_idx = get_size_class_index(size);
+	class = &pool->size_class[class_idx];
+
+	spin_lock(&class->lock);
+
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(class, class_idx, flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(pool->handle_cachep, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		stat_add(&class->pages_allocated, class->pages_per_zspage);
+		stat_add(&class->objs_allocated, class->objs_per_zspage);
+	}
+
+	obj = obj_alloc(class, zspage, handle);
+	*handle = obj << 1;
+	fix_fullness_group(class, zspage);
+
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned long *h = (unsigned long *)handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	u32 idx;
+
+	if (unlikely(!handle))
+		return;
+
+	/* Pinning keeps compaction from moving the object under us */
+	pin_handle(h);
+	zspage = location_to_zspage(handle_to_obj(h), &idx);
+	class = &pool->size_class[zspage->class_idx];
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, idx);
+	fix_fullness_group(class, zspage);
+	if (zspage->fullness == ZS_EMPTY)
+		free_zspage(class, zspage);
+	spin_unlock(&class->lock);
+
+	unpin_handle(h);
+	kmem_cache_free(pool->handle_cachep, h);
+}
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: whether the caller reads, writes or both
+ *
+ * The object is pinned until zs_unmap_object() and the caller runs
+ * atomically meanwhile: it must not sleep, and must not map a second
+ * object. KM_USER1 is used internally, so the caller can still have
+ * a page mapped at KM_USER0.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned long *h = (unsigned long *)handle;
+	struct mapping_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned long offset;
+	u32 idx;
+
+	pin_handle(h);
+
+	zspage = location_to_zspage(handle_to_obj(h), &idx);
+	class = &pool->size_class[zspage->class_idx];
+	offset = (unsigned long)idx * class->size;
+
+	area = &pool->area[smp_processor_id()];
+	area->mm = mm;
+
+	if ((offset & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		area->addr = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT],
+				KM_USER1);
+		return area->addr + (offset & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	/* The object straddles two pages; work on a copy */
+	area->addr = NULL;
+	if (mm != ZS_MM_WO)
+		copy_object_data(class, zspage, idx, ZS_HANDLE_SIZE, area->buf,
+				class->size - ZS_HANDLE_SIZE, 0);
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned long *h = (unsigned long *)handle;
+	struct mapping_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	u32 idx;
+
+	area = &pool->area[smp_processor_id()];
+	if (area->addr) {
+		kunmap_atomic(area->addr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		zspage = location_to_zspage(handle_to_obj(h), &idx);
+		class = &pool->size_class[zspage->class_idx];
+		copy_object_data(class, zspage, idx, ZS_HANDLE_SIZE, area->buf,
+				class->size - ZS_HANDLE_SIZE, 1);
+	}
+
+	unpin_handle(h);
+}
+
+/*
+ * Move objects from 'src' to 'dst' until 'src' is empty or 'dst' is full.
+ * Returns -EBUSY if an object is mapped, so 'src' can not be emptied now.
+ *
+ * Caller must hold class->lock.
+ */
+static int migrate_zspage(struct size_class *class, struct zspage *src,
+			struct zspage *dst)
+{
+	unsigned long *head, *handle;
+	unsigned long val, obj;
+	u32 idx, newidx;
+
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		if (dst->inuse == class->objs_per_zspage)
+			return 0;
+
+		head = get_header_atomic(class, src, idx, KM_USER0);
+		val = *head;
+		put_header_atomic(head, KM_USER0);
+		if (!(val & OBJ_ALLOCATED_TAG))
+			continue;
+
+		handle = (unsigned long *)(val & ~OBJ_ALLOCATED_TAG);
+		if (!trypin_handle(handle))
+			return -EBUSY;
+
+		obj = obj_alloc(class, dst, handle);
+		location_to_zspage(obj, &newidx);
+		move_object_data(class, src, idx, dst, newidx);
+		/* move_object_data() copied the header, which is the same */
+		obj_free(class, src, idx);
+		record_obj(handle, obj);
+
+		unpin_handle(handle);
+	}
+
+	return 0;
+}
+
+static unsigned long class_can_compact(struct size_class *class)
+{
+	u64 free = class->objs_allocated - class->objs_used;
+
+	do_div(free, class->objs_per_zspage);
+	return free * class->pages_per_zspage;
+}
+
+static unsigned long compact_class(struct size_class *class)
+{
+	struct list_head *sparse = &class->fullness_list[ZS_ALMOST_EMPTY];
+	struct list_head *dense = &class->fullness_list[ZS_ALMOST_FULL];
+	struct zspage *src, *dst;
+	unsigned long freed = 0;
+	int ret;
+
+	spin_lock(&class->lock);
+	while (class_can_compact(class)) {
+		/* Empty the sparsest zspages into the densest ones */
+		if (list_empty(sparse))
+			break;
+		src = list_entry(sparse->prev, struct zspage, list);
+
+		if (!list_empty(dense))
+			dst = list_first_entry(dense, struct zspage, list);
+		else if (sparse->next != &src->list)
+			dst = list_first_entry(sparse, struct zspage, list);
+		else
+			break;
+
+		ret = migrate_zspage(class, src, dst);
+
+		fix_fullness_group(class, dst);
+		fix_fullness_group(class, src);
+		if (src->fullness == ZS_EMPTY) {
+			free_zspage(class, src);
+			freed += class->pages_per_zspage;
+		}
+
+		if (ret)
+			break;
+
+		if (need_resched() || spin_needbreak(&class->lock)) {
+			spin_unlock(&class->lock);
+			cond_resched();
+			spin_lock(&class->lock);
+		}
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - free zspages by moving objects out of sparsely used ones
+ * @pool: pool to compact
+ *
+ * May sleep. Objects that are mapped are not moved. Returns the number
+ * of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	u32 i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += compact_class(&pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+
+/*
+ * Returns the number of pages zs_compact() could free, ignoring objects
+ * that are mapped.
+ */
+unsigned long zs_can_compact(struct zs_pool *pool)
+{
+	unsigned long pages = 0;
+	u32 i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages += class_can_compact(&pool->size_class[i]);
+
+	return pages;
+}
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	u64 pages = 0;
+	u32 i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages += pool->size_class[i].pages_allocated;
+
+	return pages << PAGE_SHIFT;
+}
+
+/*
+ * Returns the memory held in free objects of partially used zspages, i.e.
+ * the fragmentation that compaction can reclaim.
+ */
+u64 zs_get_slack_bytes(struct zs_pool *pool)
+{
+	struct size_class *class;
+	u64 bytes = 0;
+	u32 i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[i];
+		bytes += (class->objs_allocated - class->objs_used) *
+				class->size;
+	}
+
+	return bytes;
+}
+
+u64 zs_get_pages_compacted(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
@@ -0,0 +1,109 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <asm/atomic.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many 0-order pages, treated as one
+ * contiguous area that is split into objects of a single size class.
+ * Objects may straddle page boundaries, which keeps the tail waste small
+ * for sizes that do not divide PAGE_SIZE.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* Size classes are separated by ZS_SIZE_CLASS_DELTA bytes */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/* A zspage is almost full once this many quarters of it are in use */
+#define ZS_ALMOST_FULL_QUARTERS	3
+
+/* End of user params */
+
+/*
+ * Each object starts with a header word. For an allocated object it is
+ * the address of its handle with OBJ_ALLOCATED_TAG set, so that compaction
+ * can find and update the handle; for a free object it is the index of the
+ * next free object, shifted left by one.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+#define OBJ_ALLOCATED_TAG	1UL
+
+/*
+ * The handle holds the object location, shifted left by one: the page
+ * frame number of the zspage's first page and the object index within
+ * the zspage. Bit 0 is a lock that pins the object while it is mapped.
+ */
+#define HANDLE_PIN_BIT		0
+#define OBJ_INDEX_BITS		10
+#define OBJ_INDEX_MASK		((1UL << OBJ_INDEX_BITS) - 1)
+#define OBJ_FREE_END		OBJ_INDEX_MASK
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+
+	ZS_EMPTY,
+};
+
+struct zspage {
+	struct list_head list;		/* entry in class->fullness_list */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	u16 inuse;			/* no. of allocated objects */
+	u16 freeobj;			/* first free object, or OBJ_FREE_END */
+	u8 class_idx;
+	u8 fullness;
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+
+	u32 size;			/* object size, header included */
+	u32 pages_per_zspage;
+	u32 objs_per_zspage;
+
+	/* stats */
+	u64 pages_allocated;
+	u64 objs_allocated;		/* object slots in all zspages */
+	u64 objs_used;
+};
+
+/* Per-CPU state of a mapping, for objects that straddle two pages */
+struct mapping_area {
+	char *buf;			/* copy of the object */
+	void *addr;			/* kmap_atomic address, if not copied */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+	struct mapping_area *area;	/* indexed by CPU */
+	struct kmem_cache *handle_cachep;	/* handles, see zs_malloc() */
+
+	/* stats */
+	atomic_long_t pages_compacted;
+};
+
+#endif
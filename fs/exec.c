@@ -54,6 +54,7 @@
 #include <linux/kmod.h>
 #include <linux/fsnotify.h>
 #include <linux/fs_struct.h>
+#include <linux/oom.h>
 #include <linux/pipe_fs_i.h>
 
 #include <asm/uaccess.h>
@@ -900,6 +901,7 @@ static int de_thread(struct task_struct *tsk)
 		leader->exit_state = EXIT_DEAD;
 		write_unlock_irq(&tasklist_lock);
 
+		oom_adj_notify(OOM_ADJ_NOTIFY_SET, tsk);
 		release_task(leader);
 	}
 
@@ -1013,7 +1013,7 @@ static ssize_t oom_adjust_read(struct file *file, char __user *buf,
 static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 				size_t count, loff_t *ppos)
 {
-	struct task_struct *task;
+	struct task_struct *task, *leader;
 	char buffer[PROC_NUMBUF];
 	long oom_adjust;
 	unsigned long flags;
@@ -1047,10 +1047,15 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	}
 
 	task->signal->oom_adj = oom_adjust;
+	leader = task->group_leader;
+	get_task_struct(leader);
 
 	unlock_task_sighand(task, &flags);
 	put_task_struct(task);
 
+	oom_adj_notify(OOM_ADJ_NOTIFY_SET, leader);
+	put_task_struct(leader);
+
 	return count;
 }
 
@@ -97,6 +97,14 @@ extern const char *yaffs_guts_c_version;
 #define YAFFS_USE_WRITE_BEGIN_END 0
 #endif
 
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+#define YAFFS_USE_BACKGROUND_GC 1
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#else
+#define YAFFS_USE_BACKGROUND_GC 0
+#endif
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 28))
 static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 {
@@ -169,6 +177,7 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino);
 		} while(0)
 		
 static void yaffs_put_super(struct super_block *sb);
+static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data);
 
 static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 				loff_t *pos);
@@ -363,6 +372,7 @@ static const struct super_operations yaffs_super_ops = {
 	.put_inode = yaffs_put_inode,
 #endif
 	.put_super = yaffs_put_super,
+	.remount_fs = yaffs_remount_fs,
 	.delete_inode = yaffs_delete_inode,
 	.clear_inode = yaffs_clear_inode,
 	.sync_fs = yaffs_sync_fs,
@@ -382,6 +392,122 @@ static void yaffs_GrossUnlock(yaffs_Device *dev)
 	up(&dev->grossLock);
 }
 
+#if YAFFS_USE_BACKGROUND_GC
+/*-----------------------------------------------------------------*/
+/* Background garbage collection.
+ * Each yaffs2 mount gets a thread that does passive gc while nobody else
+ * is using the file system, so writers find erased blocks waiting instead
+ * of having to collect them first. The chunks a gc step copies are read
+ * without the gross lock; it is only held for the writes.
+ */
+
+#define YAFFS_BG_GC_IDLE_MS	500	/* We're busy, or just ran out of gc */
+#define YAFFS_BG_GC_MAX_IDLE_MS	32000	/* Idle waits double up to this */
+#define YAFFS_BG_GC_STEP_MS	20	/* Between steps on the same block */
+
+static int yaffs_BackgroundThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	yaffs_GCPrefetch *prefetch;
+	int maxPrefetch;
+	int nPrefetch;
+	unsigned long delay;
+	unsigned long idle = msecs_to_jiffies(YAFFS_BG_GC_IDLE_MS);
+	int i;
+
+	T(YAFFS_TRACE_GC, ("yaffs_background starting for %s\n",
+				   dev->name));
+
+	prefetch = kcalloc(YAFFS_PASSIVE_GC_COPIES, sizeof(yaffs_GCPrefetch),
+			   GFP_KERNEL);
+
+	/* Read ahead into as many buffers as we can get; with none the gc
+	 * steps just read the chunks themselves.
+	 */
+	for (maxPrefetch = 0;
+	     prefetch && maxPrefetch < YAFFS_PASSIVE_GC_COPIES; maxPrefetch++) {
+		prefetch[maxPrefetch].data =
+			kmalloc(dev->nDataBytesPerChunk, GFP_KERNEL);
+		if (!prefetch[maxPrefetch].data)
+			break;
+	}
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		try_to_freeze();
+
+		if (down_trylock(&dev->grossLock) != 0) {
+			/* Someone is writing: there may soon be gc to do */
+			delay = msecs_to_jiffies(YAFFS_BG_GC_IDLE_MS);
+			idle = delay;
+		} else {
+			nPrefetch = yaffs_GetBackgroundGCList(dev, prefetch,
+							      maxPrefetch);
+			yaffs_GrossUnlock(dev);
+
+			/* Nothing dirty: wait longer each time it stays so */
+			delay = idle;
+			idle = min(2 * idle,
+				   msecs_to_jiffies(YAFFS_BG_GC_MAX_IDLE_MS));
+
+			if (nPrefetch >= 0) {
+				yaffs_ReadBackgroundGCList(dev, prefetch,
+							   nPrefetch);
+
+				yaffs_GrossLock(dev);
+				yaffs_BackgroundGarbageCollect(dev, prefetch,
+							       nPrefetch);
+				yaffs_GrossUnlock(dev);
+
+				delay = msecs_to_jiffies(YAFFS_BG_GC_STEP_MS);
+				idle = msecs_to_jiffies(YAFFS_BG_GC_IDLE_MS);
+			}
+		}
+
+		schedule_timeout_interruptible(delay);
+	}
+
+	for (i = 0; i < maxPrefetch; i++)
+		kfree(prefetch[i].data);
+	kfree(prefetch);
+
+	T(YAFFS_TRACE_GC, ("yaffs_background stopping for %s\n",
+				   dev->name));
+
+	return 0;
+}
+
+static void yaffs_StartBackgroundThread(yaffs_Device *dev)
+{
+	struct super_block *sb = (struct super_block *)dev->superBlock;
+
+	dev->bgThread = kthread_run(yaffs_BackgroundThread, dev,
+				    "yaffs-bg-%d", MINOR(sb->s_dev));
+	if (IS_ERR(dev->bgThread)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: could not start background gc thread\n"));
+		dev->bgThread = NULL;
+	}
+}
+
+static void yaffs_StopBackgroundThread(yaffs_Device *dev)
+{
+	if (dev->bgThread) {
+		kthread_stop(dev->bgThread);
+		dev->bgThread = NULL;
+	}
+}
+#else
+static void yaffs_StartBackgroundThread(yaffs_Device *dev)
+{
+}
+
+static void yaffs_StopBackgroundThread(yaffs_Device *dev)
+{
+}
+#endif
+
 
 /*-----------------------------------------------------------------*/
 /* Directory search context allows us to unlock access to yaffs during
@@ -1856,7 +1982,6 @@ static void yaffs_read_inode(struct inode *inode)
 
 static YLIST_HEAD(yaffs_dev_list);
 
-#if 0 /* not used */
 static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 {
 	yaffs_Device    *dev = yaffs_SuperToDevice(sb);
@@ -1869,6 +1994,9 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 
 		yaffs_GrossLock(dev);
 
+		/* No more background gc; it would write behind the checkpoint */
+		dev->isReadOnly = 1;
+
 		yaffs_FlushEntireDeviceCache(dev);
 
 		yaffs_CheckpointSave(dev);
@@ -1877,14 +2005,22 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 			mtd->sync(mtd);
 
 		yaffs_GrossUnlock(dev);
+
+		yaffs_StopBackgroundThread(dev);
 	} else {
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RW\n", dev->name));
+
+		yaffs_GrossLock(dev);
+		dev->isReadOnly = 0;
+		yaffs_GrossUnlock(dev);
+
+		if (dev->isYaffs2 && !dev->noBackgroundGC && !dev->bgThread)
+			yaffs_StartBackgroundThread(dev);
 	}
 
 	return 0;
 }
-#endif
 
 static void yaffs_put_super(struct super_block *sb)
 {
@@ -1892,6 +2028,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_StopBackgroundThread(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -1944,6 +2082,7 @@ typedef struct {
 	int no_cache;
 	int empty_lost_and_found_overridden;
 	int empty_lost_and_found;
+	int no_background_gc;
 } yaffs_options;
 
 #define MAX_OPT_LEN 20
@@ -1978,6 +2117,8 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 			options->skip_checkpoint_read = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-write"))
 			options->skip_checkpoint_write = 1;
+		else if (!strcmp(cur_opt, "no-background-gc"))
+			options->no_background_gc = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint")) {
 			options->skip_checkpoint_read = 1;
 			options->skip_checkpoint_write = 1;
@@ -2209,6 +2350,8 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_ReadChunkWithTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
+		dev->readChunksWithTagsFromNAND =
+		    nandmtd2_ReadChunksWithTagsFromNAND;
 		dev->spareBuffer = YMALLOC(mtd->oobsize);
 		dev->isYaffs2 = 1;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -2304,6 +2447,11 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	dev->isReadOnly = (sb->s_flags & MS_RDONLY) ? 1 : 0;
+	dev->noBackgroundGC = options.no_background_gc;
+	if (dev->isYaffs2 && !dev->noBackgroundGC && !dev->isReadOnly)
+		yaffs_StartBackgroundThread(dev);
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2428,6 +2576,9 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
+	buf += sprintf(buf, "nGCPrefetchHits.... %d\n", dev->nGCPrefetchHits);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2962,6 +2962,28 @@ static int yaffs_GetErasedChunks(yaffs_Device *dev)
 
 }
 
+/* Use the background gc's copy of a chunk, if it has one that is still good */
+static int yaffs_ReadPrefetchedChunk(yaffs_Device *dev, yaffs_BlockInfo *bi,
+				int chunkInNAND, __u8 *buffer,
+				yaffs_ExtendedTags *tags)
+{
+	yaffs_GCPrefetch *p;
+	int i;
+
+	for (i = 0; i < dev->nGCPrefetch; i++) {
+		p = &dev->gcPrefetch[i];
+		if (p->chunk == chunkInNAND &&
+		    p->sequenceNumber == bi->sequenceNumber) {
+			memcpy(buffer, p->data, dev->nDataBytesPerChunk);
+			*tags = p->tags;
+			dev->nGCPrefetchHits++;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 		int wholeBlock)
 {
@@ -3022,7 +3044,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 		yaffs_VerifyBlock(dev, bi, block);
 
-		maxCopies = (wholeBlock) ? dev->nChunksPerBlock : 10;
+		maxCopies = (wholeBlock) ? dev->nChunksPerBlock : YAFFS_PASSIVE_GC_COPIES;
 		oldChunk = block * dev->nChunksPerBlock + dev->gcChunk;
 
 		for (/* init already done */;
@@ -3041,8 +3063,10 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 				yaffs_InitialiseTags(&tags);
 
-				yaffs_ReadChunkWithTagsFromNAND(dev, oldChunk,
-								buffer, &tags);
+				if (!yaffs_ReadPrefetchedChunk(dev, bi, oldChunk,
+							       buffer, &tags))
+					yaffs_ReadChunkWithTagsFromNAND(dev, oldChunk,
+									buffer, &tags);
 
 				object =
 				    yaffs_FindObjectByNumber(dev,
@@ -3288,6 +3312,114 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* Background gc.
+ * Done in three steps so that the NAND reads, which are most of the cost
+ * of copying a chunk, happen without the gross lock held:
+ * yaffs_GetBackgroundGCList() (locked) picks the block and lists the chunks
+ * the next passive step will copy, yaffs_ReadBackgroundGCList() (unlocked)
+ * reads them and yaffs_BackgroundGarbageCollect() (locked) does the step,
+ * which then only has to write.
+ *
+ * Returns the number of chunks to read or -1 if there is no gc to do.
+ */
+int yaffs_GetBackgroundGCList(yaffs_Device *dev, yaffs_GCPrefetch *prefetch,
+			      int maxPrefetch)
+{
+	yaffs_BlockInfo *bi;
+	int erasedChunks;
+	int block;
+	int c;
+	int n = 0;
+
+	if (dev->isDoingGC || dev->isReadOnly)
+		return -1;
+
+	if (dev->gcBlock <= 0) {
+		/* Only start on a block if a good part of the free space
+		 * is tied up in dirty blocks.
+		 */
+		erasedChunks = dev->nErasedBlocks * dev->nChunksPerBlock;
+		if (erasedChunks >= dev->nFreeChunks / 2)
+			return -1;
+
+		dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, 0);
+		dev->gcChunk = 0;
+	}
+
+	block = dev->gcBlock;
+	if (block <= 0)
+		return -1;
+
+	bi = yaffs_GetBlockInfo(dev, block);
+
+	if (!dev->readChunksWithTagsFromNAND ||
+	    bi->blockState == YAFFS_BLOCK_STATE_CHECKPOINT)
+		return 0;
+
+	for (c = dev->gcChunk; c < dev->nChunksPerBlock && n < maxPrefetch; c++) {
+		if (yaffs_CheckChunkBit(dev, block, c)) {
+			prefetch[n].chunk = block * dev->nChunksPerBlock + c;
+			prefetch[n].sequenceNumber = bi->sequenceNumber;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* Called without the gross lock, so only the driver's reentrant read is used.
+ * Chunks that fail to read here are read the usual way by the gc step.
+ */
+void yaffs_ReadBackgroundGCList(yaffs_Device *dev, yaffs_GCPrefetch *prefetch,
+				int nPrefetch)
+{
+	yaffs_GCPrefetch *p;
+	int i;
+
+	for (i = 0; i < nPrefetch; i++) {
+		p = &prefetch[i];
+		yaffs_InitialiseTags(&p->tags);
+		if (dev->readChunksWithTagsFromNAND(dev,
+						    p->chunk - dev->chunkOffset,
+						    1, p->data,
+						    &p->tags) != YAFFS_OK ||
+		    !p->tags.chunkUsed ||
+		    p->tags.eccResult != YAFFS_ECC_RESULT_NO_ERROR)
+			p->chunk = -1;
+	}
+}
+
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev,
+				   yaffs_GCPrefetch *prefetch, int nPrefetch)
+{
+	int block = dev->gcBlock;
+	int gcOk;
+
+	/* Foreground gc may have finished the block while we were reading,
+	 * or the file system been remounted read-only and checkpointed.
+	 */
+	if (dev->isDoingGC || dev->isReadOnly || block <= 0)
+		return YAFFS_OK;
+
+	dev->gcPrefetch = prefetch;
+	dev->nGCPrefetch = nPrefetch;
+
+	dev->garbageCollections++;
+	dev->passiveGarbageCollections++;
+	dev->backgroundGarbageCollections++;
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC block %d, %d chunks read ahead" TENDSTR),
+	   block, nPrefetch));
+
+	gcOk = yaffs_GarbageCollectBlock(dev, block, 0);
+
+	dev->gcPrefetch = NULL;
+	dev->nGCPrefetch = 0;
+
+	return gcOk;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -6119,6 +6251,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	yaffs_BlockIndex *blockIndex = NULL;
 	int altBlockIndex = 0;
 
+	yaffs_ExtendedTags *blockTags;
+
 	if (!dev->isYaffs2) {
 		T(YAFFS_TRACE_SCAN,
 		  (TSTR("yaffs_ScanBackwards is only for YAFFS2!" TENDSTR)));
@@ -6146,6 +6280,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 		return YAFFS_FAIL;
 	}
 
+	/* Tags for a whole block are read in one go if we can; if this
+	 * allocation fails we just read them a chunk at a time.
+	 */
+	blockTags = YMALLOC(dev->nChunksPerBlock * sizeof(yaffs_ExtendedTags));
+
 	dev->blocksInCheckpoint = 0;
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
@@ -6265,6 +6404,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		if (blockTags)
+			yaffs_ReadBlockTagsFromNAND(dev, blk, blockTags);
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6277,8 +6419,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (blockTags)
+				tags = blockTags[c];
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk,
+								NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6732,6 +6877,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	else
 		YFREE(blockIndex);
 
+	if (blockTags)
+		YFREE(blockTags);
+
 	/* Ok, we've done all the scanning.
 	 * Fix up the hard link chains.
 	 * We should now have scanned all the objects, now it's time to add these
@@ -7438,6 +7586,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
+	dev->backgroundGarbageCollections = 0;
+	dev->nGCPrefetchHits = 0;
 	dev->currentDirtyChecker = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
@@ -530,6 +530,22 @@ typedef struct {
 	int maxLine;
 } yaffs_TempBuffer;
 
+/*--------------------- Background gc read-ahead ----------
+ *
+ * The chunks the next passive gc step will copy, read without the gross
+ * lock held. A copy is only good while the block keeps the sequence number
+ * it had when the chunk was read.
+ */
+
+#define YAFFS_PASSIVE_GC_COPIES	10	/* Chunks copied per passive gc step */
+
+typedef struct {
+	int chunk;		/* Chunk in NAND, < 0 if the read failed */
+	__u32 sequenceNumber;
+	yaffs_ExtendedTags tags;
+	__u8 *data;
+} yaffs_GCPrefetch;
+
 /*----------------- Device ---------------------------------*/
 
 struct yaffs_DeviceStruct {
@@ -590,6 +606,13 @@ struct yaffs_DeviceStruct {
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
+	/* Optional: read consecutive chunks in one transfer. Must not use
+	 * shared device state as background gc calls it without the gross lock.
+	 */
+	int (*readChunksWithTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+					   int chunkInNAND, int nChunks,
+					   __u8 *data,
+					   yaffs_ExtendedTags *tags);
 #endif
 
 	int isYaffs2;
@@ -643,12 +666,18 @@ struct yaffs_DeviceStruct {
 
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
+	struct task_struct *bgThread;	/* Background gc, see yaffs_fs.c */
+	int noBackgroundGC;	/* "no-background-gc" mount option */
         struct ylist_head searchContexts;
 
 #endif
 
 	int isMounted;
 
+	int isReadOnly;		/* Mounted read-only, no background gc.
+				 * Protected by the gross lock.
+				 */
+
 	int isCheckpointed;
 
 
@@ -699,6 +728,8 @@ struct yaffs_DeviceStruct {
 	int isDoingGC;
 	int gcBlock;
 	int gcChunk;
+	yaffs_GCPrefetch *gcPrefetch;	/* Chunks read ahead by background gc */
+	int nGCPrefetch;
 
 	int nObjectsCreated;
 	yaffs_Object *freeObjects;
@@ -725,6 +756,8 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
+	int nGCPrefetchHits;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -900,6 +933,16 @@ int yaffs_DumpObject(yaffs_Object *obj);
 
 void yaffs_GutsTest(yaffs_Device *dev);
 
+/* Background gc. The list is set up and the gc step done under the gross
+ * lock; the reads in between are done without it.
+ */
+int yaffs_GetBackgroundGCList(yaffs_Device *dev, yaffs_GCPrefetch *prefetch,
+			      int maxPrefetch);
+void yaffs_ReadBackgroundGCList(yaffs_Device *dev, yaffs_GCPrefetch *prefetch,
+				int nPrefetch);
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev,
+				   yaffs_GCPrefetch *prefetch, int nPrefetch);
+
 /* A few useful functions */
 void yaffs_InitialiseTags(yaffs_ExtendedTags *tags);
 void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn);
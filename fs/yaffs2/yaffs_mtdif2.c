@@ -187,6 +187,66 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Read the tags, and optionally the data, of nChunks consecutive chunks
+ * with a single MTD call so the driver can stream the pages back to back.
+ * Nothing shared in the yaffs_Device is touched, so this may be called
+ * without the gross lock held.
+ * MTD reports ECC events for the whole transfer, not per page, so any ECC
+ * event fails the read and the caller falls back to reading chunk by chunk.
+ */
+int nandmtd2_ReadChunksWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
+					int nChunks, __u8 *data,
+					yaffs_ExtendedTags *tags)
+{
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	struct mtd_oob_ops ops;
+	int oobStride = mtd->oobavail;
+	loff_t addr = ((loff_t) chunkInNAND) * dev->totalBytesPerChunk;
+	yaffs_PackedTags2 pt;
+	__u8 *oob;
+	int retval;
+	int i;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR
+	   ("nandmtd2_ReadChunksWithTagsFromNAND chunk %d n %d data %p"
+	    TENDSTR), chunkInNAND, nChunks, data));
+
+	if (dev->inbandTags || oobStride < sizeof(pt))
+		return YAFFS_FAIL;
+
+	oob = YMALLOC(nChunks * oobStride);
+	if (!oob)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = nChunks * oobStride;
+	ops.len = data ? nChunks * dev->nDataBytesPerChunk : ops.ooblen;
+	ops.ooboffs = 0;
+	ops.datbuf = data;
+	ops.oobbuf = oob;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen) {
+		for (i = 0; i < nChunks; i++) {
+			memcpy(&pt, &oob[i * oobStride], sizeof(pt));
+			yaffs_UnpackTags2(&tags[i], &pt);
+		}
+	} else
+		retval = -EIO;
+
+	YFREE(oob);
+
+	if (retval == 0)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+#else
+	return YAFFS_FAIL;
+#endif
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
@@ -53,6 +53,39 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/* Read the tags of every chunk in a block, for scanning.
+ * The driver gets to do this as one transfer if it can; otherwise, or if
+ * that transfer saw an ECC event, it is done a chunk at a time.
+ */
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+				yaffs_ExtendedTags *tags)
+{
+	int chunkInNAND = blockInNAND * dev->nChunksPerBlock;
+	yaffs_BlockInfo *bi;
+	int i;
+
+	if (dev->readChunksWithTagsFromNAND &&
+	    dev->readChunksWithTagsFromNAND(dev,
+					    chunkInNAND - dev->chunkOffset,
+					    dev->nChunksPerBlock, NULL,
+					    tags) == YAFFS_OK) {
+		dev->nPageReads += dev->nChunksPerBlock;
+
+		bi = yaffs_GetBlockInfo(dev, blockInNAND);
+		for (i = 0; i < dev->nChunksPerBlock; i++)
+			if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR)
+				yaffs_HandleChunkError(dev, bi);
+
+		return YAFFS_OK;
+	}
+
+	for (i = 0; i < dev->nChunksPerBlock; i++)
+		yaffs_ReadChunkWithTagsFromNAND(dev, chunkInNAND + i, NULL,
+						&tags[i]);
+
+	return YAFFS_OK;
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
@@ -0,0 +1,42 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  A small implementation of the LZ4 block format, tuned for compressing
+ *  single pages: much faster than LZO at the cost of some ratio.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MEM_COMPRESS	((1 << LZ4_HASH_LOG) * sizeof(u32))
+
+#define lz4_compressbound(x)	((x) + ((x) / 255) + 16)
+
+/*
+ * This requires 'wrkmem' of size LZ4_MEM_COMPRESS.  On entry *dst_len is
+ * the size of 'dst'; compressing into lz4_compressbound(src_len) bytes
+ * never fails.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * Safe decompression with overrun testing.  On entry *dst_len is the size
+ * of 'dst', on return the number of bytes decompressed.
+ */
+int lz4_decompress_unknownoutputsize(const unsigned char *src,
+		size_t src_len, unsigned char *dst, size_t *dst_len);
+
+/*
+ * Return values (< 0 = Error)
+ */
+#define LZ4_E_OK		0
+#define LZ4_E_OUTPUT_OVERRUN	(-1)
+#define LZ4_E_INPUT_OVERRUN	(-2)
+#define LZ4_E_LOOKBEHIND	(-3)
+
+#endif
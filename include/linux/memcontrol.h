@@ -52,6 +52,8 @@ extern int mem_cgroup_try_charge_swapin(struct mm_struct *mm,
 extern void mem_cgroup_commit_charge_swapin(struct page *page,
 					struct mem_cgroup *ptr);
 extern void mem_cgroup_cancel_charge_swapin(struct mem_cgroup *ptr);
+extern void mem_cgroup_count_swapin(struct page *page);
+extern void mem_cgroup_count_swapout(struct page *page);
 
 extern int mem_cgroup_cache_charge(struct page *page, struct mm_struct *mm,
 					gfp_t gfp_mask);
@@ -160,6 +162,14 @@ static inline void mem_cgroup_cancel_charge_swapin(struct mem_cgroup *ptr)
 {
 }
 
+static inline void mem_cgroup_count_swapin(struct page *page)
+{
+}
+
+static inline void mem_cgroup_count_swapout(struct page *page)
+{
+}
+
 static inline void mem_cgroup_uncharge_start(void)
 {
 }
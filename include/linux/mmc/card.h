@@ -10,7 +10,9 @@
 #ifndef LINUX_MMC_CARD_H
 #define LINUX_MMC_CARD_H
 
+#include <linux/string.h>
 #include <linux/mmc/core.h>
+#include <linux/mmc/mmc.h>
 
 struct mmc_cid {
 	unsigned int		manfid;
@@ -45,6 +47,10 @@ struct mmc_ext_csd {
 	unsigned int		sa_timeout;		/* Units: 100ns */
 	unsigned int		hs_max_dtr;
 	unsigned int		sectors;
+	unsigned int		cache_size;		/* Units: KiB */
+	unsigned int		cache_ctrl:1;		/* cache enabled */
+	u8			max_packed_writes;
+	u8			max_packed_reads;
 };
 
 struct sd_scr {
@@ -147,6 +153,35 @@ static inline int mmc_blksz_for_byte_mode(const struct mmc_card *c)
 	return c->quirks & MMC_QUIRK_BLKSZ_FOR_BYTE_MODE;
 }
 
+/*
+ * Packed write header: a word with version, direction and entry count,
+ * then the block count and card address of each entry, in the 8 byte
+ * slots after the first. One header block holds MMC_PACKED_MAX_ENTRIES.
+ */
+#define MMC_PACKED_HDR_SIZE	512
+#define MMC_PACKED_MAX_ENTRIES	(MMC_PACKED_HDR_SIZE / 8 - 1)
+
+static inline void mmc_packed_hdr_init(__le32 *hdr, unsigned int num)
+{
+	memset(hdr, 0, MMC_PACKED_HDR_SIZE);
+	hdr[0] = cpu_to_le32((num << 16) | (MMC_PACKED_CMD_WR << 8) |
+			     MMC_PACKED_CMD_VER);
+}
+
+/* Fill in entry i (from 0); fails if the header has no room for it */
+static inline int mmc_packed_hdr_set(const struct mmc_card *card,
+				     __le32 *hdr, unsigned int i,
+				     u32 blocks, u32 sector)
+{
+	if (i >= MMC_PACKED_MAX_ENTRIES)
+		return -EINVAL;
+
+	hdr[(i + 1) * 2] = cpu_to_le32(blocks);
+	hdr[(i + 1) * 2 + 1] = cpu_to_le32(mmc_card_blockaddr(card) ?
+					   sector : sector << 9);
+	return 0;
+}
+
 #define mmc_card_name(c)	((c)->cid.prod_name)
 #define mmc_card_id(c)		(dev_name(&(c)->dev))
 
@@ -82,6 +82,18 @@ struct mmc_host_ops {
 	 */
 	int (*enable)(struct mmc_host *host);
 	int (*disable)(struct mmc_host *host, int lazy);
+	/*
+	 * It is optional for the host to implement pre_req and post_req in
+	 * order to support double buffering of requests (prepare one
+	 * request while another request is active).
+	 * pre_req() must always be followed by a post_req().
+	 * To undo a call made to pre_req(), call post_req() with
+	 * a nonzero err condition.
+	 */
+	void	(*post_req)(struct mmc_host *host, struct mmc_request *req,
+			    int err);
+	void	(*pre_req)(struct mmc_host *host, struct mmc_request *req,
+			   bool is_first_req);
 	void	(*request)(struct mmc_host *host, struct mmc_request *req);
 	/*
 	 * Avoid calling these three functions too often or in a "fast path",
@@ -156,6 +168,8 @@ struct mmc_host {
 #define MMC_CAP_DISABLE		(1 << 7)	/* Can the host be disabled */
 #define MMC_CAP_NONREMOVABLE	(1 << 8)	/* Nonremovable e.g. eMMC */
 #define MMC_CAP_WAIT_WHILE_BUSY	(1 << 9)	/* Waits while card is busy */
+#define MMC_CAP_CACHE_CTRL	(1 << 10)	/* Allow the eMMC cache on */
+#define MMC_CAP_PACKED_WR	(1 << 11)	/* Use packed write commands */
 
 	mmc_pm_flag_t		pm_caps;	/* supported pm features */
 
@@ -218,6 +232,17 @@ struct mmc_host {
 
 	struct dentry		*debugfs_root;
 
+	struct mmc_async_req	*areq;		/* active async req */
+
+	/* Data the CPU copies instead of the host DMAing it in place */
+	struct {
+		unsigned long	direct_reqs;	/* sg list mapped from the bio */
+		unsigned long	bounce_reqs;	/* copied via the bounce buffer */
+		u64		bounce_bytes;
+		unsigned long	pio_reqs;	/* host fell back to PIO */
+		u64		pio_bytes;
+	} bounce;
+
 #ifdef CONFIG_MMC_EMBEDDED_SDIO
 	struct {
 		struct sdio_cis			*cis;
@@ -254,6 +254,8 @@ struct _mmc_csd {
  * EXT_CSD fields
  */
 
+#define EXT_CSD_FLUSH_CACHE	32	/* W */
+#define EXT_CSD_CACHE_CTRL	33	/* R/W */
 #define EXT_CSD_BUS_WIDTH	183	/* R/W */
 #define EXT_CSD_HS_TIMING	185	/* R/W */
 #define EXT_CSD_CARD_TYPE	196	/* RO */
@@ -262,6 +264,9 @@ struct _mmc_csd {
 #define EXT_CSD_SEC_CNT		212	/* RO, 4 bytes */
 #define EXT_CSD_S_A_TIMEOUT	217
 #define EXT_CSD_BOOT_SIZE_MULTI	226
+#define EXT_CSD_CACHE_SIZE	249	/* RO, 4 bytes */
+#define EXT_CSD_MAX_PACKED_WRITES	500	/* RO */
+#define EXT_CSD_MAX_PACKED_READS	501	/* RO */
 /*
  * EXT_CSD field definitions
  */
@@ -278,6 +283,15 @@ struct _mmc_csd {
 #define EXT_CSD_BUS_WIDTH_4	1	/* Card is in 4 bit mode */
 #define EXT_CSD_BUS_WIDTH_8	2	/* Card is in 8 bit mode */
 
+/*
+ * Packed commands (eMMC 4.5): CMD23 with the packed bit announces a
+ * header block followed by the data of each packed request.
+ */
+#define MMC_CMD23_ARG_PACKED	(1 << 30)
+
+#define MMC_PACKED_CMD_VER	0x01
+#define MMC_PACKED_CMD_WR	0x02
+
 /*
  * MMC_SWITCH access modes
  */
@@ -14,6 +14,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -32,6 +33,21 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events on the oom_adj notifier chain, which lets a kill policy outside of
+ * the OOM killer follow each thread group's oom_adj without scanning the
+ * task list. The data passed along is the task concerned.
+ */
+enum oom_adj_event {
+	OOM_ADJ_NOTIFY_SET,	/* group created, oom_adj written, or leader
+				 * replaced by exec */
+	OOM_ADJ_NOTIFY_EXIT,	/* task is exiting */
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(enum oom_adj_event event, struct task_struct *task);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
@@ -32,16 +32,30 @@ enum stat_item {
 	DEACTIVATE_TO_TAIL,	/* Cpu slab was moved to the tail of partials */
 	DEACTIVATE_REMOTE_FREES,/* Slab contained remotely freed objects */
 	ORDER_FALLBACK,		/* Number of times fallback was necessary */
+	CMPXCHG_DOUBLE_CPU_FAIL,/* Failure of the lockless fastpath cmpxchg */
+	CPU_PARTIAL_ALLOC,	/* Cpu slab acquired from cpu partial list */
+	CPU_PARTIAL_FREE,	/* Slab put onto cpu partial list on free */
 	NR_SLUB_STAT_ITEMS };
 
+/*
+ * freelist and tid must stay adjacent: the lockless fastpath replaces
+ * both with a single cmpxchg_double_local().
+ */
 struct kmem_cache_cpu {
 	void **freelist;	/* Pointer to first free per cpu object */
+	unsigned long tid;	/* Bumped on every change of freelist */
 	struct page *page;	/* The slab from which we are allocating */
+	struct list_head partial;	/* Frozen slabs with free objects */
+	int nr_partial;		/* Number of slabs on the partial list */
 	int node;		/* The node of the page (or -1 for debug) */
 #ifdef CONFIG_SLUB_STATS
 	unsigned stat[NR_SLUB_STAT_ITEMS];
 #endif
-};
+}
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+__attribute__((__aligned__(2 * sizeof(void *))))
+#endif
+;
 
 struct kmem_cache_node {
 	spinlock_t list_lock;	/* Protect partial list and nr_partial */
@@ -84,6 +98,7 @@ struct kmem_cache {
 	int inuse;		/* Offset to metadata */
 	int align;		/* Alignment */
 	unsigned long min_partial;
+	int cpu_partial;	/* Max slabs on each cpu partial list */
 	const char *name;	/* Name (only for display!) */
 	struct list_head list;	/* List of slab caches */
 #ifdef CONFIG_SLUB_DEBUG
@@ -0,0 +1,58 @@
+#ifndef __LINUX_VMPRESSURE_H
+#define __LINUX_VMPRESSURE_H
+
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/gfp.h>
+#include <linux/types.h>
+
+enum vmpressure_levels {
+	VMPRESSURE_LOW = 0,
+	VMPRESSURE_MEDIUM,
+	VMPRESSURE_CRITICAL,
+	VMPRESSURE_NUM_LEVELS,
+};
+
+struct vmpressure {
+	/* Pages scanned and reclaimed since the last level was computed */
+	unsigned long scanned;
+	unsigned long reclaimed;
+	spinlock_t sr_lock;
+
+	/* Number of events at or above each level, for poll() */
+	unsigned long events[VMPRESSURE_NUM_LEVELS];
+	enum vmpressure_levels last_level;
+	wait_queue_head_t wait;
+
+	/* eventfd listeners, registered through memory.pressure_level */
+	struct list_head listeners;
+	struct mutex listeners_lock;
+
+	struct work_struct work;
+};
+
+struct mem_cgroup;
+struct eventfd_ctx;
+
+extern void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
+		       unsigned long scanned, unsigned long reclaimed);
+extern void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio);
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+extern void vmpressure_init(struct vmpressure *vmpr);
+extern void vmpressure_cleanup(struct vmpressure *vmpr);
+extern int vmpressure_register_event(struct mem_cgroup *memcg,
+				     struct eventfd_ctx *eventfd,
+				     const char *args);
+extern void vmpressure_unregister_event(struct mem_cgroup *memcg,
+					struct eventfd_ctx *eventfd);
+
+/* Provided by memcontrol.c; NULL means the root (global) pressure */
+extern struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *memcg);
+extern struct mem_cgroup *vmpressure_parent_memcg(struct vmpressure *vmpr);
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR */
+
+#endif /* __LINUX_VMPRESSURE_H */
@@ -0,0 +1,28 @@
+/*
+ *  lz4defs.h -- LZ4 block format constants
+ *
+ *  A block is a series of sequences.  Each sequence is a token byte, whose
+ *  high nibble is the literal run length and low nibble the match length
+ *  minus MINMATCH (15 in either nibble means more length bytes follow, each
+ *  adding up to 255), the literals, and a little-endian 16-bit match
+ *  offset.  The last sequence has literals only.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define MINMATCH	4
+#define MAX_DISTANCE	0xffff
+
+/* The last match must start at least MFLIMIT bytes before the end */
+#define MFLIMIT		12
+/* ... and the last LASTLITERALS bytes are always literals */
+#define LASTLITERALS	5
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_MASK	((1U << (8 - ML_BITS)) - 1)
+
+/* Search step grows by one every 1 << SKIP_STRENGTH misses */
+#define SKIP_STRENGTH	6
@@ -14,6 +14,8 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 #include "internal.h"
 
 /*
@@ -38,6 +40,9 @@ struct compact_control {
 	unsigned int order;		/* order a direct compactor needs */
 	int migratetype;		/* MOVABLE, RECLAIMABLE etc */
 	struct zone *zone;
+
+	bool proactive;			/* kcompactd ahead of demand */
+	int score_low;			/* proactive: target unusable index */
 };
 
 static unsigned long release_freepages(struct list_head *freelist)
@@ -361,6 +366,11 @@ static int compact_finished(struct zone *zone,
 	if (cc->order == -1)
 		return COMPACT_CONTINUE;
 
+	/* Proactive: continue until enough free memory is in large blocks */
+	if (cc->proactive)
+		return unusable_index(zone, cc->order) > cc->score_low ?
+					COMPACT_CONTINUE : COMPACT_PARTIAL;
+
 	/* Direct compactor: Is a suitable page free? */
 	for (order = cc->order; order < MAX_ORDER; order++) {
 		/* Job done if page is free of the right migratetype */
@@ -512,6 +522,212 @@ unsigned long try_to_compact_pages(struct zonelist *zonelist,
 	return rc;
 }
 
+/*
+ * kcompactd compacts zones in the background, so that high-order
+ * allocations find free blocks without entering direct compaction.
+ *
+ * It is woken when an allocation above PAGE_ALLOC_COSTLY_ORDER misses the
+ * fast path, and compacts for that order. Every sleep_millisecs it also
+ * checks the unusable free space index of each zone for
+ * kcompactd_order: the fraction of free memory in blocks too small for
+ * it. proactiveness (0-100) sets how much of that is tolerated. A zone
+ * is compacted when its index rises 10% above (100 - proactiveness)%,
+ * down to (100 - proactiveness)%. 0 disables proactive compaction.
+ */
+static unsigned int kcompactd_order = PAGE_ALLOC_COSTLY_ORDER + 1;
+static unsigned int kcompactd_proactiveness = 20;
+static unsigned int kcompactd_sleep_millisecs = 500;
+
+static int kcompactd_score_low(void)
+{
+	return (100 - kcompactd_proactiveness) * 10;
+}
+
+static int kcompactd_score_high(void)
+{
+	return min(kcompactd_score_low() + 100, 1000);
+}
+
+static bool kcompactd_zone_suitable(struct zone *zone, int order,
+					bool proactive)
+{
+	unsigned long watermark;
+
+	/* Compaction needs free order-0 pages to migrate into */
+	watermark = low_wmark_pages(zone) + (2UL << order);
+	if (!zone_watermark_ok(zone, 0, watermark, 0, 0))
+		return false;
+
+	if (proactive)
+		return unusable_index(zone, order) > kcompactd_score_high();
+
+	if (zone_watermark_ok(zone, order, low_wmark_pages(zone), 0, 0))
+		return false;
+
+	/* Only compact if a failure would be due to fragmentation */
+	return fragmentation_index(zone, order) > sysctl_extfrag_threshold;
+}
+
+/*
+ * Compact the zones of a node that need it for 'order'. Returns false if
+ * zones were compacted but none of them reached its target.
+ */
+static bool kcompactd_do_work(pg_data_t *pgdat, int order, bool proactive)
+{
+	int zoneid, compacted = 0, succeeded = 0;
+	struct zone *zone;
+	bool success;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct compact_control cc = {
+			.nr_freepages = 0,
+			.nr_migratepages = 0,
+			.order = order,
+			.migratetype = MIGRATE_MOVABLE,
+			.proactive = proactive,
+			.score_low = kcompactd_score_low(),
+		};
+
+		zone = &pgdat->node_zones[zoneid];
+		if (!populated_zone(zone))
+			continue;
+
+		if (!kcompactd_zone_suitable(zone, order, proactive))
+			continue;
+
+		if (!compacted++)
+			count_vm_event(KCOMPACTD_WAKE);
+
+		cc.zone = zone;
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		compact_zone(zone, &cc);
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+
+		if (proactive)
+			success = unusable_index(zone, order) <= cc.score_low;
+		else
+			success = zone_watermark_ok(zone, order,
+					low_wmark_pages(zone), 0, 0);
+
+		if (success) {
+			count_vm_event(KCOMPACTD_SUCCESS);
+			succeeded++;
+		} else {
+			count_vm_event(KCOMPACTD_FAIL);
+		}
+
+		if (kthread_should_stop())
+			break;
+	}
+
+	return !compacted || succeeded;
+}
+
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	unsigned int defer_shift = 0, deferred = 0;
+	long timeout;
+	int order;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		timeout = kcompactd_proactiveness ?
+			msecs_to_jiffies(kcompactd_sleep_millisecs) :
+			MAX_SCHEDULE_TIMEOUT;
+		wait_event_freezable_timeout(pgdat->kcompactd_wait,
+			pgdat->kcompactd_max_order || kthread_should_stop(),
+			timeout);
+		if (kthread_should_stop())
+			break;
+
+		order = pgdat->kcompactd_max_order;
+		pgdat->kcompactd_max_order = 0;
+		if (order) {
+			kcompactd_do_work(pgdat, order, false);
+			continue;
+		}
+
+		if (!kcompactd_proactiveness)
+			continue;
+
+		/* Back off while proactive compaction achieves nothing */
+		if (deferred) {
+			deferred--;
+			continue;
+		}
+
+		if (kcompactd_do_work(pgdat, kcompactd_order, true)) {
+			defer_shift = 0;
+		} else {
+			if (defer_shift < COMPACT_MAX_DEFER_SHIFT)
+				defer_shift++;
+			deferred = 1 << defer_shift;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * A high-order allocation had to leave the fast path: let kcompactd
+ * prepare blocks of that order.
+ */
+void wakeup_kcompactd(struct zone *zone, int order)
+{
+	pg_data_t *pgdat;
+
+	if (!populated_zone(zone))
+		return;
+
+	pgdat = zone->zone_pgdat;
+	if (pgdat->kcompactd_max_order < order)
+		pgdat->kcompactd_max_order = order;
+	if (!waitqueue_active(&pgdat->kcompactd_wait))
+		return;
+	wake_up_interruptible(&pgdat->kcompactd_wait);
+}
+
+/*
+ * This kcompactd start function will be called by init and node-hot-add.
+ */
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	pgdat->kcompactd = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(pgdat->kcompactd)) {
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		pgdat->kcompactd = NULL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.
+ */
+void kcompactd_stop(int nid)
+{
+	struct task_struct *kcompactd = NODE_DATA(nid)->kcompactd;
+
+	if (kcompactd) {
+		kthread_stop(kcompactd);
+		NODE_DATA(nid)->kcompactd = NULL;
+	}
+}
 
 /* Compact all zones within a node */
 static int compact_node(int nid)
@@ -583,6 +799,114 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+#ifdef CONFIG_SYSFS
+#define KCOMPACTD_ATTR(_name) \
+	static struct kobj_attribute _name##_attr = \
+		__ATTR(_name, 0644, _name##_show, _name##_store)
+
+static ssize_t order_show(struct kobject *kobj,
+			  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", kcompactd_order);
+}
+
+static ssize_t order_store(struct kobject *kobj,
+			   struct kobj_attribute *attr,
+			   const char *buf, size_t count)
+{
+	unsigned long order;
+	int err;
+
+	err = strict_strtoul(buf, 10, &order);
+	if (err || !order || order >= MAX_ORDER)
+		return -EINVAL;
+
+	kcompactd_order = order;
+
+	return count;
+}
+KCOMPACTD_ATTR(order);
+
+static ssize_t proactiveness_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", kcompactd_proactiveness);
+}
+
+static ssize_t proactiveness_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	unsigned long proactiveness;
+	int nid;
+	int err;
+
+	err = strict_strtoul(buf, 10, &proactiveness);
+	if (err || proactiveness > 100)
+		return -EINVAL;
+
+	kcompactd_proactiveness = proactiveness;
+
+	/* kcompactd sleeps without a timeout while proactiveness is 0 */
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		wake_up_interruptible(&NODE_DATA(nid)->kcompactd_wait);
+
+	return count;
+}
+KCOMPACTD_ATTR(proactiveness);
+
+static ssize_t sleep_millisecs_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", kcompactd_sleep_millisecs);
+}
+
+static ssize_t sleep_millisecs_store(struct kobject *kobj,
+				     struct kobj_attribute *attr,
+				     const char *buf, size_t count)
+{
+	unsigned long msecs;
+	int err;
+
+	err = strict_strtoul(buf, 10, &msecs);
+	if (err || !msecs || msecs > UINT_MAX)
+		return -EINVAL;
+
+	kcompactd_sleep_millisecs = msecs;
+
+	return count;
+}
+KCOMPACTD_ATTR(sleep_millisecs);
+
+static struct attribute *kcompactd_attrs[] = {
+	&order_attr.attr,
+	&proactiveness_attr.attr,
+	&sleep_millisecs_attr.attr,
+	NULL,
+};
+
+static struct attribute_group kcompactd_attr_group = {
+	.attrs = kcompactd_attrs,
+	.name = "compaction",
+};
+#endif /* CONFIG_SYSFS */
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+
+#ifdef CONFIG_SYSFS
+	if (sysfs_create_group(mm_kobj, &kcompactd_attr_group))
+		printk(KERN_ERR "kcompactd: register sysfs failed\n");
+#endif
+	return 0;
+}
+
+module_init(kcompactd_init)
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 ssize_t sysfs_compact_node(struct sys_device *dev,
 			struct sysdev_attribute *attr,
@@ -47,6 +47,8 @@
 #include <linux/mm_inline.h>
 #include <linux/page_cgroup.h>
 #include <linux/cpu.h>
+#include <linux/oom.h>
+#include <linux/vmpressure.h>
 #include "internal.h"
 
 #include <asm/uaccess.h>
@@ -86,6 +88,8 @@ enum mem_cgroup_stat_index {
 	MEM_CGROUP_STAT_PGPGIN_COUNT,	/* # of pages paged in */
 	MEM_CGROUP_STAT_PGPGOUT_COUNT,	/* # of pages paged out */
 	MEM_CGROUP_STAT_SWAPOUT, /* # of pages, swapped out */
+	MEM_CGROUP_STAT_PSWPIN_COUNT,	/* # of pages read in from swap */
+	MEM_CGROUP_STAT_PSWPOUT_COUNT,	/* # of pages written to swap */
 	MEM_CGROUP_EVENTS,	/* incremented at every  pagein/pageout */
 
 	MEM_CGROUP_STAT_NSTATS,
@@ -109,6 +113,8 @@ struct mem_cgroup_per_zone {
 	struct rb_node		tree_node;	/* RB tree node */
 	unsigned long long	usage_in_excess;/* Set to the value by which */
 						/* the soft limit is exceeded*/
+	int			soft_priority;	/* soft_limit_priority when */
+						/* put on the tree */
 	bool			on_tree;
 	struct mem_cgroup	*mem;		/* Back pointer, we cannot */
 						/* use container_of	   */
@@ -226,6 +232,11 @@ struct mem_cgroup {
 	atomic_t	refcnt;
 
 	unsigned int	swappiness;
+	/*
+	 * Order of soft limit reclaim: groups with a higher priority are
+	 * reclaimed from first, like oom_adj.
+	 */
+	int		soft_limit_priority;
 	/* OOM-Killer disable */
 	int		oom_kill_disable;
 
@@ -244,6 +255,9 @@ struct mem_cgroup {
 	/* For oom notifier event fd */
 	struct list_head oom_notify;
 
+	/* reclaim efficiency, for memory.pressure_level */
+	struct vmpressure vmpressure;
+
 	/*
 	 * Should we move charges of a task when a task is moved into this
 	 * mem_cgroup ? And what type of charges should we move ?
@@ -395,17 +409,24 @@ __mem_cgroup_insert_exceeded(struct mem_cgroup *mem,
 	mz->usage_in_excess = new_usage_in_excess;
 	if (!mz->usage_in_excess)
 		return;
+	mz->soft_priority = mem->soft_limit_priority;
+	/*
+	 * Sorted by soft_limit_priority, then by excess: the rightmost
+	 * node is reclaimed from first.
+	 */
 	while (*p) {
 		parent = *p;
 		mz_node = rb_entry(parent, struct mem_cgroup_per_zone,
 					tree_node);
-		if (mz->usage_in_excess < mz_node->usage_in_excess)
+		if (mz->soft_priority < mz_node->soft_priority ||
+		    (mz->soft_priority == mz_node->soft_priority &&
+		     mz->usage_in_excess < mz_node->usage_in_excess))
 			p = &(*p)->rb_left;
 		/*
 		 * We can't avoid mem cgroups that are over their soft
 		 * limit by the same amount
 		 */
-		else if (mz->usage_in_excess >= mz_node->usage_in_excess)
+		else
 			p = &(*p)->rb_right;
 	}
 	rb_link_node(&mz->tree_node, parent, p);
@@ -485,6 +506,33 @@ static void mem_cgroup_remove_from_trees(struct mem_cgroup *mem)
 	}
 }
 
+/*
+ * Move the zones of @mem to the place of its new soft_limit_priority in
+ * the trees.
+ */
+static void mem_cgroup_resort_trees(struct mem_cgroup *mem)
+{
+	int node, zone;
+	unsigned long long excess;
+	struct mem_cgroup_per_zone *mz;
+	struct mem_cgroup_tree_per_zone *mctz;
+
+	for_each_node_state(node, N_POSSIBLE) {
+		for (zone = 0; zone < MAX_NR_ZONES; zone++) {
+			mz = mem_cgroup_zoneinfo(mem, node, zone);
+			mctz = soft_limit_tree_node_zone(node, zone);
+			spin_lock(&mctz->lock);
+			if (mz->on_tree) {
+				excess = mz->usage_in_excess;
+				__mem_cgroup_remove_exceeded(mem, mz, mctz);
+				__mem_cgroup_insert_exceeded(mem, mz, mctz,
+							     excess);
+			}
+			spin_unlock(&mctz->lock);
+		}
+	}
+}
+
 static inline unsigned long mem_cgroup_get_excess(struct mem_cgroup *mem)
 {
 	return res_counter_soft_limit_excess(&mem->res) >> PAGE_SHIFT;
@@ -1488,6 +1536,26 @@ static bool consume_stock(struct mem_cgroup *mem)
 	return ret;
 }
 
+/*
+ * Give back the charge of an uncharged page to the local stock, if it
+ * caches charges of @mem and has room, rather than to the res_counter.
+ * With many groups, this keeps res_counter updates, which go up the whole
+ * hierarchy, off the uncharge path of the running task.
+ */
+static bool uncharge_to_stock(struct mem_cgroup *mem)
+{
+	struct memcg_stock_pcp *stock;
+	bool ret = false;
+
+	stock = &get_cpu_var(memcg_stock);
+	if (mem == stock->cached && stock->charge < CHARGE_SIZE) {
+		stock->charge += PAGE_SIZE;
+		ret = true;
+	}
+	put_cpu_var(memcg_stock);
+	return ret;
+}
+
 /*
  * Returns stocks cached in percpu to res_counter and reset cached information.
  */
@@ -2179,6 +2247,48 @@ void mem_cgroup_commit_charge_swapin(struct page *page, struct mem_cgroup *ptr)
 					MEM_CGROUP_CHARGE_TYPE_MAPPED);
 }
 
+/*
+ * Count a swap read against the group that swapped the page out, as
+ * recorded by swap accounting, or else against the group of the task
+ * reading it in.  Swap cache hits are not reads and are not counted.
+ */
+void mem_cgroup_count_swapin(struct page *page)
+{
+	struct mem_cgroup *mem;
+
+	if (mem_cgroup_disabled())
+		return;
+
+	mem = try_get_mem_cgroup_from_page(page);
+	if (!mem)
+		mem = try_get_mem_cgroup_from_mm(current->mm);
+	if (!mem)
+		return;
+	this_cpu_inc(mem->stat->count[MEM_CGROUP_STAT_PSWPIN_COUNT]);
+	css_put(&mem->css);
+}
+
+/*
+ * Count a page written to swap against the group it is charged to.  This
+ * does not need swap accounting (memsw).
+ */
+void mem_cgroup_count_swapout(struct page *page)
+{
+	struct page_cgroup *pc;
+
+	if (mem_cgroup_disabled())
+		return;
+
+	pc = lookup_page_cgroup(page);
+	if (unlikely(!pc))
+		return;
+	lock_page_cgroup(pc);
+	if (PageCgroupUsed(pc))
+		this_cpu_inc(pc->mem_cgroup->stat->count[
+					MEM_CGROUP_STAT_PSWPOUT_COUNT]);
+	unlock_page_cgroup(pc);
+}
+
 void mem_cgroup_cancel_charge_swapin(struct mem_cgroup *mem)
 {
 	if (mem_cgroup_disabled())
@@ -2229,6 +2339,15 @@ __do_uncharge(struct mem_cgroup *mem, const enum charge_type ctype)
 		batch->memsw_bytes += PAGE_SIZE;
 	return;
 direct_uncharge:
+	/*
+	 * Stocked charges are of both res and memsw, so a swapout's
+	 * uncharge cannot go there.  Nor should a charge be held back
+	 * from a group under OOM.
+	 */
+	if ((uncharge_memsw || !do_swap_account) &&
+	    !test_thread_flag(TIF_MEMDIE) && !atomic_read(&mem->oom_lock) &&
+	    uncharge_to_stock(mem))
+		return;
 	res_counter_uncharge(&mem->res, PAGE_SIZE);
 	if (uncharge_memsw)
 		res_counter_uncharge(&mem->memsw, PAGE_SIZE);
@@ -3286,6 +3405,8 @@ enum {
 	MCS_PGPGIN,
 	MCS_PGPGOUT,
 	MCS_SWAP,
+	MCS_PSWPIN,
+	MCS_PSWPOUT,
 	MCS_INACTIVE_ANON,
 	MCS_ACTIVE_ANON,
 	MCS_INACTIVE_FILE,
@@ -3308,6 +3429,8 @@ struct {
 	{"pgpgin", "total_pgpgin"},
 	{"pgpgout", "total_pgpgout"},
 	{"swap", "total_swap"},
+	{"pswpin", "total_pswpin"},
+	{"pswpout", "total_pswpout"},
 	{"inactive_anon", "total_inactive_anon"},
 	{"active_anon", "total_active_anon"},
 	{"inactive_file", "total_inactive_file"},
@@ -3336,6 +3459,10 @@ static int mem_cgroup_get_local_stat(struct mem_cgroup *mem, void *data)
 		val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_SWAPOUT);
 		s->stat[MCS_SWAP] += val * PAGE_SIZE;
 	}
+	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_PSWPIN_COUNT);
+	s->stat[MCS_PSWPIN] += val;
+	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_PSWPOUT_COUNT);
+	s->stat[MCS_PSWPOUT] += val;
 
 	/* per zone stat */
 	val = mem_cgroup_get_local_zonestat(mem, LRU_INACTIVE_ANON);
@@ -3422,6 +3549,27 @@ static int mem_control_stat_show(struct cgroup *cont, struct cftype *cft,
 	return 0;
 }
 
+static s64 mem_cgroup_soft_limit_priority_read(struct cgroup *cgrp,
+					       struct cftype *cft)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+
+	return memcg->soft_limit_priority;
+}
+
+static int mem_cgroup_soft_limit_priority_write(struct cgroup *cgrp,
+						struct cftype *cft, s64 val)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+
+	if (val < OOM_ADJUST_MIN || val > OOM_ADJUST_MAX)
+		return -EINVAL;
+
+	memcg->soft_limit_priority = val;
+	mem_cgroup_resort_trees(memcg);
+	return 0;
+}
+
 static u64 mem_cgroup_swappiness_read(struct cgroup *cgrp, struct cftype *cft)
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
@@ -3787,6 +3935,39 @@ static int mem_cgroup_oom_control_write(struct cgroup *cgrp,
 	return 0;
 }
 
+static int mem_cgroup_pressure_register_event(struct cgroup *cgrp,
+	struct cftype *cft, struct eventfd_ctx *eventfd, const char *args)
+{
+	return vmpressure_register_event(mem_cgroup_from_cont(cgrp),
+					eventfd, args);
+}
+
+static void mem_cgroup_pressure_unregister_event(struct cgroup *cgrp,
+	struct cftype *cft, struct eventfd_ctx *eventfd)
+{
+	vmpressure_unregister_event(mem_cgroup_from_cont(cgrp), eventfd);
+}
+
+/*
+ * The root cgroup reports global pressure, which vmpressure keeps for
+ * itself since it is needed without memory cgroups too.
+ */
+struct vmpressure *memcg_to_vmpressure(struct mem_cgroup *mem)
+{
+	if (!mem || mem_cgroup_is_root(mem))
+		return NULL;
+	return &mem->vmpressure;
+}
+
+/* NULL unless the cgroup of @vmpr is in a use_hierarchy tree */
+struct mem_cgroup *vmpressure_parent_memcg(struct vmpressure *vmpr)
+{
+	struct mem_cgroup *mem;
+
+	mem = container_of(vmpr, struct mem_cgroup, vmpressure);
+	return parent_mem_cgroup(mem);
+}
+
 static struct cftype mem_cgroup_files[] = {
 	{
 		.name = "usage_in_bytes",
@@ -3813,6 +3994,11 @@ static struct cftype mem_cgroup_files[] = {
 		.write_string = mem_cgroup_write,
 		.read_u64 = mem_cgroup_read,
 	},
+	{
+		.name = "soft_limit_priority",
+		.read_s64 = mem_cgroup_soft_limit_priority_read,
+		.write_s64 = mem_cgroup_soft_limit_priority_write,
+	},
 	{
 		.name = "failcnt",
 		.private = MEMFILE_PRIVATE(_MEM, RES_FAILCNT),
@@ -3850,6 +4036,11 @@ static struct cftype mem_cgroup_files[] = {
 		.unregister_event = mem_cgroup_oom_unregister_event,
 		.private = MEMFILE_PRIVATE(_OOM_TYPE, OOM_CONTROL),
 	},
+	{
+		.name = "pressure_level",
+		.register_event = mem_cgroup_pressure_register_event,
+		.unregister_event = mem_cgroup_pressure_unregister_event,
+	},
 };
 
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR_SWAP
@@ -3949,6 +4140,7 @@ static struct mem_cgroup *mem_cgroup_alloc(void)
 		return NULL;
 
 	memset(mem, 0, size);
+	vmpressure_init(&mem->vmpressure);
 	mem->stat = alloc_percpu(struct mem_cgroup_stat_cpu);
 	if (!mem->stat) {
 		if (size < PAGE_SIZE)
@@ -3977,6 +4169,7 @@ static void __mem_cgroup_free(struct mem_cgroup *mem)
 
 	mem_cgroup_remove_from_trees(mem);
 	free_css_id(&mem_cgroup_subsys, &mem->css);
+	vmpressure_cleanup(&mem->vmpressure);
 
 	for_each_node_state(node, N_POSSIBLE)
 		free_mem_cgroup_per_zone_info(mem, node);
@@ -4108,8 +4301,10 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 	spin_lock_init(&mem->reclaim_param_lock);
 	INIT_LIST_HEAD(&mem->oom_notify);
 
-	if (parent)
+	if (parent) {
 		mem->swappiness = get_swappiness(parent);
+		mem->soft_limit_priority = parent->soft_limit_priority;
+	}
 	atomic_set(&mem->refcnt, 1);
 	mem->move_charge_at_immigrate = 0;
 	mutex_init(&mem->thresholds_lock);
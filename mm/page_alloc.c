@@ -1945,6 +1945,17 @@ void wake_all_kswapd(unsigned int order, struct zonelist *zonelist,
 		wakeup_kswapd(zone, order);
 }
 
+static inline
+void wake_all_kcompactd(unsigned int order, struct zonelist *zonelist,
+						enum zone_type high_zoneidx)
+{
+	struct zoneref *z;
+	struct zone *zone;
+
+	for_each_zone_zonelist(zone, z, zonelist, high_zoneidx)
+		wakeup_kcompactd(zone, order);
+}
+
 static inline int
 gfp_to_alloc_flags(gfp_t gfp_mask)
 {
@@ -2021,6 +2032,13 @@ __alloc_pages_slowpath(gfp_t gfp_mask, unsigned int order,
 restart:
 	wake_all_kswapd(order, zonelist, high_zoneidx);
 
+	/*
+	 * A costly allocation missed the fast path: have kcompactd prepare
+	 * free blocks of this order for the allocations that follow.
+	 */
+	if (order > PAGE_ALLOC_COSTLY_ORDER)
+		wake_all_kcompactd(order, zonelist, high_zoneidx);
+
 	/*
 	 * OK, we're below the kswapd watermark and have kicked background
 	 * reclaim. Now things get more complex, so set up alloc_flags according
@@ -4090,6 +4108,10 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat->nr_zones = 0;
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	pgdat->kswapd_max_order = 0;
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+	pgdat->kcompactd_max_order = 0;
+#endif
 	pgdat_page_cgroup_init(pgdat);
 	
 	for (j = 0; j < MAX_NR_ZONES; j++) {
@@ -28,6 +28,7 @@
 #include <linux/memory.h>
 #include <linux/math64.h>
 #include <linux/fault-inject.h>
+#include <linux/uaccess.h>
 
 /*
  * Lock order:
@@ -71,11 +72,19 @@
  *   interrupts are disabled to ensure that the processor does not change
  *   while handling per_cpu slabs, due to kernel preemption.
  *
+ *   With CONFIG_HAVE_CMPXCHG_DOUBLE the fastpaths only disable preemption
+ *   and replace the cpu freelist together with a transaction id using
+ *   cmpxchg_double_local(). Everything that changes the cpu freelist with
+ *   interrupts disabled also bumps the transaction id, so an interrupt
+ *   that ran in between makes the cmpxchg fail and the fastpath retries.
+ *
  * SLUB assigns one slab for allocation to each processor.
  * Allocations only occur from these slabs called cpu slabs.
  *
  * Slabs with free elements are kept on a partial list and during regular
- * operations no list for full slabs is used. If an object in a full slab is
+ * operations no list for full slabs is used. Each processor also keeps a
+ * few frozen slabs with free objects on a cpu partial list, so that the
+ * cpu slab can be replaced without taking the per node list_lock. If an object in a full slab is
  * freed then the slab will show up again on the partial lists.
  * We track full slabs for debugging purposes though because otherwise we
  * cannot scan all objects.
@@ -263,6 +272,28 @@ static inline void set_freepointer(struct kmem_cache *s, void *object, void *fp)
 	*(void **)(object + s->offset) = fp;
 }
 
+/*
+ * The lockless fastpath reads the free pointer of an object that an
+ * interrupt may have allocated and freed (with its slab) in the meantime.
+ * The cmpxchg catches that, but the read itself must not fault.
+ */
+static inline void *get_freepointer_safe(struct kmem_cache *s, void *object)
+{
+	void *p;
+
+#ifdef CONFIG_DEBUG_PAGEALLOC
+	probe_kernel_read(&p, (void **)(object + s->offset), sizeof(p));
+#else
+	p = get_freepointer(s, object);
+#endif
+	return p;
+}
+
+static inline unsigned long next_tid(unsigned long tid)
+{
+	return tid + 1;
+}
+
 /* Loop over all objects in a slab */
 #define for_each_object(__p, __s, __addr, __objects) \
 	for (__p = (__addr); __p < (__addr) + (__objects) * (__s)->size;\
@@ -1302,10 +1333,16 @@ static inline int lock_and_freeze_slab(struct kmem_cache_node *n,
 
 /*
  * Try to allocate a partial slab from a specific node.
+ *
+ * While holding the list_lock also move further slabs onto the cpu
+ * partial list until it is half full, so that the next few cpu slab
+ * refills do not have to come back here.
  */
-static struct page *get_partial_node(struct kmem_cache_node *n)
+static struct page *get_partial_node(struct kmem_cache *s,
+		struct kmem_cache_node *n, struct kmem_cache_cpu *c)
 {
-	struct page *page;
+	struct page *page, *page2;
+	struct page *new = NULL;
 
 	/*
 	 * Racy check. If we mistakenly see no partial slabs then we
@@ -1317,19 +1354,29 @@ static struct page *get_partial_node(struct kmem_cache_node *n)
 		return NULL;
 
 	spin_lock(&n->list_lock);
-	list_for_each_entry(page, &n->partial, lru)
-		if (lock_and_freeze_slab(n, page))
-			goto out;
-	page = NULL;
-out:
+	list_for_each_entry_safe(page, page2, &n->partial, lru) {
+		if (!lock_and_freeze_slab(n, page))
+			continue;
+
+		if (!new)
+			new = page;
+		else {
+			slab_unlock(page);
+			list_add_tail(&page->lru, &c->partial);
+			c->nr_partial++;
+		}
+		if (2 * c->nr_partial >= s->cpu_partial)
+			break;
+	}
 	spin_unlock(&n->list_lock);
-	return page;
+	return new;
 }
 
 /*
  * Get a page from somewhere. Search in increasing NUMA distances.
  */
-static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags)
+static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags,
+		struct kmem_cache_cpu *c)
 {
 #ifdef CONFIG_NUMA
 	struct zonelist *zonelist;
@@ -1369,7 +1416,7 @@ static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags)
 
 		if (n && cpuset_zone_allowed_hardwall(zone, flags) &&
 				n->nr_partial > s->min_partial) {
-			page = get_partial_node(n);
+			page = get_partial_node(s, n, c);
 			if (page) {
 				put_mems_allowed();
 				return page;
@@ -1384,16 +1431,17 @@ static struct page *get_any_partial(struct kmem_cache *s, gfp_t flags)
 /*
  * Get a partial page, lock it and return it.
  */
-static struct page *get_partial(struct kmem_cache *s, gfp_t flags, int node)
+static struct page *get_partial(struct kmem_cache *s, gfp_t flags, int node,
+		struct kmem_cache_cpu *c)
 {
 	struct page *page;
 	int searchnode = (node == -1) ? numa_node_id() : node;
 
-	page = get_partial_node(get_node(s, searchnode));
+	page = get_partial_node(s, get_node(s, searchnode), c);
 	if (page || (flags & __GFP_THISNODE))
 		return page;
 
-	return get_any_partial(s, flags);
+	return get_any_partial(s, flags, c);
 }
 
 /*
@@ -1473,9 +1521,28 @@ static void deactivate_slab(struct kmem_cache *s, struct kmem_cache_cpu *c)
 		page->inuse--;
 	}
 	c->page = NULL;
+	c->tid = next_tid(c->tid);
 	unfreeze_slab(s, page, tail);
 }
 
+/*
+ * Return the slabs on the cpu partial list to the node partial lists
+ * (or the page allocator if they are empty by now).
+ *
+ * Interrupts are disabled.
+ */
+static void unfreeze_partials(struct kmem_cache *s, struct kmem_cache_cpu *c)
+{
+	struct page *page, *page2;
+
+	list_for_each_entry_safe(page, page2, &c->partial, lru) {
+		list_del(&page->lru);
+		slab_lock(page);
+		unfreeze_slab(s, page, 1);
+	}
+	c->nr_partial = 0;
+}
+
 static inline void flush_slab(struct kmem_cache *s, struct kmem_cache_cpu *c)
 {
 	stat(s, CPUSLAB_FLUSH);
@@ -1492,8 +1559,11 @@ static inline void __flush_cpu_slab(struct kmem_cache *s, int cpu)
 {
 	struct kmem_cache_cpu *c = per_cpu_ptr(s->cpu_slab, cpu);
 
-	if (likely(c && c->page))
-		flush_slab(s, c);
+	if (likely(c)) {
+		if (c->page)
+			flush_slab(s, c);
+		unfreeze_partials(s, c);
+	}
 }
 
 static void flush_cpu_slab(void *d)
@@ -1588,13 +1658,16 @@ slab_out_of_memory(struct kmem_cache *s, gfp_t gfpflags, int nid)
  * Slow path. The lockless freelist is empty or we need to perform
  * debugging duties.
  *
- * Interrupts are disabled.
+ * Interrupts are disabled. With the cmpxchg_double fastpath the caller
+ * only had preemption disabled, so interrupts are disabled here and the
+ * cpu structure is looked up again.
  *
  * Processing is still very fast if new objects have been freed to the
  * regular freelist. In that case we simply take over the regular freelist
  * as the lockless freelist and zap the regular freelist.
  *
- * If that is not working then we fall back to the partial lists. We take the
+ * If that is not working then we take a slab from the cpu partial list, and
+ * then fall back to the node partial lists. We take the
  * first element of the freelist as the object to allocate now and move the
  * rest of the freelist to the lockless freelist.
  *
@@ -1607,6 +1680,27 @@ static void *__slab_alloc(struct kmem_cache *s, gfp_t gfpflags, int node,
 {
 	void **object;
 	struct page *new;
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	unsigned long flags;
+
+	local_irq_save(flags);
+	c = __this_cpu_ptr(s->cpu_slab);
+
+	/*
+	 * The fastpath saw an empty freelist with only preemption disabled.
+	 * Since then we may have moved to another cpu, or an interrupt may
+	 * have freed to this one: take what is there rather than overwrite
+	 * it below and leak those objects.
+	 */
+	object = c->freelist;
+	if (unlikely(object) && node_match(c, node)) {
+		c->freelist = get_freepointer(s, object);
+		c->tid = next_tid(c->tid);
+		stat(s, ALLOC_SLOWPATH);
+		local_irq_restore(flags);
+		return object;
+	}
+#endif
 
 	/* We handle __GFP_ZERO in the caller */
 	gfpflags &= ~__GFP_ZERO;
@@ -1628,19 +1722,35 @@ load_freelist:
 		goto debug;
 
 	c->freelist = get_freepointer(s, object);
+	c->tid = next_tid(c->tid);
 	c->page->inuse = c->page->objects;
 	c->page->freelist = NULL;
 	c->node = page_to_nid(c->page);
 unlock_out:
 	slab_unlock(c->page);
 	stat(s, ALLOC_SLOWPATH);
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	local_irq_restore(flags);
+#endif
 	return object;
 
 another_slab:
 	deactivate_slab(s, c);
 
 new_slab:
-	new = get_partial(s, gfpflags, node);
+	if (!list_empty(&c->partial)) {
+		new = list_first_entry(&c->partial, struct page, lru);
+		if (node == -1 || page_to_nid(new) == node) {
+			list_del(&new->lru);
+			c->nr_partial--;
+			slab_lock(new);
+			c->page = new;
+			stat(s, CPU_PARTIAL_ALLOC);
+			goto load_freelist;
+		}
+	}
+
+	new = get_partial(s, gfpflags, node, c);
 	if (new) {
 		c->page = new;
 		stat(s, ALLOC_FROM_PARTIAL);
@@ -1667,6 +1777,9 @@ new_slab:
 	}
 	if (!(gfpflags & __GFP_NOWARN) && printk_ratelimit())
 		slab_out_of_memory(s, gfpflags, node);
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	local_irq_restore(flags);
+#endif
 	return NULL;
 debug:
 	if (!alloc_debug_processing(s, c->page, object, addr))
@@ -1674,6 +1787,7 @@ debug:
 
 	c->page->inuse++;
 	c->page->freelist = get_freepointer(s, object);
+	c->tid = next_tid(c->tid);
 	c->node = -1;
 	goto unlock_out;
 }
@@ -1693,7 +1807,11 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 {
 	void **object;
 	struct kmem_cache_cpu *c;
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	unsigned long tid;
+#else
 	unsigned long flags;
+#endif
 
 	gfpflags &= gfp_allowed_mask;
 
@@ -1703,6 +1821,35 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 	if (should_failslab(s->objsize, gfpflags, s->flags))
 		return NULL;
 
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+redo:
+	/*
+	 * Disabling preemption keeps us on this cpu, so only an interrupt
+	 * can change the cpu slab under us. The tid must be read before
+	 * the freelist: an interrupt in between bumps the tid and the
+	 * cmpxchg fails.
+	 */
+	preempt_disable();
+	c = __this_cpu_ptr(s->cpu_slab);
+	tid = c->tid;
+	barrier();
+	object = c->freelist;
+	if (unlikely(!object || !node_match(c, node))) {
+		preempt_enable();
+		object = __slab_alloc(s, gfpflags, node, addr, c);
+	} else {
+		if (unlikely(!cmpxchg_double_local(&c->freelist, &c->tid,
+				object, tid,
+				get_freepointer_safe(s, object),
+				next_tid(tid)))) {
+			stat(s, CMPXCHG_DOUBLE_CPU_FAIL);
+			preempt_enable();
+			goto redo;
+		}
+		stat(s, ALLOC_FASTPATH);
+		preempt_enable();
+	}
+#else
 	local_irq_save(flags);
 	c = __this_cpu_ptr(s->cpu_slab);
 	object = c->freelist;
@@ -1715,6 +1862,7 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 		stat(s, ALLOC_FASTPATH);
 	}
 	local_irq_restore(flags);
+#endif
 
 	if (unlikely(gfpflags & __GFP_ZERO) && object)
 		memset(object, 0, s->objsize);
@@ -1773,13 +1921,21 @@ EXPORT_SYMBOL(kmem_cache_alloc_node_notrace);
  * So we still attempt to reduce cache line usage. Just take the slab
  * lock and free the item. If there is no additional partial page
  * handling required then we can return immediately.
+ *
+ * A slab that was full is put onto the cpu partial list if there is room,
+ * which avoids the node list_lock here and on the next cpu slab refill.
  */
 static void __slab_free(struct kmem_cache *s, struct page *page,
 			void *x, unsigned long addr)
 {
 	void *prior;
 	void **object = (void *)x;
+	struct kmem_cache_cpu *c;
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	unsigned long flags;
 
+	local_irq_save(flags);
+#endif
 	stat(s, FREE_SLOWPATH);
 	slab_lock(page);
 
@@ -1805,12 +1961,24 @@ checks_ok:
 	 * then add it.
 	 */
 	if (unlikely(!prior)) {
-		add_partial(get_node(s, page_to_nid(page)), page, 1);
-		stat(s, FREE_ADD_PARTIAL);
+		c = __this_cpu_ptr(s->cpu_slab);
+		if (c->nr_partial < s->cpu_partial &&
+				!(SLABDEBUG && PageSlubDebug(page))) {
+			__SetPageSlubFrozen(page);
+			list_add(&page->lru, &c->partial);
+			c->nr_partial++;
+			stat(s, CPU_PARTIAL_FREE);
+		} else {
+			add_partial(get_node(s, page_to_nid(page)), page, 1);
+			stat(s, FREE_ADD_PARTIAL);
+		}
 	}
 
 out_unlock:
 	slab_unlock(page);
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	local_irq_restore(flags);
+#endif
 	return;
 
 slab_empty:
@@ -1824,6 +1992,9 @@ slab_empty:
 	slab_unlock(page);
 	stat(s, FREE_SLAB);
 	discard_slab(s, page);
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	local_irq_restore(flags);
+#endif
 	return;
 
 debug:
@@ -1848,9 +2019,40 @@ static __always_inline void slab_free(struct kmem_cache *s,
 {
 	void **object = (void *)x;
 	struct kmem_cache_cpu *c;
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	void **prior;
+	unsigned long tid;
+#else
 	unsigned long flags;
+#endif
 
 	kmemleak_free_recursive(x, s->flags);
+#ifdef CONFIG_HAVE_CMPXCHG_DOUBLE
+	kmemcheck_slab_free(s, object, s->objsize);
+	debug_check_no_locks_freed(object, s->objsize);
+	if (!(s->flags & SLAB_DEBUG_OBJECTS))
+		debug_check_no_obj_freed(object, s->objsize);
+redo:
+	preempt_disable();
+	c = __this_cpu_ptr(s->cpu_slab);
+	tid = c->tid;
+	barrier();
+	if (likely(page == c->page && c->node >= 0)) {
+		prior = c->freelist;
+		set_freepointer(s, object, prior);
+		if (unlikely(!cmpxchg_double_local(&c->freelist, &c->tid,
+				prior, tid, object, next_tid(tid)))) {
+			stat(s, CMPXCHG_DOUBLE_CPU_FAIL);
+			preempt_enable();
+			goto redo;
+		}
+		stat(s, FREE_FASTPATH);
+		preempt_enable();
+	} else {
+		preempt_enable();
+		__slab_free(s, page, x, addr);
+	}
+#else
 	local_irq_save(flags);
 	c = __this_cpu_ptr(s->cpu_slab);
 	kmemcheck_slab_free(s, object, s->objsize);
@@ -1865,6 +2067,7 @@ static __always_inline void slab_free(struct kmem_cache *s,
 		__slab_free(s, page, x, addr);
 
 	local_irq_restore(flags);
+#endif
 }
 
 void kmem_cache_free(struct kmem_cache *s, void *x)
@@ -2066,6 +2269,8 @@ static DEFINE_PER_CPU(struct kmem_cache_cpu, kmalloc_percpu[KMALLOC_CACHES]);
 
 static inline int alloc_kmem_cache_cpus(struct kmem_cache *s, gfp_t flags)
 {
+	int cpu;
+
 	if (s < kmalloc_caches + KMALLOC_CACHES && s >= kmalloc_caches)
 		/*
 		 * Boot time creation of the kmalloc array. Use static per cpu data
@@ -2078,6 +2283,9 @@ static inline int alloc_kmem_cache_cpus(struct kmem_cache *s, gfp_t flags)
 	if (!s->cpu_slab)
 		return 0;
 
+	for_each_possible_cpu(cpu)
+		INIT_LIST_HEAD(&per_cpu_ptr(s->cpu_slab, cpu)->partial);
+
 	return 1;
 }
 
@@ -2188,6 +2396,25 @@ static void set_min_partial(struct kmem_cache *s, unsigned long min)
 	s->min_partial = min;
 }
 
+/*
+ * Number of slabs each cpu may keep frozen on its partial list. Large
+ * objects come few to a slab, but each slab also pins more memory, so
+ * keep fewer of them. Debugging needs every slab on the node lists.
+ */
+static void set_cpu_partial(struct kmem_cache *s)
+{
+	if (SLABDEBUG && (s->flags & (DEBUG_DEFAULT_FLAGS | SLAB_TRACE)))
+		s->cpu_partial = 0;
+	else if (s->size >= PAGE_SIZE)
+		s->cpu_partial = 2;
+	else if (s->size >= 1024)
+		s->cpu_partial = 4;
+	else if (s->size >= 256)
+		s->cpu_partial = 8;
+	else
+		s->cpu_partial = 16;
+}
+
 /*
  * calculate_sizes() determines the order and the distribution of data within
  * a slab object.
@@ -2344,6 +2571,7 @@ static int kmem_cache_open(struct kmem_cache *s, gfp_t gfpflags,
 	 * list to avoid pounding the page allocator excessively.
 	 */
 	set_min_partial(s, ilog2(s->size));
+	set_cpu_partial(s);
 	s->refcount = 1;
 #ifdef CONFIG_NUMA
 	s->remote_node_defrag_ratio = 1000;
@@ -3940,6 +4168,29 @@ static ssize_t min_partial_store(struct kmem_cache *s, const char *buf,
 }
 SLAB_ATTR(min_partial);
 
+static ssize_t cpu_partial_show(struct kmem_cache *s, char *buf)
+{
+	return sprintf(buf, "%d\n", s->cpu_partial);
+}
+
+static ssize_t cpu_partial_store(struct kmem_cache *s, const char *buf,
+				 size_t length)
+{
+	unsigned long slabs;
+	int err;
+
+	err = strict_strtoul(buf, 10, &slabs);
+	if (err)
+		return err;
+	if (slabs > MAX_OBJS_PER_PAGE)
+		return -EINVAL;
+
+	s->cpu_partial = slabs;
+	flush_all(s);
+	return length;
+}
+SLAB_ATTR(cpu_partial);
+
 static ssize_t ctor_show(struct kmem_cache *s, char *buf)
 {
 	if (s->ctor) {
@@ -3975,6 +4226,29 @@ static ssize_t cpu_slabs_show(struct kmem_cache *s, char *buf)
 }
 SLAB_ATTR_RO(cpu_slabs);
 
+static ssize_t slabs_cpu_partial_show(struct kmem_cache *s, char *buf)
+{
+	unsigned long sum = 0;
+	int cpu;
+	int len;
+
+	for_each_online_cpu(cpu)
+		sum += per_cpu_ptr(s->cpu_slab, cpu)->nr_partial;
+
+	len = sprintf(buf, "%lu", sum);
+
+#ifdef CONFIG_SMP
+	for_each_online_cpu(cpu) {
+		int nr = per_cpu_ptr(s->cpu_slab, cpu)->nr_partial;
+
+		if (nr && len < PAGE_SIZE - 20)
+			len += sprintf(buf + len, " C%d=%d", cpu, nr);
+	}
+#endif
+	return len + sprintf(buf + len, "\n");
+}
+SLAB_ATTR_RO(slabs_cpu_partial);
+
 static ssize_t objects_show(struct kmem_cache *s, char *buf)
 {
 	return show_slab_objects(s, buf, SO_ALL|SO_OBJECTS);
@@ -4281,6 +4555,9 @@ STAT_ATTR(DEACTIVATE_TO_HEAD, deactivate_to_head);
 STAT_ATTR(DEACTIVATE_TO_TAIL, deactivate_to_tail);
 STAT_ATTR(DEACTIVATE_REMOTE_FREES, deactivate_remote_frees);
 STAT_ATTR(ORDER_FALLBACK, order_fallback);
+STAT_ATTR(CMPXCHG_DOUBLE_CPU_FAIL, cmpxchg_double_cpu_fail);
+STAT_ATTR(CPU_PARTIAL_ALLOC, cpu_partial_alloc);
+STAT_ATTR(CPU_PARTIAL_FREE, cpu_partial_free);
 #endif
 
 static struct attribute *slab_attrs[] = {
@@ -4289,12 +4566,14 @@ static struct attribute *slab_attrs[] = {
 	&objs_per_slab_attr.attr,
 	&order_attr.attr,
 	&min_partial_attr.attr,
+	&cpu_partial_attr.attr,
 	&objects_attr.attr,
 	&objects_partial_attr.attr,
 	&total_objects_attr.attr,
 	&slabs_attr.attr,
 	&partial_attr.attr,
 	&cpu_slabs_attr.attr,
+	&slabs_cpu_partial_attr.attr,
 	&ctor_attr.attr,
 	&aliases_attr.attr,
 	&align_attr.attr,
@@ -4335,6 +4614,9 @@ static struct attribute *slab_attrs[] = {
 	&deactivate_to_tail_attr.attr,
 	&deactivate_remote_frees_attr.attr,
 	&order_fallback_attr.attr,
+	&cmpxchg_double_cpu_fail_attr.attr,
+	&cpu_partial_alloc_attr.attr,
+	&cpu_partial_free_attr.attr,
 #endif
 #ifdef CONFIG_FAILSLAB
 	&failslab_attr.attr,
@@ -19,6 +19,8 @@
 #include <linux/pagevec.h>
 #include <linux/migrate.h>
 #include <linux/page_cgroup.h>
+#include <linux/log2.h>
+#include <linux/kobject.h>
 
 #include <asm/pgtable.h>
 
@@ -57,6 +59,48 @@ static struct {
 	unsigned long find_total;
 } swap_cache_info;
 
+/*
+ * vma->swap_readahead_info packs the address of the last swap fault in
+ * the vma with the readahead window used for it and the number of
+ * readahead hits since: the page offset bits hold the window and hits.
+ */
+#define SWAP_RA_WIN_SHIFT	(PAGE_SHIFT / 2)
+#define SWAP_RA_HITS_MASK	((1UL << SWAP_RA_WIN_SHIFT) - 1)
+#define SWAP_RA_HITS_MAX	SWAP_RA_HITS_MASK
+#define SWAP_RA_WIN_MASK	(~PAGE_MASK & ~SWAP_RA_HITS_MASK)
+
+#define SWAP_RA_HITS(v)		((v) & SWAP_RA_HITS_MASK)
+#define SWAP_RA_WIN(v)		(((v) & SWAP_RA_WIN_MASK) >> SWAP_RA_WIN_SHIFT)
+#define SWAP_RA_ADDR(v)		((v) & PAGE_MASK)
+
+#define SWAP_RA_VAL(addr, win, hits)				\
+	(((addr) & PAGE_MASK) |					\
+	 (((win) << SWAP_RA_WIN_SHIFT) & SWAP_RA_WIN_MASK) |	\
+	 ((hits) & SWAP_RA_HITS_MASK))
+
+/* Largest VMA readahead window, as an order; ptes are copied on stack */
+#define SWAP_RA_ORDER_CEILING	3
+
+/*
+ * With VMA readahead, a swap fault reads ahead the swapped out pages next
+ * to the faulting address, instead of the neighbouring swap slots, which
+ * may belong to any process.
+ */
+static bool swap_vma_readahead_enabled __read_mostly = true;
+
+bool swap_use_vma_readahead(void)
+{
+	return swap_vma_readahead_enabled;
+}
+
+static void count_swap_ra_event(bool hit)
+{
+	if (swap_use_vma_readahead())
+		count_vm_event(hit ? SWAP_RA_VMA_HIT : SWAP_RA_VMA);
+	else
+		count_vm_event(hit ? SWAP_RA_CLUSTER_HIT : SWAP_RA_CLUSTER);
+}
+
 void show_swap_cache_info(void)
 {
 	printk("%lu pages in swap cache\n", total_swapcache_pages);
@@ -256,16 +300,37 @@ void free_pages_and_swap_cache(struct page **pages, int nr)
  * unlocked and with its refcount incremented - we rely on the kernel
  * lock getting page table operations atomic even if we drop the page
  * lock before returning.
+ *
+ * A page that was read ahead counts as a readahead hit, for the vma the
+ * fault is in if there is one.
  */
-struct page * lookup_swap_cache(swp_entry_t entry)
+struct page *lookup_swap_cache(swp_entry_t entry,
+			struct vm_area_struct *vma, unsigned long addr)
 {
 	struct page *page;
+	unsigned long ra_val;
+	unsigned int win, hits;
 
 	page = find_get_page(&swapper_space, entry.val);
 
-	if (page)
+	if (page) {
 		INC_CACHE_INFO(find_success);
 
+		if (TestClearPageReadahead(page)) {
+			count_swap_ra_event(true);
+			if (vma) {
+				ra_val = atomic_long_read(
+						&vma->swap_readahead_info);
+				win = SWAP_RA_WIN(ra_val);
+				hits = SWAP_RA_HITS(ra_val);
+				if (hits < SWAP_RA_HITS_MAX)
+					hits++;
+				atomic_long_set(&vma->swap_readahead_info,
+						SWAP_RA_VAL(addr, win, hits));
+			}
+		}
+	}
+
 	INC_CACHE_INFO(find_total);
 	return page;
 }
@@ -275,9 +340,13 @@ struct page * lookup_swap_cache(swp_entry_t entry)
  * and reading the disk if it is not already cached.
  * A failure return means that either the page allocation failed or that
  * the swap entry is no longer in use.
+ *
+ * Pages read on behalf of readahead are marked PG_readahead, so that
+ * lookup_swap_cache() can tell when they are used.
  */
-struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
-			struct vm_area_struct *vma, unsigned long addr)
+static struct page *__read_swap_cache_async(swp_entry_t entry,
+			gfp_t gfp_mask, struct vm_area_struct *vma,
+			unsigned long addr, bool readahead)
 {
 	struct page *found_page, *new_page = NULL;
 	int err;
@@ -330,6 +399,10 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 			/*
 			 * Initiate read into locked page and return.
 			 */
+			if (readahead) {
+				SetPageReadahead(new_page);
+				count_swap_ra_event(false);
+			}
 			lru_cache_add_anon(new_page);
 			swap_readpage(new_page);
 			return new_page;
@@ -349,6 +422,12 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 	return found_page;
 }
 
+struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	return __read_swap_cache_async(entry, gfp_mask, vma, addr, false);
+}
+
 /**
  * swapin_readahead - swap in pages in hope we need them soon
  * @entry: swap entry of this memory
@@ -386,8 +465,10 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	nr_pages = valid_swaphandles(entry, &offset);
 	for (end_offset = offset + nr_pages; offset < end_offset; offset++) {
 		/* Ok, do the async read-ahead now */
-		page = read_swap_cache_async(swp_entry(swp_type(entry), offset),
-						gfp_mask, vma, addr);
+		page = __read_swap_cache_async(
+				swp_entry(swp_type(entry), offset),
+				gfp_mask, vma, addr,
+				offset != swp_offset(entry));
 		if (!page)
 			break;
 		page_cache_release(page);
@@ -395,3 +476,172 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	lru_add_drain();	/* Push any new pages onto the LRU now */
 	return read_swap_cache_async(entry, gfp_mask, vma, addr);
 }
+
+/*
+ * Size the readahead window for a fault at page 'fpfn' of a vma, given
+ * the previous fault at 'ppfn' and the readahead hits since: grow it while
+ * readahead pages are used, let it decay by half per fault otherwise.
+ */
+static unsigned int swap_ra_window(unsigned long fpfn, unsigned long ppfn,
+			unsigned int hits, unsigned int max_win,
+			unsigned int prev_win)
+{
+	unsigned int win;
+
+	win = hits + 2;
+	if (win == 2) {
+		/* No hits: only read ahead of sequential faults */
+		if (fpfn != ppfn + 1 && fpfn != ppfn - 1)
+			win = 1;
+	} else {
+		win = roundup_pow_of_two(win);
+	}
+
+	if (win > max_win)
+		win = max_win;
+
+	/* Don't shrink the window too fast */
+	if (win < prev_win / 2)
+		win = prev_win / 2;
+
+	return win;
+}
+
+/**
+ * swap_vma_readahead - swap in pages in hope we need them soon
+ * @fentry: swap entry of the faulting page
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma the faulting address belongs to
+ * @faddr: faulting address
+ * @pmd: pmd mapping @faddr
+ *
+ * Returns the struct page for @fentry, after queueing swapin.
+ *
+ * Reads ahead the swapped out pages mapped next to @faddr: after it for a
+ * fault following the previous one in the vma, before it for one just
+ * below it, else around it. The window (up to 1 << page_cluster pages)
+ * adapts to how many readahead pages of the vma get used.
+ *
+ * Caller must hold down_read on the vma->vm_mm.
+ */
+struct page *swap_vma_readahead(swp_entry_t fentry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long faddr,
+			pmd_t *pmd)
+{
+	pte_t ptes[1 << SWAP_RA_ORDER_CEILING], *pte;
+	unsigned long ra_val, fpfn, ppfn, start, end, lpfn, rpfn;
+	unsigned int max_win, hits, prev_win, win, left, i;
+	swp_entry_t entry;
+	struct page *page;
+
+	max_win = 1 << min_t(unsigned int, page_cluster,
+				SWAP_RA_ORDER_CEILING);
+	if (max_win == 1)
+		goto skip;
+
+	fpfn = faddr >> PAGE_SHIFT;
+	ra_val = atomic_long_read(&vma->swap_readahead_info);
+	ppfn = SWAP_RA_ADDR(ra_val) >> PAGE_SHIFT;
+	prev_win = SWAP_RA_WIN(ra_val);
+	hits = SWAP_RA_HITS(ra_val);
+	win = swap_ra_window(fpfn, ppfn, hits, max_win, prev_win);
+	atomic_long_set(&vma->swap_readahead_info,
+			SWAP_RA_VAL(faddr, win, 0));
+	if (win == 1)
+		goto skip;
+
+	if (fpfn == ppfn + 1) {
+		start = fpfn;
+	} else if (fpfn == ppfn - 1) {
+		start = fpfn + 1 - min_t(unsigned long, win, fpfn + 1);
+	} else {
+		left = (win - 1) / 2;
+		start = fpfn - min_t(unsigned long, left, fpfn);
+	}
+	end = start + win;
+
+	/* Stay within the vma and the page table of the faulting pte */
+	lpfn = max(vma->vm_start >> PAGE_SHIFT,
+		   fpfn & ~((unsigned long)PTRS_PER_PTE - 1));
+	rpfn = min(vma->vm_end >> PAGE_SHIFT,
+		   (fpfn & ~((unsigned long)PTRS_PER_PTE - 1)) + PTRS_PER_PTE);
+	start = max(start, lpfn);
+	end = min(end, rpfn);
+
+	/*
+	 * Copy the ptes rather than hold the pte lock while reading: an
+	 * entry that changes under us fails in swapcache_prepare().
+	 */
+	pte = pte_offset_map(pmd, start << PAGE_SHIFT);
+	for (i = 0; i < end - start; i++)
+		ptes[i] = pte[i];
+	pte_unmap(pte);
+
+	for (i = 0; i < end - start; i++) {
+		if (start + i == fpfn)
+			continue;
+		if (pte_none(ptes[i]) || pte_present(ptes[i]) ||
+		    pte_file(ptes[i]))
+			continue;
+		entry = pte_to_swp_entry(ptes[i]);
+		if (unlikely(non_swap_entry(entry)))
+			continue;
+
+		page = __read_swap_cache_async(entry, gfp_mask, vma,
+				(start + i) << PAGE_SHIFT, true);
+		if (!page)
+			continue;
+		page_cache_release(page);
+	}
+	lru_add_drain();	/* Push any new pages onto the LRU now */
+skip:
+	return read_swap_cache_async(fentry, gfp_mask, vma, faddr);
+}
+
+#ifdef CONFIG_SYSFS
+static ssize_t vma_ra_enabled_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", swap_vma_readahead_enabled ?
+		       "true" : "false");
+}
+
+static ssize_t vma_ra_enabled_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	if (!strncmp(buf, "true", 4) || !strncmp(buf, "1", 1))
+		swap_vma_readahead_enabled = true;
+	else if (!strncmp(buf, "false", 5) || !strncmp(buf, "0", 1))
+		swap_vma_readahead_enabled = false;
+	else
+		return -EINVAL;
+
+	return count;
+}
+static struct kobj_attribute vma_ra_enabled_attr =
+	__ATTR(vma_ra_enabled, 0644, vma_ra_enabled_show,
+	       vma_ra_enabled_store);
+
+static struct attribute *swap_attrs[] = {
+	&vma_ra_enabled_attr.attr,
+	NULL,
+};
+
+static struct attribute_group swap_attr_group = {
+	.attrs = swap_attrs,
+	.name = "swap",
+};
+
+static int __init swap_init_sysfs(void)
+{
+	int err;
+
+	err = sysfs_create_group(mm_kobj, &swap_attr_group);
+	if (err)
+		printk(KERN_ERR "swap: register sysfs failed\n");
+
+	return err;
+}
+subsys_initcall(swap_init_sysfs);
+#endif /* CONFIG_SYSFS */
@@ -0,0 +1,438 @@
+/*
+ * linux/mm/vmpressure.c
+ *
+ * Memory pressure notifications, so that userspace can shrink its caches
+ * before the kernel has to reclaim hard or kill processes.
+ *
+ * Pressure is derived from reclaim efficiency: the ratio of pages reclaimed
+ * to pages scanned by shrink_zone(), accumulated per zone scan over a
+ * window of vmpressure_win pages. Reclaim of a memory cgroup is accounted
+ * to that cgroup, all other reclaim to the root (global) pressure.
+ *
+ * Listeners are told about three levels:
+ *  low      - reclaim is going on, but is efficient
+ *  medium   - reclaim is getting harder; caches should be trimmed
+ *  critical - reclaim barely makes progress, the OOM killer (or the
+ *             lowmemorykiller) is about to act
+ *
+ * Global pressure can be polled on /dev/mempressure; memory cgroups (and
+ * the root) expose memory.pressure_level for use with cgroup.event_control.
+ *
+ * This file is released under the GPLv2.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/swap.h>
+#include <linux/eventfd.h>
+#include <linux/uaccess.h>
+#include <linux/vmpressure.h>
+
+/*
+ * Reclaim is accounted in windows of this many scanned pages, so that
+ * listeners are not woken for every SWAP_CLUSTER_MAX batch.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+/* Percentage of scanned pages not reclaimed at which each level starts */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
+/*
+ * Direct reclaim reaching this priority has scanned 1/8 of the LRUs
+ * without meeting its target: report critical regardless of efficiency.
+ */
+static const int vmpressure_level_critical_prio = 3;
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+/* An eventfd registered through memory.pressure_level */
+struct vmpressure_event {
+	struct eventfd_ctx *efd;
+	enum vmpressure_levels level;	/* lowest level to signal */
+	struct list_head node;
+};
+
+static void vmpressure_work_fn(struct work_struct *work);
+
+static struct vmpressure global_vmpressure = {
+	.sr_lock = __SPIN_LOCK_UNLOCKED(global_vmpressure.sr_lock),
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(global_vmpressure.wait),
+	.listeners = LIST_HEAD_INIT(global_vmpressure.listeners),
+	.listeners_lock =
+		__MUTEX_INITIALIZER(global_vmpressure.listeners_lock),
+	.work = __WORK_INITIALIZER(global_vmpressure.work,
+				   vmpressure_work_fn),
+};
+
+static struct vmpressure *to_vmpressure(struct mem_cgroup *memcg)
+{
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+	struct vmpressure *vmpr = memcg_to_vmpressure(memcg);
+
+	if (vmpr)
+		return vmpr;
+#endif
+	return &global_vmpressure;
+}
+
+static enum vmpressure_levels vmpressure_level(unsigned long pressure)
+{
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static enum vmpressure_levels vmpressure_calc_level(unsigned long scanned,
+						    unsigned long reclaimed)
+{
+	unsigned long pressure = 0;
+
+	/* Slab reclaim can free more than was scanned off the LRUs */
+	if (reclaimed < scanned)
+		pressure = 100 - reclaimed * 100 / scanned;
+
+	pr_debug("%s: %3lu (s: %lu r: %lu)\n", __func__, pressure,
+		 scanned, reclaimed);
+
+	return vmpressure_level(pressure);
+}
+
+/* Returns true if anybody was listening */
+static bool vmpressure_event(struct vmpressure *vmpr,
+			     enum vmpressure_levels level)
+{
+	struct vmpressure_event *ev;
+	bool signalled = false;
+	int i;
+
+	mutex_lock(&vmpr->listeners_lock);
+
+	list_for_each_entry(ev, &vmpr->listeners, node) {
+		if (level >= ev->level) {
+			eventfd_signal(ev->efd, 1);
+			signalled = true;
+		}
+	}
+
+	vmpr->last_level = level;
+	for (i = 0; i <= level; i++)
+		vmpr->events[i]++;
+	if (waitqueue_active(&vmpr->wait)) {
+		wake_up_interruptible(&vmpr->wait);
+		signalled = true;
+	}
+
+	mutex_unlock(&vmpr->listeners_lock);
+
+	return signalled;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	struct vmpressure *vmpr = container_of(work, struct vmpressure, work);
+	unsigned long scanned, reclaimed;
+	enum vmpressure_levels level;
+
+	spin_lock(&vmpr->sr_lock);
+	scanned = vmpr->scanned;
+	reclaimed = vmpr->reclaimed;
+	vmpr->scanned = 0;
+	vmpr->reclaimed = 0;
+	spin_unlock(&vmpr->sr_lock);
+
+	/* Several works may have been queued for one window */
+	if (!scanned)
+		return;
+
+	level = vmpressure_calc_level(scanned, reclaimed);
+
+	/*
+	 * A cgroup without listeners passes its pressure on to the nearest
+	 * ancestor (in a use_hierarchy tree) that has some, up to the root
+	 * cgroup, whose listeners share the global pressure.
+	 */
+	do {
+		if (vmpressure_event(vmpr, level))
+			break;
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+		if (vmpr != &global_vmpressure) {
+			struct mem_cgroup *parent;
+
+			parent = vmpressure_parent_memcg(vmpr);
+			vmpr = parent ? to_vmpressure(parent) : NULL;
+		} else
+			vmpr = NULL;
+#else
+		vmpr = NULL;
+#endif
+	} while (vmpr);
+}
+
+/**
+ * vmpressure() - Account memory pressure through scanned/reclaimed ratio
+ * @gfp:	reclaimer's gfp mask
+ * @memcg:	cgroup being reclaimed, NULL for global reclaim
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * Called from shrink_zone() after each zone scan. Listeners are notified
+ * from a work item once a window worth of pages has been scanned.
+ */
+void vmpressure(gfp_t gfp, struct mem_cgroup *memcg,
+		unsigned long scanned, unsigned long reclaimed)
+{
+	struct vmpressure *vmpr = to_vmpressure(memcg);
+
+	/*
+	 * Only reclaim on behalf of user and page cache allocations says
+	 * something about the pressure the framework cares about.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpr->sr_lock);
+	vmpr->scanned += scanned;
+	vmpr->reclaimed += reclaimed;
+	scanned = vmpr->scanned;
+	spin_unlock(&vmpr->sr_lock);
+
+	if (scanned < vmpressure_win)
+		return;
+	schedule_work(&vmpr->work);
+}
+
+/**
+ * vmpressure_prio() - Account reclaim priority drops
+ * @gfp:	reclaimer's gfp mask
+ * @memcg:	cgroup being reclaimed, NULL for global reclaim
+ * @prio:	reclaim priority about to be used
+ *
+ * Direct reclaim that keeps raising its priority is in trouble however
+ * efficient each zone scan looked; report it as critical.
+ */
+void vmpressure_prio(gfp_t gfp, struct mem_cgroup *memcg, int prio)
+{
+	if (prio > vmpressure_level_critical_prio)
+		return;
+
+	/* A full window, nothing reclaimed: critical */
+	vmpressure(gfp, memcg, vmpressure_win, 0);
+}
+
+static int vmpressure_parse_level(const char *str, size_t len)
+{
+	int level;
+
+	for (level = 0; level < VMPRESSURE_NUM_LEVELS; level++)
+		if (strlen(vmpressure_str_levels[level]) == len &&
+		    !strncmp(str, vmpressure_str_levels[level], len))
+			return level;
+
+	return -EINVAL;
+}
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+void vmpressure_init(struct vmpressure *vmpr)
+{
+	spin_lock_init(&vmpr->sr_lock);
+	init_waitqueue_head(&vmpr->wait);
+	INIT_LIST_HEAD(&vmpr->listeners);
+	mutex_init(&vmpr->listeners_lock);
+	INIT_WORK(&vmpr->work, vmpressure_work_fn);
+}
+
+void vmpressure_cleanup(struct vmpressure *vmpr)
+{
+	/* The work may still be pending from the last reclaim */
+	flush_work(&vmpr->work);
+}
+
+/*
+ * Register an eventfd for memory.pressure_level. 'args' is the lowest
+ * level to be notified of: "low", "medium" or "critical".
+ */
+int vmpressure_register_event(struct mem_cgroup *memcg,
+			      struct eventfd_ctx *eventfd, const char *args)
+{
+	struct vmpressure *vmpr = to_vmpressure(memcg);
+	struct vmpressure_event *ev;
+	int level;
+
+	level = vmpressure_parse_level(args, strcspn(args, "\n"));
+	if (level < 0)
+		return level;
+
+	ev = kzalloc(sizeof(*ev), GFP_KERNEL);
+	if (!ev)
+		return -ENOMEM;
+
+	ev->efd = eventfd;
+	ev->level = level;
+
+	mutex_lock(&vmpr->listeners_lock);
+	list_add(&ev->node, &vmpr->listeners);
+	mutex_unlock(&vmpr->listeners_lock);
+
+	return 0;
+}
+
+void vmpressure_unregister_event(struct mem_cgroup *memcg,
+				 struct eventfd_ctx *eventfd)
+{
+	struct vmpressure *vmpr = to_vmpressure(memcg);
+	struct vmpressure_event *ev, *tmp;
+
+	mutex_lock(&vmpr->listeners_lock);
+	list_for_each_entry_safe(ev, tmp, &vmpr->listeners, node) {
+		if (ev->efd != eventfd)
+			continue;
+		list_del(&ev->node);
+		kfree(ev);
+		break;
+	}
+	mutex_unlock(&vmpr->listeners_lock);
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR */
+
+/*
+ * /dev/mempressure: global pressure for processes outside of any memory
+ * cgroup setup. Write the lowest level of interest (default "low"), then
+ * poll() for POLLPRI. read() waits for an event at or above that level
+ * and returns the level of the latest event, e.g. "medium\n".
+ */
+struct vmpressure_reader {
+	enum vmpressure_levels level;
+	unsigned long seen;	/* events[level] at the last read */
+};
+
+static bool vmpressure_reader_pending(struct vmpressure_reader *reader)
+{
+	return global_vmpressure.events[reader->level] != reader->seen;
+}
+
+static int vmpressure_open(struct inode *inode, struct file *file)
+{
+	struct vmpressure_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	reader->level = VMPRESSURE_LOW;
+	reader->seen = global_vmpressure.events[VMPRESSURE_LOW];
+	file->private_data = reader;
+
+	return nonseekable_open(inode, file);
+}
+
+static int vmpressure_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t vmpressure_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct vmpressure_reader *reader = file->private_data;
+	const char *name;
+	char line[16];
+	size_t len;
+	int ret;
+
+	if (!vmpressure_reader_pending(reader)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(global_vmpressure.wait,
+				vmpressure_reader_pending(reader));
+		if (ret)
+			return ret;
+	}
+
+	reader->seen = global_vmpressure.events[reader->level];
+	name = vmpressure_str_levels[global_vmpressure.last_level];
+	len = snprintf(line, sizeof(line), "%s\n", name);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, line, len))
+		return -EFAULT;
+
+	return len;
+}
+
+static ssize_t vmpressure_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct vmpressure_reader *reader = file->private_data;
+	char line[16];
+	int level;
+
+	if (count >= sizeof(line))
+		return -EINVAL;
+	if (copy_from_user(line, buf, count))
+		return -EFAULT;
+	line[count] = '\0';
+
+	level = vmpressure_parse_level(line, strcspn(line, "\n"));
+	if (level < 0)
+		return level;
+
+	reader->level = level;
+	reader->seen = global_vmpressure.events[level];
+
+	return count;
+}
+
+static unsigned int vmpressure_poll(struct file *file, poll_table *wait)
+{
+	struct vmpressure_reader *reader = file->private_data;
+
+	poll_wait(file, &global_vmpressure.wait, wait);
+
+	if (vmpressure_reader_pending(reader))
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations vmpressure_fops = {
+	.owner = THIS_MODULE,
+	.open = vmpressure_open,
+	.release = vmpressure_release,
+	.read = vmpressure_read,
+	.write = vmpressure_write,
+	.poll = vmpressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice vmpressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "mempressure",
+	.fops = &vmpressure_fops,
+};
+
+static int __init vmpressure_dev_init(void)
+{
+	int ret;
+
+	ret = misc_register(&vmpressure_misc);
+	if (unlikely(ret))
+		printk(KERN_ERR "vmpressure: failed to register misc device\n");
+
+	return ret;
+}
+
+module_init(vmpressure_dev_init);
@@ -0,0 +1,323 @@
+/*
+ * linux/mm/workingset.c
+ *
+ * Workingset detection: telling apart pages reclaimed for good from
+ * pages that were still in use and are faulted right back in.
+ *
+ *		Double CLOCK lists
+ *
+ * Per zone, two clock lists are maintained for file pages: the inactive
+ * list and the active list.  Freshly faulted pages start out at the head
+ * of the inactive list and page reclaim scans pages from the tail.  Pages
+ * that are accessed multiple times on the inactive list are promoted to
+ * the active list, to protect them from reclaim, whereas active pages
+ * are demoted to the inactive list when the active list grows too big.
+ *
+ * The fixed balance between the two lists means a burst of new pages,
+ * an app launch for instance, can push out frequently used pages that
+ * sit on the inactive list only because the active list is full: the
+ * shared libraries and dex files of the framework, which are then read
+ * back from flash straight away.
+ *
+ *		Refault distance
+ *
+ * Each zone counts evictions from and activations out of its inactive
+ * list in zone->inactive_age.  When a file page is reclaimed, the
+ * counter is stored in a shadow entry left in the page's slot of the
+ * page cache radix tree.  If the page is faulted in again, the
+ * difference between the counter at that time and the one in the shadow
+ * entry, the refault distance, is the minimum number of pages the
+ * inactive list would have needed to be longer to hold on to the page.
+ *
+ * All pages on the active list are candidates for that space.  So if
+ * the refault distance is no more than the active list size, the page
+ * would have stayed in memory with the lists balanced differently, and
+ * it is activated right away.  It then competes with the existing
+ * active pages, which are deactivated as usual if they are used less.
+ *
+ *		Implementation
+ *
+ * Shadow entries take no memory beyond the radix tree slots that held
+ * the pages, and are dropped with the rest of the page cache when the
+ * inode is truncated or evicted.  Only reclaimed pages leave them.
+ *
+ * A file that stays open while its pages are reclaimed, though, can
+ * keep radix tree nodes holding nothing but shadow entries for as
+ * long as the inode lives.  Such nodes are put on a list, oldest
+ * first, and a shrinker frees them once there are more than the
+ * active cache could ever use, see count_shadow_nodes().  A node
+ * leaves the list when a page goes into it again.
+ */
+
+#include <linux/mm.h>
+#include <linux/mm_inline.h>
+#include <linux/swap.h>
+#include <linux/fs.h>
+#include <linux/mmzone.h>
+#include <linux/radix-tree.h>
+#include <linux/spinlock.h>
+#include <linux/init.h>
+#include <linux/vmstat.h>
+
+#define EVICTION_SHIFT	(RADIX_TREE_EXCEPTIONAL_SHIFT + \
+			 NODES_SHIFT +	\
+			 ZONES_SHIFT)
+#define EVICTION_MASK	(~0UL >> EVICTION_SHIFT)
+
+static void *pack_shadow(unsigned long eviction, struct zone *zone)
+{
+	eviction = (eviction << NODES_SHIFT) | zone_to_nid(zone);
+	eviction = (eviction << ZONES_SHIFT) | zone_idx(zone);
+	eviction = (eviction << RADIX_TREE_EXCEPTIONAL_SHIFT);
+
+	return (void *)(eviction | RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static void unpack_shadow(void *shadow, struct zone **zone,
+			  unsigned long *distance)
+{
+	unsigned long entry = (unsigned long)shadow;
+	unsigned long eviction;
+	unsigned long refault;
+	unsigned long mask;
+	int zid, nid;
+
+	entry >>= RADIX_TREE_EXCEPTIONAL_SHIFT;
+	zid = entry & ((1UL << ZONES_SHIFT) - 1);
+	entry >>= ZONES_SHIFT;
+	nid = entry & ((1UL << NODES_SHIFT) - 1);
+	entry >>= NODES_SHIFT;
+	eviction = entry;
+
+	*zone = NODE_DATA(nid)->node_zones + zid;
+
+	refault = atomic_long_read(&(*zone)->inactive_age);
+	mask = EVICTION_MASK;
+	/*
+	 * The unsigned subtraction here gives an accurate distance
+	 * across inactive_age overflows in most cases.
+	 *
+	 * There is a special case: usually, shadow entries have a
+	 * short lifetime and are either refaulted or dropped along
+	 * with the inode before inactive_age wraps around.  A shadow
+	 * kept for longer, e.g. of a file that stays open while its
+	 * pages are never used again, may then show a small distance
+	 * and activate a page that is not hot.  That costs one page
+	 * on the active list for a while and is not worth tracking.
+	 */
+	*distance = (refault - eviction) & mask;
+}
+
+/**
+ * workingset_eviction - note the eviction of a page from memory
+ * @mapping: address space the page was backing
+ * @page: the page being evicted
+ *
+ * Returns a shadow entry to be stored in @mapping->page_tree in place
+ * of the evicted @page so that a later refault can be detected.
+ */
+void *workingset_eviction(struct address_space *mapping, struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	unsigned long eviction;
+
+	eviction = atomic_long_inc_return(&zone->inactive_age);
+	return pack_shadow(eviction, zone);
+}
+
+/**
+ * workingset_refault - evaluate the refault of a previously evicted page
+ * @shadow: shadow entry of the evicted page
+ *
+ * Calculates and evaluates the refault distance of the previously
+ * evicted page in the context of the zone it was allocated in.
+ *
+ * Returns %true if the page should be activated, %false otherwise.
+ */
+bool workingset_refault(void *shadow)
+{
+	unsigned long refault_distance;
+	struct zone *zone;
+
+	unpack_shadow(shadow, &zone, &refault_distance);
+	inc_zone_state(zone, WORKINGSET_REFAULT);
+
+	if (refault_distance <= zone_page_state(zone, NR_ACTIVE_FILE)) {
+		inc_zone_state(zone, WORKINGSET_ACTIVATE);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * workingset_activation - note a page activation
+ * @page: page that is being activated
+ */
+void workingset_activation(struct page *page)
+{
+	atomic_long_inc(&page_zone(page)->inactive_age);
+}
+
+/*
+ * Nodes of the page cache radix trees that hold shadow entries only,
+ * oldest first.  shadow_nodes_lock nests inside mapping->tree_lock.
+ */
+static LIST_HEAD(shadow_nodes);
+static DEFINE_SPINLOCK(shadow_nodes_lock);
+static unsigned long nr_shadow_nodes;
+
+/**
+ * workingset_shadow_node_add - note a node that may hold shadows only
+ * @mapping: address space @node belongs to
+ * @node: bottom-level node of @mapping->page_tree
+ * @index: index of a slot in @node
+ *
+ * Called with @mapping->tree_lock held after a shadow entry has been
+ * stored in @node.  Puts @node on the list of reclaimable shadow nodes
+ * if it holds no pages.
+ */
+void workingset_shadow_node_add(struct address_space *mapping,
+				struct radix_tree_node *node, pgoff_t index)
+{
+	int i;
+
+	if (!list_empty(&node->private_list))
+		return;
+
+	for (i = 0; i < RADIX_TREE_MAP_SIZE; i++) {
+		void *entry = node->slots[i];
+
+		if (entry && !radix_tree_exceptional_entry(entry))
+			return;
+	}
+
+	node->private_data = mapping;
+	node->private_index = index & ~RADIX_TREE_MAP_MASK;
+
+	spin_lock(&shadow_nodes_lock);
+	list_add_tail(&node->private_list, &shadow_nodes);
+	nr_shadow_nodes++;
+	spin_unlock(&shadow_nodes_lock);
+}
+
+/**
+ * workingset_shadow_node_del - stop tracking a node for shadow reclaim
+ * @node: bottom-level node of a page cache radix tree
+ *
+ * Called with the mapping's tree_lock held before a page is stored in
+ * @node, or before an entry is deleted from it.
+ */
+void workingset_shadow_node_del(struct radix_tree_node *node)
+{
+	if (list_empty(&node->private_list))
+		return;
+
+	spin_lock(&shadow_nodes_lock);
+	list_del_init(&node->private_list);
+	nr_shadow_nodes--;
+	spin_unlock(&shadow_nodes_lock);
+}
+
+/*
+ * Active cache pages are limited to 50% of memory, and shadow entries
+ * that represent a refault distance bigger than that do not have any
+ * effect.  Allow as many shadow nodes as it takes for the shadow
+ * entries to match the number of active cache pages, assuming a
+ * worst-case node population density of 1/8th on average.
+ */
+static unsigned long max_shadow_nodes(void)
+{
+	return totalram_pages >> (1 + RADIX_TREE_MAP_SHIFT - 3);
+}
+
+static unsigned long count_shadow_nodes(void)
+{
+	unsigned long max_nodes = max_shadow_nodes();
+	unsigned long nr_nodes = nr_shadow_nodes;
+
+	if (nr_nodes <= max_nodes)
+		return 0;
+	return nr_nodes - max_nodes;
+}
+
+/*
+ * Free the shadow entries in @node, which the caller has taken off the
+ * list, with the mapping's tree_lock held.
+ */
+static void shadow_node_reclaim(struct address_space *mapping,
+				struct radix_tree_node *node)
+{
+	pgoff_t indices[RADIX_TREE_MAP_SIZE];
+	int i, nr = 0;
+
+	/* Deleting the last entry frees the node */
+	for (i = 0; i < RADIX_TREE_MAP_SIZE; i++) {
+		void *entry = node->slots[i];
+
+		if (entry && radix_tree_exceptional_entry(entry))
+			indices[nr++] = node->private_index + i;
+	}
+
+	inc_zone_state(page_zone(virt_to_page(node)), WORKINGSET_NODERECLAIM);
+
+	for (i = 0; i < nr; i++) {
+		radix_tree_delete(&mapping->page_tree, indices[i]);
+		mapping->nrshadows--;
+	}
+}
+
+static int shrink_shadow_nodes(struct shrinker *shrink, int nr_to_scan,
+			       gfp_t gfp_mask)
+{
+	struct radix_tree_node *node;
+	struct address_space *mapping;
+
+	if (!nr_to_scan)
+		return count_shadow_nodes();
+
+	spin_lock_irq(&shadow_nodes_lock);
+	while (nr_to_scan-- > 0 && count_shadow_nodes()) {
+		node = list_first_entry(&shadow_nodes, struct radix_tree_node,
+					private_list);
+		/*
+		 * A node stays on the list until its mapping's tree_lock
+		 * has been taken to drop it, so the mapping is still there.
+		 * The lock order is the other way round, though: try it,
+		 * and move on to the next node if it is busy.
+		 */
+		mapping = node->private_data;
+		if (!spin_trylock(&mapping->tree_lock)) {
+			list_move_tail(&node->private_list, &shadow_nodes);
+			continue;
+		}
+
+		list_del_init(&node->private_list);
+		nr_shadow_nodes--;
+		spin_unlock(&shadow_nodes_lock);
+
+		shadow_node_reclaim(mapping, node);
+
+		spin_unlock_irq(&mapping->tree_lock);
+		cond_resched();
+		spin_lock_irq(&shadow_nodes_lock);
+	}
+	spin_unlock_irq(&shadow_nodes_lock);
+
+	return count_shadow_nodes();
+}
+
+/*
+ * Shadow nodes are cheap to rebuild, but their loss makes refaults look
+ * like new pages: reclaim them about as eagerly as other caches.
+ */
+static struct shrinker workingset_shadow_shrinker = {
+	.shrink = shrink_shadow_nodes,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int __init workingset_init(void)
+{
+	register_shrinker(&workingset_shadow_shrinker);
+	return 0;
+}
+module_init(workingset_init);
@@ -0,0 +1,681 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o binder_stress binder_stress.c */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * This program measures binder throughput and latency, and how they scale
+ * with the number of independent client/server process pairs.  Since the
+ * pairs share nothing but the driver, the aggregate rate should grow with
+ * the number of cores until the driver (or the machine) saturates.
+ *
+ * Modes (-m):
+ *   ping	synchronous call with a small parcel, empty reply
+ *   oneway	flood of one-way calls, with a synchronous call after every
+ *		batch so the server's async queue stays bounded
+ *   large	synchronous call with a large parcel
+ *   sg		the same payload sent as a BINDER_TYPE_PTR buffer
+ *   fd		synchronous call carrying a file descriptor
+ *
+ * Latency is the client-side time per call: the full round trip for
+ * synchronous calls, and until BR_TRANSACTION_COMPLETE for one-way ones.
+ * The driver's own breakdown is in <debugfs>/binder/latency.
+ *
+ * The program becomes the context manager itself so that servers can publish
+ * their objects and clients can look them up, which means servicemanager must
+ * not be running.  Pair counts double from 1 up to -n (default: one pair per
+ * online CPU), each step running for -t seconds.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../drivers/staging/android/binder.h"
+
+/*-------------------------------------------------------------------------*/
+
+#define	BINDER_DEV	"/dev/binder"
+#define	MAP_SIZE	((1024 - 8) * 1024)
+#define	MAX_PAIRS	64
+#define	MAX_PAYLOAD	(256 * 1024)
+#define	BATCH		64
+#define	LAT_SLOTS	20000		/* 1us each, the last one is overflow */
+
+enum {
+	CODE_REGISTER = 1,	/* server -> manager: index and binder object */
+	CODE_LOOKUP,		/* client -> manager: index, reply holds handle */
+	CODE_PING,		/* client -> server */
+};
+
+enum {
+	MODE_PING,
+	MODE_ONEWAY,
+	MODE_LARGE,
+	MODE_SG,
+	MODE_FD,
+};
+
+static const struct {
+	const char	*name;
+	size_t		payload;
+} modes[] = {
+	[MODE_PING]	= { "ping",	64 },
+	[MODE_ONEWAY]	= { "oneway",	64 },
+	[MODE_LARGE]	= { "large",	128 * 1024 },
+	[MODE_SG]	= { "sg",	128 * 1024 },
+	[MODE_FD]	= { "fd",	0 },
+};
+
+struct bs {
+	int		fd;
+	void		*map;
+	int		complete;	/* BR_TRANSACTION_COMPLETE seen */
+	size_t		wlen;
+	unsigned char	wbuf[256];
+	unsigned char	rbuf[256];
+};
+
+struct bs_register {
+	unsigned long			index;
+	struct flat_binder_object	obj;
+};
+
+/* one per client, in memory shared with the parent */
+struct bs_result {
+	unsigned long	count;
+	double		elapsed;
+	unsigned int	lat[LAT_SLOTS];
+};
+
+typedef void (*bs_handler)(struct bs *bs, struct binder_transaction_data *txn,
+			   struct binder_transaction_data *reply);
+
+static int mode = MODE_PING;
+static int server_node;
+
+/*-------------------------------------------------------------------------*/
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bs_open(struct bs *bs)
+{
+	struct binder_version vers;
+
+	bs->fd = open(BINDER_DEV, O_RDWR);
+	if (bs->fd < 0)
+		die("open " BINDER_DEV);
+	if (ioctl(bs->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder_stress: protocol %ld, expected %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	bs->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, bs->fd, 0);
+	if (bs->map == MAP_FAILED)
+		die("mmap " BINDER_DEV);
+	bs->complete = 0;
+	bs->wlen = 0;
+}
+
+/* queue a command for the next BINDER_WRITE_READ */
+static void bs_put(struct bs *bs, uint32_t cmd, const void *arg, size_t len)
+{
+	if (bs->wlen + sizeof(cmd) + len > sizeof(bs->wbuf)) {
+		fprintf(stderr, "binder_stress: command buffer overflow\n");
+		exit(1);
+	}
+	memcpy(bs->wbuf + bs->wlen, &cmd, sizeof(cmd));
+	bs->wlen += sizeof(cmd);
+	if (len) {
+		memcpy(bs->wbuf + bs->wlen, arg, len);
+		bs->wlen += len;
+	}
+}
+
+static void bs_free(struct bs *bs, struct binder_transaction_data *tr)
+{
+	const void *buffer = tr->data.ptr.buffer;
+
+	bs_put(bs, BC_FREE_BUFFER, &buffer, sizeof(buffer));
+}
+
+/* flush queued commands and, if asked, read one batch of returns */
+static size_t bs_xfer(struct bs *bs, int do_read)
+{
+	struct binder_write_read bwr;
+
+	bwr.write_size = bs->wlen;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)bs->wbuf;
+	bwr.read_size = do_read ? sizeof(bs->rbuf) : 0;
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)bs->rbuf;
+
+	/* the driver updates the consumed counts before failing */
+	while (ioctl(bs->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+	}
+	bs->wlen = 0;
+	return bwr.read_consumed;
+}
+
+/*
+ * Consume one batch of returns.  Reference count requests on our own node
+ * are acknowledged on the next write.  The driver ends a batch after a
+ * transaction or reply, so that (if any) is what we return.
+ */
+static uint32_t bs_parse(struct bs *bs, size_t len,
+			 struct binder_transaction_data *tr)
+{
+	unsigned char *p = bs->rbuf;
+	unsigned char *end = bs->rbuf + len;
+	struct binder_ptr_cookie pc;
+	uint32_t cmd;
+
+	while (p < end) {
+		memcpy(&cmd, p, sizeof(cmd));
+		p += sizeof(cmd);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_SPAWN_LOOPER:
+			break;
+		case BR_TRANSACTION_COMPLETE:
+			bs->complete = 1;
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			memcpy(&pc, p, sizeof(pc));
+			p += sizeof(pc);
+			bs_put(bs, cmd == BR_INCREFS ? BC_INCREFS_DONE :
+			       BC_ACQUIRE_DONE, &pc, sizeof(pc));
+			break;
+		case BR_RELEASE:
+		case BR_DECREFS:
+			p += sizeof(pc);
+			break;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, p, sizeof(*tr));
+			return cmd;
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			fprintf(stderr, "binder_stress: %d: transaction %s\n",
+				getpid(), cmd == BR_DEAD_REPLY ? "hit a dead "
+				"process" : "failed");
+			exit(1);
+		default:
+			fprintf(stderr, "binder_stress: %d: unexpected return "
+				"0x%x\n", getpid(), cmd);
+			exit(1);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send a transaction; for synchronous ones, wait for and return the reply.
+ * A non-zero buffers_size sends it with BC_TRANSACTION_SG.
+ */
+static void bs_transact(struct bs *bs, uint32_t handle, uint32_t code,
+			unsigned int flags, const void *data, size_t data_size,
+			const size_t *offsets, size_t offsets_size,
+			size_t buffers_size,
+			struct binder_transaction_data *reply)
+{
+	struct binder_transaction_data_sg sg;
+	struct binder_transaction_data *tr = &sg.transaction_data;
+	uint32_t ret;
+
+	memset(&sg, 0, sizeof(sg));
+	tr->target.handle = handle;
+	tr->code = code;
+	tr->flags = flags;
+	tr->data_size = data_size;
+	tr->offsets_size = offsets_size;
+	tr->data.ptr.buffer = data;
+	tr->data.ptr.offsets = offsets;
+	if (buffers_size) {
+		sg.buffers_size = buffers_size;
+		bs_put(bs, BC_TRANSACTION_SG, &sg, sizeof(sg));
+	} else {
+		bs_put(bs, BC_TRANSACTION, tr, sizeof(*tr));
+	}
+
+	bs->complete = 0;
+	do {
+		ret = bs_parse(bs, bs_xfer(bs, 1), reply);
+		if (ret == BR_TRANSACTION) {
+			fprintf(stderr, "binder_stress: %d: unexpected nested "
+				"transaction\n", getpid());
+			exit(1);
+		}
+		if ((flags & TF_ONE_WAY) && bs->complete)
+			return;
+	} while (ret != BR_REPLY);
+}
+
+/* serve transactions forever; replies must point at static data */
+static void bs_loop(struct bs *bs, bs_handler fn)
+{
+	struct binder_transaction_data txn, reply;
+
+	bs_put(bs, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		if (bs_parse(bs, bs_xfer(bs, 1), &txn) != BR_TRANSACTION)
+			continue;
+		memset(&reply, 0, sizeof(reply));
+		fn(bs, &txn, &reply);
+		bs_free(bs, &txn);
+		if (!(txn.flags & TF_ONE_WAY))
+			bs_put(bs, BC_REPLY, &reply, sizeof(reply));
+	}
+}
+
+/*-------------------------------------------------------------------------*/
+
+static uint32_t mgr_handles[MAX_PAIRS];
+
+static void mgr_handler(struct bs *bs, struct binder_transaction_data *txn,
+			struct binder_transaction_data *reply)
+{
+	static struct flat_binder_object obj;
+	static size_t off;
+	const struct bs_register *reg = txn->data.ptr.buffer;
+	unsigned long index;
+
+	if (txn->data_size < sizeof(index))
+		return;
+	index = reg->index;
+	if (index >= MAX_PAIRS)
+		return;
+
+	switch (txn->code) {
+	case CODE_REGISTER:
+		if (txn->data_size < sizeof(*reg) ||
+		    reg->obj.type != BINDER_TYPE_HANDLE)
+			return;
+		/* drop the previous step's server, keep this one past free */
+		if (mgr_handles[index])
+			bs_put(bs, BC_RELEASE, &mgr_handles[index],
+			       sizeof(mgr_handles[index]));
+		mgr_handles[index] = reg->obj.handle;
+		bs_put(bs, BC_ACQUIRE, &mgr_handles[index],
+		       sizeof(mgr_handles[index]));
+		break;
+	case CODE_LOOKUP:
+		if (!mgr_handles[index])
+			return;
+		memset(&obj, 0, sizeof(obj));
+		obj.type = BINDER_TYPE_HANDLE;
+		obj.handle = mgr_handles[index];
+		off = 0;
+		reply->data_size = sizeof(obj);
+		reply->offsets_size = sizeof(off);
+		reply->data.ptr.buffer = &obj;
+		reply->data.ptr.offsets = &off;
+		break;
+	}
+}
+
+static void run_manager(int ready_fd)
+{
+	struct bs bs;
+
+	bs_open(&bs);
+	if (ioctl(bs.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR (is servicemanager running?)");
+	if (write(ready_fd, "m", 1) != 1)
+		die("write");
+	close(ready_fd);
+	bs_loop(&bs, mgr_handler);
+}
+
+static void server_handler(struct bs *bs, struct binder_transaction_data *txn,
+			   struct binder_transaction_data *reply)
+{
+	const size_t *offs = txn->data.ptr.offsets;
+	const struct flat_binder_object *obj;
+	size_t i;
+
+	(void)bs;
+	(void)reply;
+
+	/* the driver installed any passed descriptors in our table */
+	for (i = 0; i < txn->offsets_size / sizeof(*offs); i++) {
+		obj = (const void *)((const char *)txn->data.ptr.buffer +
+				     offs[i]);
+		if (obj->type == BINDER_TYPE_FD)
+			close(obj->handle);
+	}
+}
+
+static void run_server(unsigned long index, int ready_fd)
+{
+	struct binder_transaction_data reply;
+	struct bs_register reg;
+	size_t off = offsetof(struct bs_register, obj);
+	struct bs bs;
+
+	bs_open(&bs);
+	memset(&reg, 0, sizeof(reg));
+	reg.index = index;
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.flags = FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	reg.obj.binder = &server_node;
+	bs_transact(&bs, 0, CODE_REGISTER, 0, &reg, sizeof(reg),
+		    &off, sizeof(off), 0, &reply);
+	bs_free(&bs, &reply);
+
+	if (write(ready_fd, "s", 1) != 1)
+		die("write");
+	close(ready_fd);
+	bs_loop(&bs, server_handler);
+}
+
+static void run_client(unsigned long index, int ready_fd, int go_fd,
+		       struct bs_result *res, double seconds, size_t payload)
+{
+	static unsigned char data[MAX_PAYLOAD];
+	struct binder_transaction_data reply;
+	const struct flat_binder_object *obj;
+	struct flat_binder_object fd_obj;
+	struct binder_buffer_object sg_obj;
+	const void *buf = data;
+	size_t size = payload, off = 0, offs_size = 0, sg_size = 0;
+	unsigned int flags = 0;
+	double start, t0, t1;
+	uint32_t handle;
+	unsigned long us;
+	struct bs bs;
+	char c;
+	int i;
+
+	bs_open(&bs);
+	bs_transact(&bs, 0, CODE_LOOKUP, 0, &index, sizeof(index), NULL, 0,
+		    0, &reply);
+	obj = reply.data.ptr.buffer;
+	if (reply.data_size < sizeof(*obj) || obj->type != BINDER_TYPE_HANDLE) {
+		fprintf(stderr, "binder_stress: no server %lu\n", index);
+		exit(1);
+	}
+	handle = obj->handle;
+	bs_put(&bs, BC_ACQUIRE, &handle, sizeof(handle));
+	bs_free(&bs, &reply);
+	bs_xfer(&bs, 0);
+
+	if (mode == MODE_ONEWAY)
+		flags = TF_ONE_WAY;
+	if (mode == MODE_FD) {
+		memset(&fd_obj, 0, sizeof(fd_obj));
+		fd_obj.type = BINDER_TYPE_FD;
+		fd_obj.handle = open("/dev/null", O_RDONLY);
+		if (fd_obj.handle < 0)
+			die("open /dev/null");
+		buf = &fd_obj;
+		size = sizeof(fd_obj);
+		offs_size = sizeof(off);
+	}
+	if (mode == MODE_SG) {
+		memset(&sg_obj, 0, sizeof(sg_obj));
+		sg_obj.type = BINDER_TYPE_PTR;
+		sg_obj.buffer = data;
+		sg_obj.length = payload;
+		buf = &sg_obj;
+		size = sizeof(sg_obj);
+		offs_size = sizeof(off);
+		sg_size = payload;
+	}
+
+	if (write(ready_fd, "c", 1) != 1)
+		die("write");
+	close(ready_fd);
+	/* all clients start together when the parent closes the pipe */
+	if (read(go_fd, &c, 1) < 0)
+		die("read");
+
+	res->count = 0;
+	start = t1 = now();
+	do {
+		for (i = 0; i < BATCH; i++) {
+			t0 = t1;
+			bs_transact(&bs, handle, CODE_PING, flags, buf, size,
+				    offs_size ? &off : NULL, offs_size,
+				    sg_size, &reply);
+			t1 = now();
+			if (!(flags & TF_ONE_WAY))
+				bs_free(&bs, &reply);
+			us = (t1 - t0) * 1e6;
+			res->lat[us < LAT_SLOTS ? us : LAT_SLOTS - 1]++;
+		}
+		/* wait for the server to drain what we just queued */
+		if (flags & TF_ONE_WAY) {
+			bs_transact(&bs, handle, CODE_PING, 0, NULL, 0,
+				    NULL, 0, 0, &reply);
+			bs_free(&bs, &reply);
+			t1 = now();
+		}
+		res->count += BATCH;
+		res->elapsed = t1 - start;
+	} while (res->elapsed < seconds);
+	exit(0);
+}
+
+/*-------------------------------------------------------------------------*/
+
+static void wait_ready(int fd, int count)
+{
+	char c;
+
+	while (count--) {
+		if (read(fd, &c, 1) != 1) {
+			fprintf(stderr, "binder_stress: child failed to "
+				"start\n");
+			exit(1);
+		}
+	}
+}
+
+static unsigned int percentile(const unsigned int *lat, unsigned long total,
+			       int pct)
+{
+	unsigned long want = (total * pct + 99) / 100;
+	unsigned long seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < LAT_SLOTS - 1; i++) {
+		seen += lat[i];
+		if (seen >= want)
+			break;
+	}
+	return i;
+}
+
+static double run_step(struct bs_result *results, int pairs, double seconds,
+		       size_t payload, unsigned int *p50, unsigned int *p99)
+{
+	static unsigned int lat[LAT_SLOTS];
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	unsigned long total = 0;
+	int ready[2], go[2];
+	double rate = 0;
+	int i, j, status;
+
+	memset(results, 0, sizeof(*results) * pairs);
+	memset(lat, 0, sizeof(lat));
+	if (pipe(ready) < 0 || pipe(go) < 0)
+		die("pipe");
+
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] < 0)
+			die("fork");
+		if (servers[i] == 0) {
+			close(ready[0]);
+			close(go[1]);
+			run_server(i, ready[1]);
+		}
+	}
+	wait_ready(ready[0], pairs);
+
+	for (i = 0; i < pairs; i++) {
+		clients[i] = fork();
+		if (clients[i] < 0)
+			die("fork");
+		if (clients[i] == 0) {
+			close(ready[0]);
+			close(go[1]);
+			run_client(i, ready[1], go[0], &results[i], seconds,
+				   payload);
+		}
+	}
+	wait_ready(ready[0], pairs);
+	close(go[1]);
+
+	for (i = 0; i < pairs; i++) {
+		if (waitpid(clients[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "binder_stress: client failed\n");
+			exit(1);
+		}
+		rate += results[i].count / results[i].elapsed;
+		total += results[i].count;
+		for (j = 0; j < LAT_SLOTS; j++)
+			lat[j] += results[i].lat[j];
+	}
+	*p50 = percentile(lat, total, 50);
+	*p99 = percentile(lat, total, 99);
+
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGTERM);
+		waitpid(servers[i], NULL, 0);
+	}
+	close(ready[0]);
+	close(ready[1]);
+	close(go[0]);
+	return rate;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-m ping|oneway|large|sg|fd] [-n max_pairs] "
+		"[-t seconds] [-s payload_bytes]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_pairs = sysconf(_SC_NPROCESSORS_ONLN);
+	double seconds = 3;
+	long payload = -1;
+	double rate, base = 0;
+	struct bs_result *results;
+	unsigned int p50, p99;
+	int ready[2];
+	pid_t mgr;
+	int pairs;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:n:t:s:")) != -1) {
+		switch (c) {
+		case 'm':
+			for (mode = 0; mode < (int)(sizeof(modes) /
+						    sizeof(modes[0])); mode++)
+				if (!strcmp(optarg, modes[mode].name))
+					break;
+			if (mode == sizeof(modes) / sizeof(modes[0]))
+				usage(argv[0]);
+			break;
+		case 'n':
+			max_pairs = atoi(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 's':
+			payload = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (payload < 0)
+		payload = modes[mode].payload;
+	if (max_pairs < 1 || max_pairs > MAX_PAIRS || seconds <= 0 ||
+	    payload > MAX_PAYLOAD)
+		usage(argv[0]);
+
+	results = mmap(NULL, sizeof(*results) * MAX_PAIRS,
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (results == MAP_FAILED)
+		die("mmap");
+
+	if (pipe(ready) < 0)
+		die("pipe");
+	mgr = fork();
+	if (mgr < 0)
+		die("fork");
+	if (mgr == 0) {
+		close(ready[0]);
+		run_manager(ready[1]);
+	}
+	close(ready[1]);
+	wait_ready(ready[0], 1);
+	close(ready[0]);
+
+	printf("mode %s, payload %ld bytes, %g s per step\n",
+	       modes[mode].name, mode == MODE_FD ? 0 : payload, seconds);
+	printf("%6s %12s %12s %8s %8s %8s\n", "pairs", "txn/s",
+	       "txn/s/pair", "scaling", "p50(us)", "p99(us)");
+	for (pairs = 1; ; pairs *= 2) {
+		if (pairs > max_pairs)
+			pairs = max_pairs;
+		rate = run_step(results, pairs, seconds, payload, &p50, &p99);
+		if (!base)
+			base = rate;
+		printf("%6d %12.0f %12.0f %7.2fx %8u %8u\n", pairs, rate,
+		       rate / pairs, rate / base, p50, p99);
+		fflush(stdout);
+		if (pairs == max_pairs)
+			break;
+	}
+
+	kill(mgr, SIGTERM);
+	waitpid(mgr, NULL, 0);
+	return 0;
+}
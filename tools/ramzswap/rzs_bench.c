@@ -0,0 +1,241 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -O2 -o rzs_bench rzs_bench.c */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * This program measures ramzswap write (swap-out) throughput and how it
+ * scales with the number of concurrent writers.  Each writer is a separate
+ * process issuing page sized O_DIRECT writes to its own range of slots, so
+ * the only thing the writers share is the driver; with one compression
+ * stream per CPU the aggregate rate should grow with the number of cores.
+ *
+ * The device must be initialized (rzscontrol --init) but must not be in use
+ * as swap, since its contents are overwritten.  Page 0 is left alone so the
+ * swap header survives.  The pages written are about half compressible,
+ * which is roughly what anonymous memory looks like on our devices.
+ *
+ * Writer counts double from 1 up to -n (default: one per online CPU), each
+ * writer storing -s megabytes per step.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <linux/fs.h>
+
+/*-------------------------------------------------------------------------*/
+
+#define	RZS_DEV		"/dev/ramzswap0"
+#define	PAGE_SZ		4096
+#define	MAX_WRITERS	64
+
+static const char *dev = RZS_DEV;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Fill a page with a run of words drawn from a small alphabet followed by
+ * random noise, so LZO gets about 2:1 and no two pages are identical.
+ */
+static void fill_page(unsigned char *buf, unsigned int *seed)
+{
+	uint32_t *words = (uint32_t *)buf;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SZ / 8; i++)
+		words[i] = rand_r(seed) & 0x07070707;
+	for (; i < PAGE_SZ / 4; i++)
+		words[i] = rand_r(seed);
+}
+
+/*-------------------------------------------------------------------------*/
+
+static void run_writer(int id, int ready, int go, off_t first,
+		       unsigned long pages, double *elapsed)
+{
+	unsigned int seed = id * 2654435761u;
+	unsigned char *buf;
+	unsigned long i;
+	double start;
+	int fd;
+	char c;
+
+	fd = open(dev, O_WRONLY | O_DIRECT);
+	if (fd < 0)
+		die(dev);
+	if (posix_memalign((void **)&buf, PAGE_SZ, PAGE_SZ))
+		die("posix_memalign");
+
+	if (write(ready, "r", 1) != 1)
+		die("write");
+	if (read(go, &c, 1) < 0)
+		die("read");
+
+	start = now();
+	for (i = 0; i < pages; i++) {
+		fill_page(buf, &seed);
+		if (pwrite(fd, buf, PAGE_SZ, (first + i) * PAGE_SZ) != PAGE_SZ)
+			die("pwrite");
+	}
+	*elapsed = now() - start;
+	exit(0);
+}
+
+static void wait_ready(int fd, int count)
+{
+	char c;
+
+	while (count--) {
+		if (read(fd, &c, 1) != 1) {
+			fprintf(stderr, "rzs_bench: writer failed to start\n");
+			exit(1);
+		}
+	}
+}
+
+static double run_step(double *elapsed, int writers, unsigned long pages)
+{
+	pid_t pids[MAX_WRITERS];
+	int ready[2], go[2];
+	double bytes = 0;
+	double slowest = 0;
+	int i, status;
+
+	if (pipe(ready) < 0 || pipe(go) < 0)
+		die("pipe");
+
+	for (i = 0; i < writers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			die("fork");
+		if (pids[i] == 0) {
+			close(ready[0]);
+			close(go[1]);
+			run_writer(i, ready[1], go[0], 1 + i * pages, pages,
+				   &elapsed[i]);
+		}
+	}
+	wait_ready(ready[0], writers);
+	close(go[1]);
+
+	for (i = 0; i < writers; i++) {
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "rzs_bench: writer failed\n");
+			exit(1);
+		}
+		if (elapsed[i] > slowest)
+			slowest = elapsed[i];
+		bytes += (double)pages * PAGE_SZ;
+	}
+	close(ready[0]);
+	close(ready[1]);
+	close(go[0]);
+	return bytes / slowest / (1024 * 1024);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d device] [-n max_writers] "
+		"[-s megabytes_per_writer]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_writers = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long megs = 16, pages;
+	uint64_t disksize;
+	double rate, base = 0;
+	double *elapsed;
+	int writers;
+	int fd, c;
+
+	while ((c = getopt(argc, argv, "d:n:s:")) != -1) {
+		switch (c) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'n':
+			max_writers = atoi(optarg);
+			break;
+		case 's':
+			megs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_writers < 1 || max_writers > MAX_WRITERS || !megs)
+		usage(argv[0]);
+	pages = megs * 1024 * 1024 / PAGE_SZ;
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0)
+		die(dev);
+	if (ioctl(fd, BLKGETSIZE64, &disksize) < 0)
+		die("BLKGETSIZE64");
+	close(fd);
+	if ((1 + max_writers * pages) * PAGE_SZ > disksize) {
+		fprintf(stderr, "rzs_bench: %s is too small for %d writers of "
+			"%lu MB\n", dev, max_writers, megs);
+		exit(1);
+	}
+
+	elapsed = mmap(NULL, sizeof(*elapsed) * MAX_WRITERS,
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		       -1, 0);
+	if (elapsed == MAP_FAILED)
+		die("mmap");
+
+	printf("device %s, %lu MB per writer\n", dev, megs);
+	printf("%8s %10s %12s %8s\n", "writers", "MB/s", "MB/s/writer",
+	       "scaling");
+	for (writers = 1; ; writers *= 2) {
+		if (writers > max_writers)
+			writers = max_writers;
+		rate = run_step(elapsed, writers, pages);
+		if (!base)
+			base = rate;
+		printf("%8d %10.1f %12.1f %7.2fx\n", writers, rate,
+		       rate / writers, rate / base);
+		fflush(stdout);
+		if (writers == max_writers)
+			break;
+	}
+	return 0;
+}